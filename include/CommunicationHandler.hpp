@@ -1,17 +1,66 @@
 #ifndef SPHERO_RVR_SERVER_CPP_COMMHANDLER_HPP
 #define SPHERO_RVR_SERVER_CPP_COMMHANDLER_HPP
 
-#include "simple_socket/TCPSocket.hpp"
+#include "TcpListener.hpp"
+#include "UdpSocket.hpp"
 #include "Message.hpp"
+#include "FrameBuffer.hpp"
+#include "BufferPool.hpp"
+#include "Mailbox.hpp"
+#include "SpscQueue.hpp"
+#include "Notifier.hpp"
+#include "DatagramReassembler.hpp"
+#include "Latency.hpp"
 #include <vector>
+#include <chrono>
 #include <thread>
 #include <queue>
-#include <condition_variable>
+#include <array>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
 
 #define CAMERA_WIDTH 320.0
 #define CAMERA_HEIGHT 240.0
 
-using namespace simple_socket;
+/**
+ * @brief Counters describing the cost of the receive path, for measuring syscalls and copies per frame.
+ */
+struct ReadStats {
+    uint64_t frames = 0;        ///< Number of complete frames received.
+    uint64_t readCalls = 0;     ///< Number of connection->read calls issued, or receive completions with io_uring.
+    uint64_t bytesRead = 0;     ///< Total bytes returned by those calls.
+    uint64_t bytesCopied = 0;   ///< Payload bytes copied from the header buffer into frame buffers.
+};
+
+/**
+ * @brief Counters describing messages the inbound queues discarded under their drop policies.
+ */
+struct QueueStats {
+    uint64_t dropped = 0;       ///< Messages evicted by a newer one under DROP_OLDEST.
+    uint64_t coalesced = 0;     ///< Messages replaced in place by a newer one under COALESCE.
+    uint64_t overflowed = 0;    ///< Messages dropped on arrival because the consumer had fallen too far behind.
+};
+
+/**
+ * @brief Counters describing camera frames received over UDP.
+ */
+struct DatagramStats {
+    uint64_t datagrams = 0;     ///< Datagrams received on the image port.
+    uint64_t frames = 0;        ///< Frames completed from them.
+    uint64_t discarded = 0;     ///< Frames dropped incomplete, because a newer one completed or the deadline passed.
+    uint64_t unknown = 0;       ///< Datagrams dropped unread, because no robot is connected from the sender's address
+                                ///< or as many robots as the handler reassembles for already send images.
+};
+
+/**
+ * @brief Mechanism the event loop uses to receive data from the robots.
+ */
+enum class ReceiveBackend {
+    EPOLL,      ///< Readiness notifications, one read() per available chunk of data. Always available.
+    IO_URING    ///< Multishot receives into a kernel-registered buffer ring (Linux, built with USE_IO_URING).
+};
 
 /**
  * @class CommunicationHandler
@@ -40,6 +89,11 @@ using namespace simple_socket;
  *    COMMAND = 1;
  *   }
  *
+ *   message Timestamps { ... }     // see Timestamps and protobuf/Image.proto
+ *   enum ImageEncoding { ... }     // see ImageEncoding
+ *   enum Compression { ... }       // see ImageCompression
+ *   message ImageTile { ... }      // see ImageTile
+ *
  *   MessageType type = 1;
  *   bytes image = 2;
  *   uint32 speed = 3;
@@ -47,18 +101,183 @@ using namespace simple_socket;
  *   uint32 battery_percentage=5;
  *   repeated Direction directions = 6;
  *   repeated Direction camera_directions = 7;
+ *   uint64 frame_id = 8;
+ *   Timestamps timestamps = 9;
+ *   ImageEncoding image_encoding = 10;
+ *   Compression image_compression = 11;
+ *   uint32 image_width = 12;
+ *   uint32 image_height = 13;
+ *   repeated ImageTile image_tiles = 14;   // see Message::getImageTiles()
+ *   uint64 base_frame_id = 15;
  * }
  * ```
  * Any message not conforming to this Protocol Buffers schema will be disregarded or may cause parsing errors.
+ *
+ * ## Sessions
+ * Any number of robots may be connected at the same time. Each connection is a session with its own id,
+ * reassembly state, inbound queue and outbound queue; all of them are served by a single epoll event loop.
+ * Received messages carry the id of the session they came from, and messages passed to write() are sent to
+ * the session named by their session id (or to every session if the id is 0).
+ *
+ * ## Lanes
+ * CONTROL messages (commands, telemetry) take priority over BULK messages (camera frames), see Lane. Inbound,
+ * they are dequeued first. Outbound, BULK messages are cut into chunks of at most chunkSize bytes, so a
+ * command never waits for more than one chunk. A chunk is a frame whose length prefix has
+ * FrameBuffer::chunkFlag set; its payload starts with one byte holding the lane and, on the last chunk of a
+ * message, finalChunk. Robots may send chunks the same way. The server only sends chunks to robots that have
+ * sent chunks themselves; other robots receive whole frames.
+ *
+ * ## Byte order
+ * Robots write length prefixes in network byte order. The first robots read the server's prefixes in host
+ * byte order, though, so that is what every robot receives unless it sets FrameBuffer::networkOrderFlag in
+ * the prefix of a frame it sends, preferably its first one; from then on its prefixes are in network byte
+ * order as well.
+ *
+ * ## Threading
+ * Received messages are handed from the event loop to the consumer through a lock-free single-producer/
+ * single-consumer queue. Message retrieval (getLatestMessage(), hasMessages(), waitForMessages(),
+ * setQueuePolicy()) must therefore happen on one consumer thread at a time; write() may be called from any thread.
+ *
+ * ## Compact commands
+ * A COMMAND that carries nothing but a speed and directions fits in a compact 4-byte payload instead of a
+ * ProtoMessage, 8 bytes on the wire with its length prefix (see Message::isCompactFrame()). Both encodings may
+ * be mixed on one connection. The server only sends compact commands to robots that have sent one themselves,
+ * e.g. an empty command right after connecting; other robots receive ProtoMessages. Such a robot receives the
+ * commands derived from its frames compact as well, without the frame id and timestamps they would echo (see
+ * Latency): it trades the latency breakdown for the smaller frames it asked for.
+ *
+ * ## Batches
+ * A batch frame carries several messages in one length-prefixed frame (see Message::batchTag), so a robot
+ * reporting telemetry or sending commands pays one prefix and one write per batch rather than per message.
+ * The messages of a received batch are handed to the consumer together, with a single wakeup. With
+ * setBatching(), the server batches CONTROL messages to robots that have sent a batch themselves.
+ *
+ * ## Image datagrams
+ * TCP delivers in order, so one lost segment holds up every later camera frame. If an image port is given,
+ * robots may instead send IMAGE messages over UDP, split into datagrams as described in DatagramReassembler.
+ * A frame that is not complete within imageDeadline, or that is overtaken by a newer complete frame, is
+ * dropped. Datagrams are attributed to the session connected from the same address (the lowest id if
+ * several are) before they are reassembled; datagrams from an address no robot is connected from are dropped
+ * unread, so a stranger can neither feed the detector nor make the handler hold partial frames. At most
+ * maxImageStreams sessions have frames reassembled at a time, and a session's partial frames go with it. COMMAND traffic stays on TCP in both directions.
+ *
+ * ## Latency
+ * Robots number their camera frames (frame_id) and stamp them with their capture and send times. The handler
+ * adds when a frame was received and decoded, the consumer when detection finished, and sendMessage() when the
+ * command derived from the frame was sent; the command carries the frame's id and timestamps back to the robot.
+ * Robot and server clocks are compared per session with a ClockOffsetEstimator, see getClockOffset(), so
+ * LatencyBreakdown can report the glass-to-wheel latency of every command.
+ *
+ * ## Receive backends
+ * By default sessions are read with non-blocking read() calls whenever epoll reports them readable. With
+ * ReceiveBackend::IO_URING, each session instead has one multishot receive in flight that the kernel completes
+ * into buffers from a registered buffer ring, so a busy robot costs no readiness round trip and no read() call
+ * per chunk of data. Accepting, writing and shutdown still go through the epoll set, which the ring watches.
+ * If io_uring support was not built in or the kernel refuses it, the handler falls back to epoll.
+ *
+ * Inbound queues are bounded per message type (see setQueuePolicy()). By default only the newest IMAGE of
+ * each session is kept, so a slow detector always works on the latest frame, while COMMAND messages are
+ * never dropped. The policies are applied whenever the consumer retrieves messages; a consumer that stops
+ * retrieving them altogether leaves them in a handoff queue of fixed size, and once that is full, new messages
+ * of any type are dropped on arrival (see QueueStats::overflowed) rather than piling up in memory.
  */
 class CommunicationHandler {
 private:
-    TCPServer server;                               ///< The TCP server instance used for accepting connections.
-    std::unique_ptr<SimpleConnection> connection;   ///< The active connection with the client.
-    std::jthread connectionThread;                  ///< Thread for handling incoming connections.
+    /**
+     * @brief State of one connected robot.
+     */
+    struct Session {
+        uint32_t id;
+        std::unique_ptr<TcpConnection> connection;
+        uint32_t peerAddress = 0;                   ///< IPv4 address of the robot, for matching its datagrams.
+        FrameBuffer receiveBuffer;                  ///< Reassembles length-prefixed frames. Event loop only.
+        BufferPool::Buffer pendingFrame;            ///< Exact-size buffer for a payload spanning several reads;
+                                                    ///< handed on to the message once complete.
+        size_t pendingFilled = 0;                   ///< Bytes of pendingFrame received so far.
+        bool payloadPending = false;                ///< Whether pendingFrame is being filled.
+        bool pendingIsChunk = false;                ///< Whether pendingFrame is a chunk.
+        Message::Decoder decoder;                   ///< Reused for every frame of the session. Event loop only.
+        std::array<std::string, 2> partialMessages; ///< Chunks of a message received so far, per lane. Event loop only.
+        std::atomic<bool> peerChunks{false};        ///< Set once the robot sent a chunked frame, so it accepts them too.
+        std::atomic<bool> peerCompact{false};       ///< Set once the robot sent a compact command, so it accepts them too.
+        std::atomic<bool> peerBatches{false};       ///< Set once the robot sent a batch frame, so it accepts them too.
+        std::atomic<bool> peerNetworkOrder{false};  ///< Set once the robot announced it reads network-order prefixes.
+        ClockOffsetEstimator clock;                 ///< Robot clock offset from the frames' timestamps. Event loop only.
+        std::atomic<int64_t> clockOffset{unknownClockOffset}; ///< Latest clock.offset(), readable from any thread.
+        std::mutex writeMtx;                        ///< Guards the fields below and writes to the connection.
+        std::string sendBuffer;                     ///< Reusable buffer holding the serialized outgoing frame.
+        std::string current;                        ///< Frame on the wire, in the robot's byte order; finished before the next.
+        size_t currentOffset = 0;                   ///< Bytes of current already sent.
+        std::deque<std::string> controlOutbound;    ///< Complete CONTROL frames waiting for the socket, as Message writes them.
+        std::deque<std::string> bulkOutbound;       ///< Serialized BULK messages, cut into chunks as they are sent.
+        size_t bulkOffset = 0;                      ///< Bytes of bulkOutbound.front() already sent.
+        std::string batch;                          ///< Batch frame collecting CONTROL messages; empty if none is open.
+        std::chrono::steady_clock::time_point batchDeadline; ///< When the open batch is sent at the latest.
+    };
+
+    struct IoUring;
+
+    /**
+     * @brief Releases the io_uring state; defined next to it so the type can stay incomplete here.
+     */
+    struct IoUringDeleter {
+        void operator()(IoUring *ring) const;
+    };
+
+    static constexpr int64_t unknownClockOffset = INT64_MIN;
+    static constexpr size_t chunkSize = 16 * 1024;  ///< Payload bytes per chunk of a BULK message.
+    static constexpr uint8_t finalChunk = 0x80;     ///< Set in a chunk's lane byte on the last chunk of a message.
+    static constexpr size_t maxPayloadSize = 16 * 1024 * 1024; ///< Longest message accepted; a longer length
+                                                               ///< prefix closes the session.
+
+    TcpListener server;                             ///< The TCP server instance used for accepting connections.
+    int epollFd = -1;                               ///< Event loop descriptor watching the listener and all sessions.
+    int wakeFd = -1;                                ///< eventfd used to wake the event loop on shutdown.
+    int batchTimerFd = -1;                          ///< timerfd firing when the earliest open batch is due.
+    ReceiveBackend backend;                         ///< The receive backend in use.
+    std::unique_ptr<IoUring, IoUringDeleter> uring; ///< Ring state, only set for ReceiveBackend::IO_URING.
+    std::jthread connectionThread;                  ///< Thread running the event loop.
     std::atomic<bool> isRunning{true};              ///< Flag to indicate whether the thread is active.
-    std::queue<Message> messageQueue;               ///< Queue for storing received messages.
-    std::mutex mtx;                                 ///< Mutex for synchronizing access to the message queue.
+    std::map<uint32_t, std::shared_ptr<Session>> sessions; ///< Connected sessions by id, guarded by mtx.
+    uint32_t nextSessionId = 1;
+    std::mutex mtx;                                 ///< Mutex for synchronizing access to the sessions.
+
+    std::unique_ptr<UdpSocket> imageSocket;         ///< Receives IMAGE datagrams, if an image port was given.
+    std::map<uint32_t, DatagramReassembler> imageStreams; ///< Reassembly per session sending images. Event loop only.
+    static constexpr size_t maxImageStreams = 64;   ///< Most sessions whose images are reassembled at once.
+    std::vector<unsigned char> datagramBuffer;      ///< Receive buffer for one datagram. Event loop only.
+    Message::Decoder datagramDecoder;               ///< Decodes frames completed from datagrams. Event loop only.
+    const std::chrono::milliseconds imageDeadline{100}; ///< How long an incomplete image frame is waited for.
+
+    SpscQueue<Message> received{1024};              ///< Lock-free handoff from the event loop to the consumer.
+    Notifier receivedNotifier;                      ///< Wakes a consumer blocked in waitForMessages().
+
+    // Consumer side, only touched by the thread retrieving messages
+    std::map<uint32_t, Mailbox> inboxes;            ///< Inbound queue per session, applying the drop policies.
+    size_t queuedMessages = 0;                      ///< Total number of messages in all inboxes.
+    uint32_t lastServedSession = 0;                 ///< Session getLatestMessage() took a message from last.
+    Mailbox::Policies queuePolicies = Mailbox::defaultPolicies(); ///< Drop policies for new inboxes.
+    BufferPool framePool;                           ///< Exact-size buffers for payloads that span several reads.
+    const size_t headerReadSize = 1024;             ///< Read size used while waiting for a length prefix.
+    std::atomic<bool> lowLatency;                   ///< Whether connections disable Nagle's algorithm.
+    std::vector<Message> decodedFrame;              ///< Messages of the frame being enqueued. Event loop only.
+
+    std::atomic<size_t> batchBytes{0};              ///< Size at which an open batch is sent, see setBatching().
+    std::atomic<int64_t> batchDelayMicros{0};       ///< Time after which an open batch is sent; 0 disables batching.
+    std::mutex batchTimerMtx;                       ///< Guards batchTimerDeadline and arming batchTimerFd.
+    std::chrono::steady_clock::time_point batchTimerDeadline = std::chrono::steady_clock::time_point::max();
+
+    std::atomic<uint64_t> framesReceived{0};
+    std::atomic<uint64_t> readCalls{0};
+    std::atomic<uint64_t> bytesRead{0};
+    std::atomic<uint64_t> bytesCopied{0};
+    std::atomic<uint64_t> messagesDropped{0};
+    std::atomic<uint64_t> messagesCoalesced{0};
+    std::atomic<uint64_t> messagesOverflowed{0};
+    std::atomic<uint64_t> datagramsReceived{0};
+    std::atomic<uint64_t> datagramFrames{0};
+    std::atomic<uint64_t> datagramFramesDiscarded{0};
+    std::atomic<uint64_t> datagramsUnknown{0};
 
     const float cameraWidth = CAMERA_WIDTH;
     const float cameraHeight = CAMERA_HEIGHT;
@@ -66,57 +285,244 @@ private:
 
 
     /**
-     * @brief Handles incoming client connections and assigns them to the connection thread.
+     * @brief Waits for socket events and dispatches them until the handler is closed.
+     *        This method is executed within the connection thread.
      */
-    void handleConnection();
+    void eventLoop();
+
     /**
-     * @brief Reads data from the connected client, processes it, and enqueues parsed messages.
-     *        This method is executed within the connection thread.
+     * @brief Dispatches the events epoll reports within timeoutMs.
+     *
+     * @return False if waiting for events failed.
      */
-    void read();
+    bool handleEvents(int timeoutMs);
 
     /**
-     * @brief Closes the connection and stops the thread.
+     * @brief Event mask a session is registered with in the epoll set, apart from writability.
      */
-    void close();
+    uint32_t sessionEvents() const;
+
+    /**
+     * @brief Sets up the io_uring ring and its buffer ring.
+     *
+     * @return False if io_uring is not built in or not usable on this kernel.
+     */
+    bool startIoUring();
+
+    /**
+     * @brief Completes io_uring receives until the handler is closed; epoll events are dispatched whenever
+     *        the ring reports the epoll set readable. Used instead of eventLoop() for ReceiveBackend::IO_URING.
+     */
+    void ioUringLoop();
+
+    /**
+     * @brief Queues a multishot receive for a session on the ring. Event loop only.
+     */
+    void armReceive(const Session &session);
+
+    /**
+     * @brief Accepts every pending client and registers it as a new session.
+     */
+    void acceptSessions();
+
+    /**
+     * @brief Reads everything available from a session's socket, processes it, and enqueues parsed messages.
+     *
+     * @return False if the connection was closed by the peer or failed.
+     */
+    bool readSession(Session &session);
+
+    /**
+     * @brief Feeds bytes received by the io_uring backend into a session's reassembly state.
+     */
+    void consume(Session &session, const unsigned char *data, size_t size);
+
+    /**
+     * @brief Handles every complete frame in the session's receive buffer and, if the next frame is only partly
+     *        there, moves it into an exact-size payload buffer.
+     *
+     * @return True if a payload buffer was started.
+     * @throws std::runtime_error if the next frame is longer than maxPayloadSize.
+     */
+    bool processBuffered(Session &session);
+
+    /**
+     * @brief Handles the pending payload if it has been received completely.
+     */
+    void completePayload(Session &session);
+
+    /**
+     * @brief Reads every waiting datagram from the image socket and enqueues the frames they complete.
+     */
+    void readDatagrams();
+
+    /**
+     * @brief Returns the session connected from the given address, or nullptr if there is none.
+     */
+    std::shared_ptr<Session> sessionFor(uint32_t address);
+
+    /**
+     * @brief Handles a complete frame: enqueues a whole message, or collects a chunk until its message is complete.
+     */
+    void receiveFrame(Session &session, std::string_view payload, bool chunk);
+
+    /**
+     * @brief Sends as much of a session's outbound queues as the socket accepts, from the event loop.
+     *
+     * @return False if the connection failed.
+     */
+    bool flushSession(Session &session);
+
+    /**
+     * @brief Sends as much as the socket accepts, CONTROL frames first. The caller holds the session's writeMtx.
+     *
+     * @return False if the connection failed.
+     */
+    bool flushLocked(Session &session);
+
+    /**
+     * @brief Moves the next frame to send into session.current: a CONTROL frame if any is waiting, otherwise
+     *        the next chunk (or whole frame) of the oldest BULK message.
+     *
+     * @return False if nothing is waiting.
+     */
+    bool nextOutboundFrame(Session &session);
+
+    /**
+     * @brief Serializes a message as the frame sent to a session: a compact command if the robot accepts them
+     *        and the message fits, a ProtoMessage otherwise.
+     */
+    static void toFrame(const Session &session, const Message &message, std::string &out);
+
+    /**
+     * @brief Rewrites the network-order length prefix of a frame in the byte order the session reads: as it is
+     *        if the robot announced network order, in host byte order, as the first robots read it, otherwise.
+     */
+    static void toPeerOrder(const Session &session, std::string &frame);
+
+    /**
+     * @brief Serializes a message and sends it to one session, queueing whatever the socket does not accept.
+     */
+    void send(Session &session, const Message &message);
+
+    /**
+     * @brief Adds a CONTROL message to the session's open batch, opening one if needed. The caller holds the
+     *        session's writeMtx.
+     *
+     * @return True if the batch reached batchBytes and was queued for sending.
+     */
+    bool addToBatch(Session &session, const Message &message);
+
+    /**
+     * @brief Queues the session's open batch, if any, behind the CONTROL frames waiting for the socket.
+     *        The caller holds the session's writeMtx.
+     */
+    static void closeBatch(Session &session);
+
+    /**
+     * @brief Makes batchTimerFd fire at deadline, unless it is already set to fire earlier.
+     */
+    void armBatchTimer(std::chrono::steady_clock::time_point deadline);
+
+    /**
+     * @brief Sends every open batch that is due and re-arms the timer for the others. Event loop only.
+     */
+    void sendDueBatches();
+
+    /**
+     * @brief Starts or stops watching a session's socket for writability.
+     */
+    void watchWritable(const Session &session, bool enabled);
+
+    /**
+     * @brief Closes a session's connection. The session is forgotten once its remaining messages are consumed.
+     */
+    void closeSession(uint32_t id);
+
+    /**
+     * @brief Parses a complete frame, stamps its receive and decode times and hands the resulting messages (one,
+     *        or all of a batch) to the consumer at once. Images share the frame's buffer.
+     *
+     * @param session The session the frame came from.
+     */
+    void enqueue(Message::Decoder &decoder, Session &session, const SharedBuffer &frame);
+
+    /**
+     * @brief Moves everything the event loop handed over into the per-session inboxes. Consumer thread only.
+     */
+    void drainReceived();
+
+    /**
+     * @brief Pops the oldest message of an inbox, forgetting the inbox once it is empty. Consumer thread only.
+     */
+    Message popFrom(std::map<uint32_t, Mailbox>::iterator inbox);
 
     /**
-     * @brief Converts a 32-bit integer from network byte order to host byte order.
+     * @brief Derives the moving command for an object detected in a frame, addressed to the frame's session.
      *
-     * @param net The 32-bit integer in network byte order.
-     * @return The 32-bit integer in host byte order.
+     * @return The command, or std::nullopt if the object is close enough to the center.
      */
-    uint32_t ntohl(uint32_t net);
+    std::optional<Message> commandFor(const std::vector<int> &coords, const Message &frame);
 
+    /**
+     * @brief Closes all connections and stops the thread.
+     */
+    void close();
 
 
 public:
-    unsigned int connectionCount = 0;
-    std::condition_variable cv;
+    std::atomic<unsigned int> connectionCount{0};
 
     /**
      * @brief Initializes a CommunicationHandler instance on a specified TCP port, setting up
-     *        the server and spawning a thread to handle incoming connections asynchronously.
+     *        the server and spawning a thread that serves all connected robots asynchronously.
      *
      * @param port The TCP port to bind the server for incoming connections.
+     * @param lowLatency Whether to enable low-latency mode on accepted connections, see setLowLatency().
+     * @param backend The receive backend to use; falls back to ReceiveBackend::EPOLL if it is not available.
+     * @param imagePort UDP port to receive IMAGE datagrams on, see DatagramReassembler; 0 accepts images over TCP only.
      */
-    explicit CommunicationHandler(uint16_t port);
+    explicit CommunicationHandler(uint16_t port, bool lowLatency = true, ReceiveBackend backend = ReceiveBackend::EPOLL,
+                                  uint16_t imagePort = 0);
 
     /**
-     * @brief Retrieves the latest processed message from the internal message queue.
-     *        If the queue is empty, returns an empty Message object.
+     * @brief Retrieves the oldest message of the next session that has one, visiting sessions in turn.
+     *        If no session has messages, returns an empty Message object.
      *
-     * @return The latest available message in the queue.
+     * @return The next available message.
      */
     Message getLatestMessage();
 
     /**
-     * @brief Sends a message to the connected client. If no client is connected, the message is ignored.
+     * @brief Retrieves the oldest message received from the given session.
+     *        If the session has no messages (or does not exist), returns an empty Message object.
      *
-     * @param message The message to send over the active connection.
+     * @param sessionId The session to take the message from.
+     * @return The next available message of that session.
+     */
+    Message getLatestMessage(uint32_t sessionId);
+
+    /**
+     * @brief Sends a message to the session named by its session id, or to every session if the id is 0.
+     *        The length prefix and the serialized message are sent with a single write; if the socket is
+     *        busy, the frame is queued and sent by the event loop, CONTROL frames ahead of BULK ones.
+     *        Messages for unknown sessions are ignored.
+     *
+     * @param message The message to send.
      */
     void write(const Message& message);
 
+    /**
+     * @brief Enables or disables batching of CONTROL messages to robots that send batches themselves. Messages
+     *        written to such a robot are collected into one batch frame, which is sent once it holds maxBytes
+     *        or maxDelay after its first message, whichever comes first. Disabled by default, so commands go
+     *        out immediately.
+     *
+     * @param maxBytes Frame size at which a batch is sent right away.
+     * @param maxDelay Longest time a message waits in a batch; zero disables batching.
+     */
+    void setBatching(size_t maxBytes, std::chrono::microseconds maxDelay);
+
     /**
      * @brief Checks if there are any messages in the queue.
      *
@@ -125,18 +531,81 @@ public:
     bool hasMessages() const;
 
     /**
-     * @brief Sends a moving command to the client based on the detected object's coordinates.
+     * @brief Blocks until a message is available or the timeout expires.
+     *
+     * @param timeout Maximum time to wait; a negative value waits until a message arrives or the handler closes.
+     * @return True if there are messages in the queue.
+     */
+    bool waitForMessages(std::chrono::milliseconds timeout = std::chrono::milliseconds(-1));
+
+    /**
+     * @brief Sends a moving command to a robot based on the detected object's coordinates.
      *
      * @param coords The coordinates to send to the client.
+     * @param sessionId The session the coordinates were detected in; 0 sends the command to every session.
      */
-    void sendMessage(const std::vector<int> &coords);
+    void sendMessage(const std::vector<int> &coords, uint32_t sessionId = 0);
 
     /**
-     * @brief Retrieves the mutex used for synchronizing access to the message queue.
+     * @brief Sends a moving command derived from a camera frame to the robot that sent the frame. The command
+     *        echoes the frame's id and timestamps, if it carried any, with commandSent stamped now.
      *
-     * @return The mutex used for synchronizing access to the message queue.
+     * @param coords The coordinates of the object detected in the frame.
+     * @param frame The message holding the frame.
+     * @return The command sent, for its timestamps, or std::nullopt if the object is close enough to the center
+     *         or the frame belongs to no session; such a frame's command is never sent to every session.
+     */
+    std::optional<Message> sendMessage(const std::vector<int> &coords, const Message &frame);
+
+    /**
+     * @brief Returns the estimated offset of a session's clock: server clock minus robot clock in microseconds,
+     *        see ClockOffsetEstimator.
+     *
+     * @return The offset, or std::nullopt if the session is unknown or has not sent timestamped frames yet.
+     */
+    std::optional<int64_t> getClockOffset(uint32_t sessionId);
+
+    /**
+     * @brief Returns the ids of all connected sessions.
+     *
+     * @return The ids, in ascending order.
+     */
+    std::vector<uint32_t> getSessionIds();
+
+    /**
+     * @brief Enables or disables low-latency mode (TCP_NODELAY) on the current and future connections.
+     *        Enabled by default so autopilot commands are not held back by Nagle's algorithm.
+     */
+    void setLowLatency(bool enabled);
+
+    /**
+     * @brief Sets how inbound queues treat messages of the given type, for current and future sessions.
+     *        Policies are applied as the consumer takes messages over from the event loop.
+     *
+     * @param type The message type the policy applies to.
+     * @param policy The drop policy and capacity, see DropPolicy.
+     */
+    void setQueuePolicy(Type type, QueuePolicy policy);
+
+    /**
+     * @brief Returns how many inbound messages were dropped, coalesced or lost to overflow, summed over all sessions.
+     */
+    QueueStats getQueueStats() const;
+
+    /**
+     * @brief Returns a snapshot of the receive path counters, summed over all sessions.
+     */
+    ReadStats getReadStats() const;
+
+    /**
+     * @brief Returns a snapshot of the UDP image counters, summed over all senders.
+     */
+    DatagramStats getDatagramStats() const;
+
+    /**
+     * @brief Returns the receive backend actually in use, which may differ from the requested one.
      */
-    std::mutex &getMtx();
+    ReceiveBackend getBackend() const;
 
     ~CommunicationHandler();
 };
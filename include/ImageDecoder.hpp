@@ -0,0 +1,78 @@
+#ifndef RVR_SERVER_IMAGEDECODER_HPP
+#define RVR_SERVER_IMAGEDECODER_HPP
+
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "Message.hpp"
+
+/**
+ * @class ImageDecoder
+ * @brief Turns the image of a received message into the BGR cv::Mat the object detector takes.
+ *
+ * JPEG images are decoded with cv::imdecode. Raw images (see ImageEncoding) skip decoding: the Mat is mapped
+ * straight onto the pixels, inside the frame they were received in or, if they were compressed, inside the
+ * decompression buffer. BGR images are used as they are, so the Mat decode() returns must not be written to;
+ * GRAY and YUV420 ones are converted to BGR into a buffer reused across calls.
+ *
+ * Messages with tiles (see Message::getImageTiles()) update a frame kept per session. A keyframe's tiles are
+ * drawn on a black frame that is kept as well; every later update is applied to it: parts of the frame the
+ * previous update had changed are restored from the keyframe unless the update changes them again, and tiles
+ * whose bytes equal those of the previous update are neither decoded nor copied. An update whose keyframe is
+ * not the session's current one, e.g. because the keyframe was dropped, is rejected like a broken image until
+ * the next keyframe arrives. changedRegion() tells which part of the frame an update actually changed.
+ */
+class ImageDecoder {
+private:
+    static constexpr uint32_t maxDimension = 16384;
+    static constexpr size_t maxCanvases = 16;
+
+    /**
+     * @brief The frame of one session rebuilt from tile updates.
+     */
+    struct Canvas {
+        uint64_t keyframeId = 0;
+        cv::Mat keyframe;               ///< The keyframe the session's updates apply to.
+        cv::Mat frame;                  ///< The keyframe with the tiles of the last update.
+        std::vector<ImageTile> applied; ///< Tiles of the last update, holding on to their bytes.
+    };
+
+    ImageCodec codec;
+    SharedBuffer pixels;    ///< Keeps the pixels of the last mapped image alive.
+    cv::Mat converted;      ///< Reused target of colour conversions.
+    cv::Rect changed;       ///< Region of the last image that differs from the session's previous one.
+
+    std::map<uint32_t, Canvas> canvases;            ///< Per session; the oldest sessions are evicted first.
+    std::vector<cv::Mat> decodedTiles;              ///< Tiles of the update being applied, decoded.
+    std::vector<bool> unchangedTiles;               ///< Which tiles of that update the previous one sent as well.
+    std::vector<bool> repeatedTiles;                ///< Which tiles of the previous update that one sends again.
+    std::unordered_map<uint64_t, size_t> applied;   ///< Tiles of the previous update by position.
+    cv::Mat output;                                 ///< Copy of a rebuilt frame handed to the caller.
+
+    cv::Mat decodeImage(const SharedBuffer &image, const ImageFormat &format);
+
+    cv::Mat applyTiles(const Message &message);
+
+public:
+    /**
+     * @brief Returns the message's image as a BGR image.
+     *
+     * @return The image, valid until the next call. A raw BGR image is mapped onto the pixels received, which
+     *         are shared and immutable, so it is read-only and must be cloned to draw into it; any other image
+     *         is the decoder's own, which the caller may draw into. Empty if the message has no image or the
+     *         image is malformed, like cv::imdecode.
+     */
+    cv::Mat decode(const Message &message);
+
+    /**
+     * @brief Bounding box of the part of the last decoded image that changed since the previous image of its
+     *        session: the whole image unless it was a tile update, empty if the update changed nothing.
+     */
+    cv::Rect changedRegion() const {
+        return changed;
+    }
+};
+
+#endif //RVR_SERVER_IMAGEDECODER_HPP
@@ -2,10 +2,11 @@
 #define RVR_SERVER_KEYHANDLER_CPP_H
 
 #include <thread>
-#include <queue>
+#include <chrono>
 #include <ncurses.h>
-#include <condition_variable>
 #include "../src/util/Message.hpp"
+#include "../src/util/SpscQueue.hpp"
+#include "../src/util/Notifier.hpp"
 
 class KeyListener {
 private:
@@ -15,9 +16,9 @@ private:
     uint8_t speed = 50;
     std::jthread keyDetectionThread;
     std::atomic<bool> isRunning{true};
-    std::queue<Message> messageQueue;
-    std::queue<char> keyQueue;
-    std::mutex mtx;
+    SpscQueue<Message> messageQueue{64};
+    SpscQueue<char> keyQueue{64};
+    Notifier notifier;
 
     void detectKeys();
 
@@ -25,10 +26,6 @@ private:
 
     void close();
 public:
-    std::condition_variable cv;
-
-    std::mutex &getMtx();
-
     KeyListener();
 
     Message getMessage();
@@ -37,6 +34,14 @@ public:
 
     bool hasMessages() const;
 
+    /**
+     * @brief Blocks until a key press is available or the listener stops.
+     *
+     * @param timeout Maximum time to wait; a negative value waits indefinitely.
+     * @return True if there are messages available.
+     */
+    bool waitForMessages(std::chrono::milliseconds timeout = std::chrono::milliseconds(-1));
+
     bool running() const;
 
     ~KeyListener();
@@ -2,30 +2,165 @@
 #ifndef RVR_SERVER_OBJECTDETECTOR_HPP
 #define RVR_SERVER_OBJECTDETECTOR_HPP
 
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <opencv2/opencv.hpp>
 #include <opencv2/dnn.hpp>
 #include <fstream>
 #include <vector>
+#include "YoloDecode.hpp"
 
 using namespace cv;
 using namespace dnn;
 
+/**
+ * @brief An object found in a frame, in the frame's pixel coordinates.
+ */
+struct Detection {
+    int classId;
+    float confidence;
+    Rect box;
+};
+
+/**
+ * @brief What was detected in the previous frame of one camera, so that parts of the next frame that did not
+ *        change need no inference, see ObjectDetector::detectObjects().
+ */
+struct DetectionCache {
+    Size frameSize;
+    std::vector<Detection> detections;  ///< Most confident first.
+};
+
+/**
+ * @class ObjectDetector
+ * @brief Finds objects in camera frames with a YOLO network.
+ *
+ * Thread-safe. Frames that several threads detect at the same time, e.g. those of different robots, are run
+ * through the network together as one batch (see setBatching()), which costs less per frame than running them
+ * one by one; each thread gets the objects in its own frame back.
+ */
 class ObjectDetector {
 private:
+    static constexpr int regionMargin = 32;         ///< Context around a changed region, in pixels.
+    static constexpr double maxRegionShare = 0.5;   ///< Larger regions are not worth a partial inference.
+    static constexpr int inputStride = 32;          ///< YOLO input sizes are multiples of this.
+
+    /**
+     * @brief Where an image was placed in the network input: scaled by scale, its top left corner at offset.
+     */
+    struct Letterbox {
+        double scale;
+        Point offset;
+    };
+
+    /**
+     * @brief An image waiting for, or taking part in, a batch.
+     */
+    struct Request {
+        const Mat &image;
+        std::chrono::steady_clock::time_point submitted;
+        std::vector<Detection> detections;
+        std::exception_ptr error;
+        bool done = false;
+    };
+
     std::vector<std::string> classNames;
+    std::unordered_map<std::string, int> classIds;
+    std::vector<int> targetClasses;             ///< Only classes detected; empty for all of them.
+    Size inputSize;
     Net net;
+    std::vector<std::string> outputNames;
+    std::mutex netMtx;                          ///< The network runs one batch at a time.
+
+    std::mutex batchMtx;
+    std::condition_variable batchChanged;
+    std::vector<Request *> pending;             ///< Submitted images not yet taken into a batch, oldest first.
+    bool busy = false;                          ///< Whether a caller is collecting or running a batch.
+    size_t maxBatch = 1;
+    std::chrono::microseconds maxWait{0};
+
+    std::vector<Detection> infer(const Mat &image);
+
+    Letterbox letterbox(const Mat &image, Mat &input) const;
+
+    std::vector<Detection> collect(const std::vector<Mat> &outs, size_t index, size_t batchSize,
+                                   const Letterbox &placement, yolo::Candidates &candidates);
+
+    Rect regionToInfer(const Size &frameSize, const Rect &changed, const std::vector<Detection> &previous);
+
+    Mat report(Mat frame, const std::vector<Detection> &detections, std::vector<int> &coords, const std::string &objectName);
 
     std::vector<std::string> getClassNames(const std::string &classFilePath);
 
-    const std::vector<std::string> &getOutputsNames(const Net& net);
+    std::vector<std::string> getOutputsNames(const Net& net);
 
     void drawPred(int classId, float conf, int left, int top, int right, int bottom, Mat &frame,const std::vector<std::string> &classNames);
 
     std::string formatFloat(float value);
 public:
-    ObjectDetector(std::string modelConfigurationPath, std::string modelWeightsPath, std::string classesFilePath);
+    /**
+     * @param inputSize Resolution the network runs at. Frames are scaled to fit it without distortion and the
+     *        rest is padded, so a size of the camera's aspect ratio wastes the least; smaller sizes are faster
+     *        but find less. Both sides must be multiples of 32.
+     * @throws std::invalid_argument if inputSize is not a valid network input.
+     */
+    ObjectDetector(std::string modelConfigurationPath, std::string modelWeightsPath, std::string classesFilePath,
+                   Size inputSize = Size(416, 416));
+
+    Size getInputSize() const {
+        return inputSize;
+    }
+
+    /**
+     * @brief Sets how concurrent detections are batched.
+     *
+     * Images submitted while a batch runs wait for it to finish and then go through the network together. The
+     * first caller to find the network free waits until maxBatch images are submitted or the oldest of them has
+     * waited maxWait, then runs them as one batch; the other callers only wait for their results. A batch of 1,
+     * the default, runs every image on its own as soon as the network is free.
+     *
+     * @param maxBatch Most images per batch; at least 1.
+     * @param maxWait Longest an image waits for others to join its batch.
+     */
+    void setBatching(size_t maxBatch, std::chrono::microseconds maxWait);
+
+    /**
+     * @brief Detects only the named classes from now on, e.g. the one the autopilot steers towards.
+     *
+     * Only these classes are scored and suppressed, so a box is found as one of them even where another class
+     * scores better; nothing else is reported or drawn. Set once, before frames are detected.
+     *
+     * @param names Names from the classes file; none to detect every class again.
+     * @throws std::invalid_argument if a name is not in the classes file.
+     */
+    void setTargetClasses(const std::vector<std::string> &names);
+
+    /**
+     * @brief Runs the network on several images at once.
+     *
+     * @return The objects in each image, most confident first, in the image's coordinates.
+     */
+    std::vector<std::vector<Detection>> detect(const std::vector<Mat> &images);
+
     Mat detectObjects(Mat frame, std::vector<int>& coords, const std::string &objectName);
+
+    /**
+     * @brief Detects objects in a frame of which only a part changed since the previous frame of its camera.
+     *
+     * Detections of the previous frame are kept where the frame did not change. The changed region, widened
+     * by some context and by the previous objects reaching into it, is detected on its own; only if it is
+     * large, or the cache holds no frame of the same size, is the whole frame detected. Nothing is detected if
+     * nothing changed.
+     *
+     * @param changed Bounding box of the changed pixels, see ImageDecoder::changedRegion().
+     * @param cache Detections of the camera's previous frame; updated to those of this frame.
+     */
+    Mat detectObjects(Mat frame, std::vector<int>& coords, const std::string &objectName, const Rect &changed,
+                      DetectionCache &cache);
 };
 
 #endif //RVR_SERVER_OBJECTDETECTOR_HPP
@@ -0,0 +1,121 @@
+#ifndef RVR_SERVER_TCPLISTENER_HPP
+#define RVR_SERVER_TCPLISTENER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+/**
+ * @class TcpConnection
+ * @brief A connected TCP socket. Exposes the same read/write calls as SimpleSocket's SimpleConnection
+ *        plus the socket options the server needs for latency-critical traffic.
+ */
+class TcpConnection {
+private:
+    std::atomic<int> fd;
+
+public:
+    explicit TcpConnection(int fd);
+
+    TcpConnection(const TcpConnection &) = delete;
+    TcpConnection &operator=(const TcpConnection &) = delete;
+
+    /**
+     * @brief Reads up to size bytes into buffer.
+     *
+     * @return The number of bytes read, 0 if the peer closed the connection or -1 on error.
+     */
+    int read(unsigned char *buffer, size_t size);
+
+    /**
+     * @brief Writes all size bytes of data, retrying on partial writes.
+     *
+     * @return False if the connection failed before everything was written.
+     */
+    bool write(const unsigned char *data, size_t size);
+
+    /**
+     * @brief Writes as much of data as the socket accepts without blocking.
+     *
+     * @return The number of bytes written, 0 if the socket is not writable right now, or -1 on error.
+     */
+    int writeSome(const unsigned char *data, size_t size);
+
+    /**
+     * @brief Switches the socket between blocking and non-blocking mode. In non-blocking mode read() returns -1
+     *        with errno set to EAGAIN when no data is available.
+     */
+    void setNonBlocking(bool enabled);
+
+    /**
+     * @brief Enables or disables low-latency mode: disables Nagle's algorithm (TCP_NODELAY) and, where
+     *        supported, delayed acknowledgements (TCP_QUICKACK), so small frames leave immediately.
+     */
+    void setLowLatency(bool enabled);
+
+    /**
+     * @brief Returns the peer's IPv4 address in host byte order, or 0 if it is unknown.
+     */
+    uint32_t peerAddress() const;
+
+    /**
+     * @brief Returns the underlying socket descriptor, or -1 once closed.
+     */
+    int nativeHandle() const;
+
+    /**
+     * @brief Shuts the socket down, waking up any thread blocked in read(), and releases it.
+     */
+    void close();
+
+    ~TcpConnection();
+};
+
+/**
+ * @class TcpListener
+ * @brief A listening TCP socket bound to all interfaces.
+ */
+class TcpListener {
+private:
+    std::atomic<int> fd;
+
+public:
+    /**
+     * @brief Binds to the given port and starts listening.
+     *
+     * @param port The TCP port to listen on.
+     * @param backlog Maximum number of pending connections.
+     * @throws std::runtime_error if the socket cannot be created or bound.
+     */
+    TcpListener(uint16_t port, int backlog);
+
+    TcpListener(const TcpListener &) = delete;
+    TcpListener &operator=(const TcpListener &) = delete;
+
+    /**
+     * @brief Blocks until a client connects.
+     *
+     * @return The new connection, or nullptr if the listener was closed (or, in non-blocking mode,
+     *         if no client is waiting).
+     */
+    std::unique_ptr<TcpConnection> accept();
+
+    /**
+     * @brief Switches the listening socket between blocking and non-blocking accept().
+     */
+    void setNonBlocking(bool enabled);
+
+    /**
+     * @brief Returns the underlying socket descriptor, or -1 once closed.
+     */
+    int nativeHandle() const;
+
+    /**
+     * @brief Stops listening, waking up any thread blocked in accept().
+     */
+    void close();
+
+    ~TcpListener();
+};
+
+#endif //RVR_SERVER_TCPLISTENER_HPP
@@ -0,0 +1,60 @@
+#ifndef RVR_SERVER_UDPSOCKET_HPP
+#define RVR_SERVER_UDPSOCKET_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/**
+ * @class UdpSocket
+ * @brief A non-blocking IPv4 UDP socket, used for traffic where a late datagram is better dropped than waited for.
+ */
+class UdpSocket {
+private:
+    std::atomic<int> fd;
+
+public:
+    /**
+     * @brief Binds to the given port on all interfaces.
+     *
+     * @param port The UDP port to bind; 0 picks any free port (e.g. for a sender).
+     * @param receiveBufferSize Requested kernel receive buffer in bytes, so bursts of datagrams are not dropped
+     *        while the event loop is busy; 0 keeps the system default.
+     * @throws std::runtime_error if the socket cannot be created or bound.
+     */
+    explicit UdpSocket(uint16_t port = 0, int receiveBufferSize = 0);
+
+    UdpSocket(const UdpSocket &) = delete;
+    UdpSocket &operator=(const UdpSocket &) = delete;
+
+    /**
+     * @brief Receives one datagram without blocking.
+     *
+     * @param buffer Destination; a datagram longer than size is truncated.
+     * @param size Size of buffer.
+     * @param sourceAddress Set to the sender's IPv4 address, in host byte order.
+     * @param sourcePort Set to the sender's port.
+     * @return The datagram length, or -1 if none is waiting (errno EAGAIN) or on error.
+     */
+    int receive(unsigned char *buffer, size_t size, uint32_t &sourceAddress, uint16_t &sourcePort);
+
+    /**
+     * @brief Sends one datagram.
+     *
+     * @param host IPv4 address of the receiver in dotted notation.
+     * @param port Port of the receiver.
+     * @return False if the datagram could not be sent.
+     */
+    bool sendTo(const unsigned char *data, size_t size, const std::string &host, uint16_t port);
+
+    /**
+     * @brief Returns the underlying socket descriptor, or -1 once closed.
+     */
+    int nativeHandle() const;
+
+    void close();
+
+    ~UdpSocket();
+};
+
+#endif //RVR_SERVER_UDPSOCKET_HPP
@@ -1,25 +1,94 @@
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include <fstream>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
 #include "include/CommunicationHandler.hpp"
 #include "src/util/Message.hpp"
+#include "src/util/Latency.hpp"
+#include "src/util/Pipeline.hpp"
 #include "include/KeyListener.hpp"
 #include "ObjectDetector.hpp"
+#include "ImageDecoder.hpp"
+
+namespace {
+    // A camera frame on its way through the pipeline
+    struct Frame {
+        Message message;
+        cv::Mat image;
+        uint64_t sequence = 0;      // per session, in the order the frames were decoded
+        std::vector<int> coords;    // center of the target object, if found
+    };
+
+    // How each stage runs, and what the queue in front of it does when the stage falls behind
+    struct PipelineConfig {
+        QueuePolicy decodeQueue{DropPolicy::DROP_OLDEST, 2};
+        size_t inferThreads = 4;                                // frames detected at once, batched together
+        size_t inferBatch = 4;                                  // see ObjectDetector::setBatching()
+        std::chrono::microseconds inferBatchWait{2000};
+        cv::Size inferInputSize{320, 256};                      // the 320x240 camera frame, padded; see detector_sweep
+        QueuePolicy inferQueue{DropPolicy::DROP_OLDEST, 2};     // detect recent frames rather than every frame
+        QueuePolicy controlQueue{DropPolicy::KEEP, 8};
+        QueuePolicy displayQueue{DropPolicy::DROP_OLDEST, 1};   // a slow display never holds up commands
+    };
+
+    // What is known about the camera of one session, shared by the decode stage and every inference worker
+    struct Scene {
+        static constexpr size_t maxChanges = 32;
+
+        uint64_t decoded = 0;           // sequence of the last decoded frame
+        std::deque<cv::Rect> changes;   // changed region of each of the last decoded frames, oldest first
+        uint64_t detected = 0;          // sequence of the frame the cache holds the detections of, 0 if none
+        DetectionCache cache;
+
+        // Region that differs between the cached frame and the given one, the whole frame if that is unknown.
+        // Frames in between may have been dropped or be detected by other workers, so their changes add up.
+        cv::Rect changedSince(const Frame &frame) const {
+            const cv::Rect whole(cv::Point(), frame.image.size());
+            const uint64_t from = std::min(detected, frame.sequence);
+            const uint64_t to = std::max(detected, frame.sequence);
+            if (detected == 0 || decoded - from > changes.size()) {
+                return whole;
+            }
+            cv::Rect changed;
+            for (uint64_t sequence = from + 1; sequence <= to; ++sequence) {
+                changed |= changes[changes.size() - 1 - (decoded - sequence)];
+            }
+            return changed;
+        }
+    };
+
+    template<typename T>
+    void report(Stage<T> &stage) {
+        const StageStats stats = stage.takeStats();
+        std::cout << stage.getName() << ": " << stats.fps << " FPS, wait " << stats.meanWait << " us, work "
+                  << stats.meanService << " us, max latency " << stats.maxLatency << " us, dropped "
+                  << stats.dropped << std::endl;
+    }
+}
 
 int main() {
-    CommunicationHandler server(8000);
+    const PipelineConfig config;
+    // the autopilot steers towards this object; nothing else is detected
+    const std::string targetObject = "bottle";
+    // camera frames may also arrive as UDP datagrams on port 8001
+    CommunicationHandler server(8000, true, ReceiveBackend::EPOLL, 8001);
     KeyListener keyListener;
-    ObjectDetector objectDetector(YOLO_CONFIG_PATH, YOLO_WEIGHTS_PATH, YOLO_CLASSES_PATH);
+    ObjectDetector objectDetector(YOLO_CONFIG_PATH, YOLO_WEIGHTS_PATH, YOLO_CLASSES_PATH, config.inferInputSize);
+    objectDetector.setBatching(config.inferBatch, config.inferBatchWait);
+    objectDetector.setTargetClasses({targetObject});
+    ImageDecoder imageDecoder;
+    std::unordered_map<uint32_t, Scene> scenes;                 // per session
+    std::mutex scenesMtx;                                       // guards scenes
+    std::unordered_map<uint32_t, uint64_t> latestDetected;      // per session
     std::atomic<bool> isRunning{true};
     std::atomic<bool> autoPilot{false};
     std::cout << "Server started on port 8000" << std::endl;
     // start thread to listen for key presses and send commands
     std::jthread keyListenerThread([&keyListener, &server, &isRunning, &autoPilot] {
         while (isRunning) {
-            {
-                std::unique_lock<std::mutex> lock(keyListener.getMtx());
-                keyListener.cv.wait(lock, [&] { return keyListener.hasMessages(); });
-            }
+            keyListener.waitForMessages();
             while (keyListener.hasMessages()) {
                 auto keyMessage = keyListener.getMessage();
                 auto key = keyListener.getKey();
@@ -33,45 +102,110 @@ int main() {
         }
     });
 
-    // Variables for FPS calculation
-    auto lastTime = std::chrono::high_resolution_clock::now();
-    int frameCount = 0;
-    while (isRunning) {
+    // Received frames go through decode -> infer -> control -> display, each stage on threads of its own, so
+    // frame N+1 is decoded while frame N is in inference. Stages are declared last to first, so each one is
+    // stopped before the queue it pushes into.
+    StageQueue<Frame> decodeQueue(config.decodeQueue);
+    StageQueue<Frame> inferQueue(config.inferQueue);
+    StageQueue<Frame> controlQueue(config.controlQueue);
+    StageQueue<Frame> displayQueue(config.displayQueue);
 
-        {
-            std::unique_lock<std::mutex> lock(server.getMtx());
-            server.cv.wait(lock, [&] { return server.hasMessages(); });
-        }
+    // HighGUI is only ever used from this stage's single thread
+    Stage<Frame> display("display", displayQueue, 1, [](Frame &frame, size_t) {
+        cv::imshow("Received Image", frame.image);
+        cv::waitKey(1);
+    });
 
-        // Retrieve and process messages
-        while (server.hasMessages()) {
-            Message message = server.getLatestMessage();
+    Stage<Frame> control("control", controlQueue, 1, [&](Frame &frame, size_t) {
+        // parallel inference finishes frames out of order; never steer by an older frame than before
+        uint64_t &latest = latestDetected[frame.message.getSessionId()];
+        const bool stale = frame.sequence < latest;
+        latest = std::max(latest, frame.sequence);
+        if (!stale && !frame.coords.empty() && autoPilot) {
+            auto command = server.sendMessage(frame.coords, frame.message);
+            auto clockOffset = server.getClockOffset(frame.message.getSessionId());
+            if (command && clockOffset) {
+                // glass-to-wheel latency of this frame, split into its stages
+                if (auto latency = LatencyBreakdown::of(command->getTimestamps(), *clockOffset)) {
+                    std::cout << "Frame " << command->getFrameId() << " latency (us): transfer "
+                              << latency->transfer << ", decode " << latency->decode << ", detect "
+                              << latency->detect << ", command " << latency->command << ", total "
+                              << latency->total << std::endl;
+                }
+            }
+        }
+        displayQueue.push(std::move(frame));
+    });
 
-            // Process image if available
-            if (message.getImage().has_value()) {
-                auto receivedImage = message.getImage().value();
-                std::vector<unsigned char> imageBytes(receivedImage.begin(), receivedImage.end());
-                std::vector<int> coords;
+    Stage<Frame> infer("infer", inferQueue, config.inferThreads, [&](Frame &frame, size_t) {
+        // the workers detect a session's frames in parallel, each starting from a copy of the latest detections
+        DetectionCache cache;
+        cv::Rect changed;
+        {
+            std::lock_guard<std::mutex> lock(scenesMtx);
+            const Scene &scene = scenes[frame.message.getSessionId()];
+            changed = scene.changedSince(frame);
+            cache = scene.cache;
+        }
+        // boxes are drawn into the image, which nothing else reads
+        frame.image = objectDetector.detectObjects(frame.image, frame.coords, targetObject, changed, cache);
+        {
+            std::lock_guard<std::mutex> lock(scenesMtx);
+            Scene &scene = scenes[frame.message.getSessionId()];
+            if (frame.sequence > scene.detected) {
+                scene.detected = frame.sequence;
+                scene.cache = std::move(cache);
+            }
+        }
+        Timestamps stamps = frame.message.getTimestamps();
+        stamps.detected = monotonicMicros();
+        frame.message.setTimestamps(stamps);
+        controlQueue.push(std::move(frame));
+    });
 
-                cv::Mat image = cv::imdecode(imageBytes, cv::IMREAD_COLOR);
-                cv::Mat frame = objectDetector.detectObjects(image, coords, "bottle");
-                if (!coords.empty() && autoPilot) {
-                    server.sendMessage(coords);
-                }
-                cv::imshow("Received Image", frame);
-                cv::waitKey(1);
+    Stage<Frame> decode("decode", decodeQueue, 1, [&](Frame &frame, size_t) {
+        // raw frames are mapped rather than decoded
+        cv::Mat image = imageDecoder.decode(frame.message);
+        if (image.empty()) {
+            return;
+        }
+        // later stages draw into the image, which the decoder may have mapped read-only onto the received pixels
+        // or reuse for the next frame, so only an image nothing else refers to is handed on as it is
+        frame.image = image.u && image.u->refcount == 1 ? image : image.clone();
+        {
+            std::lock_guard<std::mutex> lock(scenesMtx);
+            Scene &scene = scenes[frame.message.getSessionId()];
+            frame.sequence = ++scene.decoded;
+            scene.changes.push_back(imageDecoder.changedRegion());
+            if (scene.changes.size() > Scene::maxChanges) {
+                scene.changes.pop_front();
             }
+        }
+        inferQueue.push(std::move(frame));
+    });
 
-            // FPS calculation
-            frameCount++;
-            auto currentTime = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::seconds>(currentTime - lastTime);
+    auto lastReport = std::chrono::steady_clock::now();
+    while (isRunning) {
+        server.waitForMessages(std::chrono::milliseconds(1000));
 
-            if (duration.count() >= 1) {
-                std::cout << "FPS: " << frameCount << std::endl;
-                frameCount = 0;
-                lastTime = currentTime;
+        // Retrieve messages; camera frames enter the pipeline
+        while (server.hasMessages()) {
+            Message message = server.getLatestMessage();
+            if (message.getType() == Type::IMAGE) {
+                Frame frame;
+                frame.message = std::move(message);
+                decodeQueue.push(std::move(frame));
             }
         }
+
+        // FPS and latency of every stage
+        auto currentTime = std::chrono::steady_clock::now();
+        if (currentTime - lastReport >= std::chrono::seconds(1)) {
+            report(decode);
+            report(infer);
+            report(control);
+            report(display);
+            lastReport = currentTime;
+        }
     }
 }
@@ -1,115 +1,757 @@
 #include <string>
 #include <fstream>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <cerrno>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 #include "../include/CommunicationHandler.hpp"
 
-CommunicationHandler::CommunicationHandler(uint16_t port) : server(port, 1) {
-    connectionThread = std::jthread(&CommunicationHandler::handleConnection, this);
+namespace {
+    // epoll keys for the non-session descriptors; session ids start at 1
+    constexpr uint64_t listenerKey = 0;
+    constexpr uint64_t wakeKey = UINT64_MAX;
+    constexpr uint64_t datagramKey = UINT64_MAX - 1;
+    constexpr uint64_t batchTimerKey = UINT64_MAX - 2;
+
+    // room for the largest UDP payload
+    constexpr size_t datagramBufferSize = 65536;
+    // enough for a few camera frames arriving while the event loop is busy
+    constexpr int datagramReceiveBuffer = 4 * 1024 * 1024;
+
+    bool wouldBlock() {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+}
+
+CommunicationHandler::CommunicationHandler(uint16_t port, bool lowLatency, ReceiveBackend backend, uint16_t imagePort)
+        : server(port, SOMAXCONN), backend(backend), lowLatency(lowLatency) {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    batchTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (epollFd < 0 || wakeFd < 0 || batchTimerFd < 0) {
+        throw std::runtime_error("Failed to create event loop");
+    }
+
+    server.setNonBlocking(true);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = listenerKey;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, server.nativeHandle(), &event);
+    event.data.u64 = wakeKey;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+    event.data.u64 = batchTimerKey;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, batchTimerFd, &event);
+    if (imagePort != 0) {
+        imageSocket = std::make_unique<UdpSocket>(imagePort, datagramReceiveBuffer);
+        datagramBuffer.resize(datagramBufferSize);
+        event.data.u64 = datagramKey;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, imageSocket->nativeHandle(), &event);
+    }
+
+    if (backend == ReceiveBackend::IO_URING && !startIoUring()) {
+        this->backend = ReceiveBackend::EPOLL;
+    }
+    connectionThread = std::jthread(this->backend == ReceiveBackend::IO_URING ? &CommunicationHandler::ioUringLoop
+                                                                              : &CommunicationHandler::eventLoop, this);
 }
 
 void CommunicationHandler::close() {
     isRunning = false;
+    receivedNotifier.notify();
+    // wake up the event loop so it notices the shutdown
+    uint64_t one = 1;
+    ::write(wakeFd, &one, sizeof(one));
     if (connectionThread.joinable()) {
         connectionThread.join();
     }
-    connection->close();
-}
 
-void CommunicationHandler::read() {
-    if (!connection) {
-        return;
+    uring.reset();
+
+    for (auto id : getSessionIds()) {
+        closeSession(id);
     }
+    server.close();
+    if (imageSocket) {
+        imageSocket->close();
+    }
+    ::close(epollFd);
+    ::close(wakeFd);
+    ::close(batchTimerFd);
+}
 
-    std::vector<unsigned char> buffer(1024);
-    int bytesRead = 0;
+void CommunicationHandler::eventLoop() {
+    while (isRunning && handleEvents(-1)) {
+    }
+}
 
-    // Store any remaining part of a message from previous reads
-    static std::string leftover;
+bool CommunicationHandler::handleEvents(int timeoutMs) {
+    std::array<epoll_event, 64> events{};
+    int count;
+    do {
+        count = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), timeoutMs);
+        if (count < 0) {
+            return errno == EINTR;
+        }
 
-    // Store expected length of next message
-    static size_t expectedMessageLength = 0;
+        for (int i = 0; i < count && isRunning; ++i) {
+            const auto &event = events[i];
+            if (event.data.u64 == listenerKey) {
+                acceptSessions();
+                continue;
+            }
+            if (event.data.u64 == wakeKey) {
+                uint64_t value;
+                ::read(wakeFd, &value, sizeof(value));
+                continue;
+            }
+            if (event.data.u64 == datagramKey) {
+                readDatagrams();
+                continue;
+            }
+            if (event.data.u64 == batchTimerKey) {
+                sendDueBatches();
+                continue;
+            }
 
-    // Loop to accumulate data until we reach a complete message
-    while ((bytesRead = connection->read(buffer)) > 0) {
-        leftover.append(buffer.begin(), buffer.begin() + bytesRead);
+            std::shared_ptr<Session> session;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                auto it = sessions.find(static_cast<uint32_t>(event.data.u64));
+                if (it == sessions.end()) {
+                    continue;
+                }
+                session = it->second;
+            }
 
-        while (true) {
-            if (expectedMessageLength == 0) {
-                // If we haven't read the length yet, check if we have enough bytes for it
-                if (leftover.size() < sizeof(uint32_t)) {
-                    break; // wait for more data
+            bool alive = true;
+            try {
+                // with io_uring, hangups surface as the end of the session's receive instead
+                if (backend == ReceiveBackend::EPOLL && (event.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                    alive = readSession(*session);
+                }
+                if (alive && (event.events & EPOLLOUT)) {
+                    alive = flushSession(*session);
                 }
+            } catch (const std::exception &) {
+                // a malformed frame leaves the stream out of sync, drop the robot and let it reconnect
+                alive = false;
+            }
+            if (!alive) {
+                closeSession(session->id);
+            }
+        }
+        // a full batch may leave events behind that nothing will report again when polled from the ring
+        timeoutMs = 0;
+    } while (count == static_cast<int>(events.size()) && isRunning);
+    return true;
+}
+
+uint32_t CommunicationHandler::sessionEvents() const {
+    // io_uring receives the data itself, epoll only reports writability for it
+    return backend == ReceiveBackend::EPOLL ? EPOLLIN | EPOLLRDHUP : 0;
+}
+
+void CommunicationHandler::acceptSessions() {
+    while (auto connection = server.accept()) {
+        connection->setNonBlocking(true);
+        connection->setLowLatency(lowLatency);
+
+        auto session = std::make_shared<Session>();
+        session->peerAddress = connection->peerAddress();
+        session->connection = std::move(connection);
+
+        std::lock_guard<std::mutex> lock(mtx);
+        session->id = nextSessionId++;
+        epoll_event event{};
+        event.events = sessionEvents();
+        event.data.u64 = session->id;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, session->connection->nativeHandle(), &event);
+        if (backend == ReceiveBackend::IO_URING) {
+            armReceive(*session);
+        }
+        sessions.emplace(session->id, std::move(session));
+        connectionCount++;
+    }
+}
+
+bool CommunicationHandler::readSession(Session &session) {
+    auto &connection = *session.connection;
+    while (true) {
+        if (session.payloadPending) {
+            // Read the rest of the payload straight into its exact-size buffer
+            auto &frame = session.pendingFrame;
+            int n = connection.read(frame.data() + session.pendingFilled, frame.size() - session.pendingFilled);
+            readCalls++;
+            if (n <= 0) {
+                return n < 0 && wouldBlock();
+            }
+            bytesRead += n;
+            session.pendingFilled += n;
+            completePayload(session);
+            continue;
+        }
+
+        if (processBuffered(session)) {
+            continue;
+        }
+
+        // Still waiting for a length prefix, fall back to small reads
+        auto space = session.receiveBuffer.prepare(headerReadSize);
+        int n = connection.read(space.data(), headerReadSize);
+        readCalls++;
+        if (n <= 0) {
+            return n < 0 && wouldBlock();
+        }
+        bytesRead += n;
+        session.receiveBuffer.commit(n);
+    }
+}
+
+void CommunicationHandler::consume(Session &session, const unsigned char *data, size_t size) {
+    bytesRead += size;
+    while (size > 0) {
+        if (session.payloadPending) {
+            auto &frame = session.pendingFrame;
+            size_t n = std::min(size, frame.size() - session.pendingFilled);
+            std::memcpy(frame.data() + session.pendingFilled, data, n);
+            bytesCopied += n;
+            session.pendingFilled += n;
+            data += n;
+            size -= n;
+            completePayload(session);
+            continue;
+        }
+
+        auto space = session.receiveBuffer.prepare(size);
+        std::memcpy(space.data(), data, size);
+        bytesCopied += size;
+        session.receiveBuffer.commit(size);
+        size = 0;
+        processBuffered(session);
+    }
+}
 
-                // Extract message length (first 4 bytes)
-                uint32_t lengthNetworkOrder;
-                std::memcpy(&lengthNetworkOrder, leftover.data(), sizeof(uint32_t));
-                expectedMessageLength = ntohl(lengthNetworkOrder);
+bool CommunicationHandler::processBuffered(Session &session) {
+    // Process every complete message already buffered; the views stay valid until the next prepare()
+    while (true) {
+        auto frame = session.receiveBuffer.nextFrame();
+        // noted before the frame is handed on, so the reply to it is already in the order the robot asked for
+        if (session.receiveBuffer.networkOrderAnnounced()) {
+            session.peerNetworkOrder = true;
+        }
+        if (!frame) {
+            break;
+        }
+        receiveFrame(session, frame->payload, frame->chunk);
+    }
+
+    auto length = session.receiveBuffer.pendingFrameLength();
+    if (!length) {
+        return false;
+    }
+    // a corrupt or hostile prefix must not make us allocate gigabytes; the stream is out of sync either way
+    if (*length > maxPayloadSize) {
+        throw std::runtime_error("Frame of " + std::to_string(*length) + " bytes exceeds the maximum payload size");
+    }
+    // The prefix is parsed but the payload is incomplete: continue in an exact-size buffer
+    session.pendingFrame = framePool.acquire(*length);
+    session.pendingIsChunk = session.receiveBuffer.pendingFrameIsChunk();
+    session.pendingFilled = session.receiveBuffer.takePendingFrame(session.pendingFrame.data());
+    session.payloadPending = true;
+    bytesCopied += session.pendingFilled;
+    return true;
+}
+
+void CommunicationHandler::completePayload(Session &session) {
+    auto &frame = session.pendingFrame;
+    if (session.pendingFilled == frame.size()) {
+        if (session.pendingIsChunk) {
+            receiveFrame(session, frame.view(), true);
+            frame.reset();
+        } else {
+            if (Message::isCompactFrame(frame.view())) {
+                session.peerCompact = true;
+            }
+            // the message keeps the pooled buffer, its image is decoded right where it was received
+            enqueue(session.decoder, session, SharedBuffer::adopt(std::move(frame)));
+        }
+        session.payloadPending = false;
+    }
+}
+
+void CommunicationHandler::receiveFrame(Session &session, std::string_view payload, bool chunk) {
+    if (!chunk) {
+        if (Message::isCompactFrame(payload)) {
+            session.peerCompact = true;
+        }
+        enqueue(session.decoder, session, SharedBuffer::copyOf(payload));
+        return;
+    }
+
+    if (payload.empty()) {
+        throw std::runtime_error("Received a chunk without a lane");
+    }
+    const auto tag = static_cast<uint8_t>(payload[0]);
+    const size_t lane = tag & ~finalChunk;
+    if (lane >= session.partialMessages.size()) {
+        throw std::runtime_error("Received a chunk for unknown lane " + std::to_string(lane));
+    }
+    session.peerChunks = true;
+
+    auto &partial = session.partialMessages[lane];
+    if (partial.size() + payload.size() - 1 > maxPayloadSize) {
+        throw std::runtime_error("Chunked message exceeds the maximum payload size");
+    }
+    partial.append(payload.substr(1));
+    if (tag & finalChunk) {
+        enqueue(session.decoder, session, SharedBuffer(std::move(partial)));
+        partial = {};
+    }
+}
 
-                leftover.erase(0, sizeof(uint32_t)); // Remove the length prefix
+void CommunicationHandler::readDatagrams() {
+    uint32_t address;
+    uint16_t port;
+    int n;
+    while ((n = imageSocket->receive(datagramBuffer.data(), datagramBuffer.size(), address, port)) >= 0) {
+        datagramsReceived++;
+        // only robots connected over TCP may send images, anyone else could pose as one of them or make the
+        // handler hold partial frames for made-up senders
+        const auto session = sessionFor(address);
+        if (!session) {
+            datagramsUnknown++;
+            continue;
+        }
+        auto stream = imageStreams.find(session->id);
+        if (stream == imageStreams.end()) {
+            if (imageStreams.size() >= maxImageStreams) {
+                datagramsUnknown++;
+                continue;
             }
+            stream = imageStreams.emplace(session->id, DatagramReassembler(imageDeadline)).first;
+        }
+
+        auto &reassembler = stream->second;
+        const uint64_t discardedBefore = reassembler.discardedFrames();
+        auto frame = reassembler.add({reinterpret_cast<const char *>(datagramBuffer.data()), static_cast<size_t>(n)});
+        datagramFramesDiscarded += reassembler.discardedFrames() - discardedBefore;
+        if (!frame) {
+            continue;
+        }
+        datagramFrames++;
+        try {
+            enqueue(datagramDecoder, *session, SharedBuffer(std::move(*frame)));
+        } catch (const std::exception &) {
+            // a corrupt datagram only costs its own frame
+        }
+    }
+}
 
-            // Check if we have the complete message
-            if (leftover.size() < expectedMessageLength) {
-                break; // wait for more data
+std::shared_ptr<CommunicationHandler::Session> CommunicationHandler::sessionFor(uint32_t address) {
+    std::lock_guard<std::mutex> lock(mtx);
+    for (const auto &[id, session] : sessions) {
+        if (session->peerAddress == address) {
+            return session;
+        }
+    }
+    return nullptr;
+}
+
+void CommunicationHandler::enqueue(Message::Decoder &decoder, Session &session, const SharedBuffer &frame) {
+    const uint64_t receivedAt = monotonicMicros();
+    if (Message::isBatchFrame(frame.view())) {
+        decoder.decodeBatch(frame, decodedFrame);
+        session.peerBatches = true;
+    } else {
+        decodedFrame.resize(1);
+        decoder.decode(frame, decodedFrame.front());
+    }
+    const uint64_t decodedAt = monotonicMicros();
+    framesReceived++;
+
+    for (auto &receivedMessage : decodedFrame) {
+        Timestamps stamps = receivedMessage.getTimestamps();
+        stamps.received = receivedAt;
+        stamps.decoded = decodedAt;
+        receivedMessage.setTimestamps(stamps);
+        receivedMessage.setSessionId(session.id);
+        session.clock.add(stamps);
+    }
+    if (auto offset = session.clock.offset()) {
+        session.clockOffset = *offset;
+    }
+
+    // the whole frame becomes visible to the consumer at once, with a single wakeup; if the consumer has stalled
+    // so long that the handoff queue is full, what does not fit is dropped instead of buffered without bound
+    const size_t queued = received.pushAll(std::make_move_iterator(decodedFrame.begin()),
+                                           std::make_move_iterator(decodedFrame.end()));
+    messagesOverflowed += decodedFrame.size() - queued;
+    decodedFrame.clear();
+    receivedNotifier.notify();
+}
+
+bool CommunicationHandler::flushSession(Session &session) {
+    std::lock_guard<std::mutex> lock(session.writeMtx);
+    if (!flushLocked(session)) {
+        return false;
+    }
+    if (session.current.empty()) {
+        watchWritable(session, false);
+    }
+    return true;
+}
+
+bool CommunicationHandler::flushLocked(Session &session) {
+    while (true) {
+        if (session.currentOffset == session.current.size()) {
+            session.current.clear();
+            session.currentOffset = 0;
+            if (!nextOutboundFrame(session)) {
+                return true;
             }
+        }
+        int n = session.connection->writeSome(reinterpret_cast<const unsigned char *>(session.current.data()) + session.currentOffset,
+                                              session.current.size() - session.currentOffset);
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        session.currentOffset += n;
+    }
+}
 
-            // Extract the complete message based on the expected length
-            std::string completeMessage = leftover.substr(0, expectedMessageLength);
-            leftover.erase(0, expectedMessageLength);
-            expectedMessageLength = 0; // Reset for next message
+bool CommunicationHandler::nextOutboundFrame(Session &session) {
+    if (!session.controlOutbound.empty()) {
+        session.current = std::move(session.controlOutbound.front());
+        session.controlOutbound.pop_front();
+        toPeerOrder(session, session.current);
+        return true;
+    }
+    if (session.bulkOutbound.empty()) {
+        return false;
+    }
+
+    const std::string &message = session.bulkOutbound.front();
+    const size_t remaining = message.size() - session.bulkOffset;
+    const bool chunked = session.peerChunks;
+    const size_t payloadSize = chunked ? std::min(remaining, chunkSize) : remaining;
+    const bool last = payloadSize == remaining;
 
-            // Process complete message
-            Message receivedMessage = Message::fromProto(completeMessage);
+    // same prefix layout as Message::toFrame, with the chunk flag and lane byte when chunking
+    const uint32_t prefix = htonl(chunked ? static_cast<uint32_t>(payloadSize + 1) | FrameBuffer::chunkFlag
+                                          : static_cast<uint32_t>(payloadSize));
+    session.current.assign(reinterpret_cast<const char *>(&prefix), sizeof(uint32_t));
+    if (chunked) {
+        session.current.push_back(static_cast<char>(static_cast<uint8_t>(Lane::BULK) | (last ? finalChunk : 0)));
+    }
+    session.current.append(message, session.bulkOffset, payloadSize);
+    toPeerOrder(session, session.current);
 
-            // Enqueue the message
-            std::lock_guard<std::mutex> lock(mtx);
-            messageQueue.push(receivedMessage);
-            cv.notify_one();
+    session.bulkOffset += payloadSize;
+    if (last) {
+        session.bulkOutbound.pop_front();
+        session.bulkOffset = 0;
+    }
+    return true;
+}
+
+void CommunicationHandler::watchWritable(const Session &session, bool enabled) {
+    epoll_event event{};
+    event.events = sessionEvents() | (enabled ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    event.data.u64 = session.id;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, session.connection->nativeHandle(), &event);
+}
+
+void CommunicationHandler::closeSession(uint32_t id) {
+    std::shared_ptr<Session> session;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = sessions.find(id);
+        if (it == sessions.end()) {
+            return;
         }
+        session = std::move(it->second);
+        sessions.erase(it);
+        connectionCount--;
     }
+    // only the event loop reassembles, and close() joins it before closing the remaining sessions
+    imageStreams.erase(id);
+    // wait for any writer to finish before the descriptor is released and possibly reused
+    std::lock_guard<std::mutex> lock(session->writeMtx);
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, session->connection->nativeHandle(), nullptr);
+    session->connection->close();
 }
 
 void CommunicationHandler::write(const Message& message) {
-    if (!connection) {
+    std::vector<std::shared_ptr<Session>> targets;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (message.getSessionId() == 0) {
+            for (const auto &[id, session] : sessions) {
+                targets.push_back(session);
+            }
+        } else if (auto it = sessions.find(message.getSessionId()); it != sessions.end()) {
+            targets.push_back(it->second);
+        }
+    }
+    for (const auto &session : targets) {
+        send(*session, message);
+    }
+}
+
+void CommunicationHandler::toFrame(const Session &session, const Message &message, std::string &out) {
+    // a robot sending compact commands does without the latency echo, see fitsCompactFrameWithoutEcho()
+    if (session.peerCompact && message.fitsCompactFrameWithoutEcho()) {
+        message.toCompactFrame(out);
+    } else {
+        message.toFrame(out);
+    }
+}
+
+void CommunicationHandler::toPeerOrder(const Session &session, std::string &frame) {
+    if (session.peerNetworkOrder) {
+        return;
+    }
+    uint32_t prefix;
+    std::memcpy(&prefix, frame.data(), sizeof(uint32_t));
+    prefix = ntohl(prefix);
+    std::memcpy(frame.data(), &prefix, sizeof(uint32_t));
+}
+
+void CommunicationHandler::send(Session &session, const Message &message) {
+    std::lock_guard<std::mutex> lock(session.writeMtx);
+    if (session.connection->nativeHandle() < 0) {
         return;
     }
-    // convert the message to a string
-    auto messageString = message.toProto();
-    uint32_t messageLength = messageString.size();
 
-    // send the message
-    connection->write(reinterpret_cast<const unsigned char *>(&messageLength), sizeof(uint32_t));
-    connection->write(reinterpret_cast<const unsigned char *>(messageString.data()), messageString.size());
+    const bool batching = session.peerBatches && batchDelayMicros > 0;
+    if (!batching) {
+        // a batch left open when batching was switched off goes ahead of anything newer
+        closeBatch(session);
+    }
+
+    if (laneOf(message.getType()) == Lane::BULK) {
+        session.bulkOutbound.push_back(message.toProto());
+    } else if (batching) {
+        if (!addToBatch(session, message)) {
+            // the batch timer sends it
+            return;
+        }
+    } else if (session.current.empty() && session.controlOutbound.empty()) {
+        // nothing in the way: serialize prefix and body into the reused buffer and send them in one go
+        toFrame(session, message, session.sendBuffer);
+        toPeerOrder(session, session.sendBuffer);
+        int n = session.connection->writeSome(reinterpret_cast<const unsigned char *>(session.sendBuffer.data()),
+                                              session.sendBuffer.size());
+        if (n < 0 || static_cast<size_t>(n) == session.sendBuffer.size()) {
+            // fully sent, or the connection failed and the event loop will drop the session
+            return;
+        }
+        session.current.assign(session.sendBuffer, n);
+        session.currentOffset = 0;
+    } else {
+        std::string frame;
+        toFrame(session, message, frame);
+        session.controlOutbound.push_back(std::move(frame));
+    }
+
+    if (flushLocked(session) && !session.current.empty()) {
+        watchWritable(session, true);
+    }
 }
 
-void CommunicationHandler::handleConnection() {
-    connection = server.accept();
-    if (!connection) {
-        throw std::runtime_error("Failed to accept connection");
+bool CommunicationHandler::addToBatch(Session &session, const Message &message) {
+    if (session.batch.empty()) {
+        Message::startBatchFrame(session.batch);
+        session.batchDeadline = std::chrono::steady_clock::now() + std::chrono::microseconds(batchDelayMicros);
+        armBatchTimer(session.batchDeadline);
     }
-    connectionCount++;
+    message.appendToBatchFrame(session.batch);
+    if (session.batch.size() < batchBytes) {
+        return false;
+    }
+    closeBatch(session);
+    return true;
+}
+
+void CommunicationHandler::closeBatch(Session &session) {
+    if (!session.batch.empty()) {
+        session.controlOutbound.push_back(std::move(session.batch));
+        session.batch.clear();
+    }
+}
 
-    while (isRunning) {
-        read();
-        // check if host is still connected
-        if (!connection) {
-            connectionCount--;
-            handleConnection();
+void CommunicationHandler::armBatchTimer(std::chrono::steady_clock::time_point deadline) {
+    std::lock_guard<std::mutex> lock(batchTimerMtx);
+    if (deadline >= batchTimerDeadline) {
+        return;
+    }
+    batchTimerDeadline = deadline;
+    // steady_clock is CLOCK_MONOTONIC, so its time points can be used as absolute timer values
+    const auto sinceEpoch = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch());
+    itimerspec timer{};
+    timer.it_value.tv_sec = static_cast<time_t>(sinceEpoch.count() / 1000000000);
+    timer.it_value.tv_nsec = static_cast<long>(sinceEpoch.count() % 1000000000);
+    timerfd_settime(batchTimerFd, TFD_TIMER_ABSTIME, &timer, nullptr);
+}
+
+void CommunicationHandler::sendDueBatches() {
+    uint64_t expirations;
+    ::read(batchTimerFd, &expirations, sizeof(expirations));
+    {
+        // batches opened from now on arm the timer themselves
+        std::lock_guard<std::mutex> lock(batchTimerMtx);
+        batchTimerDeadline = std::chrono::steady_clock::time_point::max();
+    }
+
+    std::vector<std::shared_ptr<Session>> targets;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (const auto &[id, session] : sessions) {
+            targets.push_back(session);
+        }
+    }
+    const auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+    for (const auto &session : targets) {
+        std::lock_guard<std::mutex> lock(session->writeMtx);
+        if (session->batch.empty() || session->connection->nativeHandle() < 0) {
+            continue;
+        }
+        if (session->batchDeadline > now) {
+            next = std::min(next, session->batchDeadline);
+            continue;
+        }
+        closeBatch(*session);
+        if (flushLocked(*session) && !session->current.empty()) {
+            watchWritable(*session, true);
         }
     }
+    if (next != std::chrono::steady_clock::time_point::max()) {
+        armBatchTimer(next);
+    }
 }
 
-Message CommunicationHandler::getLatestMessage() {
+void CommunicationHandler::setBatching(size_t maxBytes, std::chrono::microseconds maxDelay) {
+    batchBytes = maxBytes;
+    batchDelayMicros = std::max<int64_t>(maxDelay.count(), 0);
+}
+
+void CommunicationHandler::setLowLatency(bool enabled) {
+    lowLatency = enabled;
     std::lock_guard<std::mutex> lock(mtx);
-    if (messageQueue.empty()) {
-        return {};
+    for (const auto &[id, session] : sessions) {
+        session->connection->setLowLatency(enabled);
     }
+}
 
-    Message message = messageQueue.front();
-    messageQueue.pop();
+void CommunicationHandler::drainReceived() {
+    while (auto message = received.pop()) {
+        auto inbox = inboxes.find(message->getSessionId());
+        if (inbox == inboxes.end()) {
+            inbox = inboxes.emplace(message->getSessionId(), Mailbox()).first;
+            inbox->second.setPolicies(queuePolicies);
+        }
+        switch (inbox->second.push(std::move(*message))) {
+            case Mailbox::PushResult::QUEUED:
+                queuedMessages++;
+                break;
+            case Mailbox::PushResult::DROPPED_OLDEST:
+                messagesDropped++;
+                break;
+            case Mailbox::PushResult::COALESCED:
+                messagesCoalesced++;
+                break;
+        }
+    }
+}
+
+Message CommunicationHandler::popFrom(std::map<uint32_t, Mailbox>::iterator inbox) {
+    Message message = std::move(*inbox->second.pop());
+    queuedMessages--;
+    lastServedSession = inbox->first;
+    if (inbox->second.empty()) {
+        inboxes.erase(inbox);
+    }
     return message;
 }
 
-void CommunicationHandler::sendMessage(const std::vector<int> &coords) {
+Message CommunicationHandler::getLatestMessage() {
+    drainReceived();
+    if (inboxes.empty()) {
+        return {};
+    }
+
+    // visit sessions in turn, starting after the one served last, so one busy robot cannot starve the others;
+    // empty inboxes are removed, so the next one always has a message
+    auto it = inboxes.upper_bound(lastServedSession);
+    if (it == inboxes.end()) {
+        it = inboxes.begin();
+    }
+    return popFrom(it);
+}
+
+Message CommunicationHandler::getLatestMessage(uint32_t sessionId) {
+    drainReceived();
+    auto it = inboxes.find(sessionId);
+    if (it == inboxes.end()) {
+        return {};
+    }
+    return popFrom(it);
+}
+
+std::vector<uint32_t> CommunicationHandler::getSessionIds() {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<uint32_t> ids;
+    ids.reserve(sessions.size());
+    for (const auto &[id, session] : sessions) {
+        ids.push_back(id);
+    }
+    return ids;
+}
+
+std::optional<int64_t> CommunicationHandler::getClockOffset(uint32_t sessionId) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = sessions.find(sessionId);
+    if (it == sessions.end()) {
+        return std::nullopt;
+    }
+    const int64_t offset = it->second->clockOffset;
+    if (offset == unknownClockOffset) {
+        return std::nullopt;
+    }
+    return offset;
+}
+
+void CommunicationHandler::sendMessage(const std::vector<int> &coords, uint32_t sessionId) {
+    Message frame;
+    frame.setSessionId(sessionId);
+    if (auto command = commandFor(coords, frame)) {
+        write(*command);
+    }
+}
+
+std::optional<Message> CommunicationHandler::sendMessage(const std::vector<int> &coords, const Message &frame) {
+    // a frame of no session has no robot to answer; sending to session 0 would steer all of them
+    if (frame.getSessionId() == 0) {
+        return std::nullopt;
+    }
+    auto command = commandFor(coords, frame);
+    if (command) {
+        write(*command);
+    }
+    return command;
+}
+
+std::optional<Message> CommunicationHandler::commandFor(const std::vector<int> &coords, const Message &frame) {
     auto x = coords[0];
     auto y = static_cast<int>(cameraHeight) - coords[1];
     // compute relative x and y (-1 to 1), where 0,0 is the center of the camera
@@ -120,42 +762,70 @@ void CommunicationHandler::sendMessage(const std::vector<int> &coords) {
     // compute angle from the center
     auto angle = std::atan2(relative_y, relative_x);
     // if displacement is greater than the threshold, move the robot
-    if (displacement > maxDisplacement) {
-        Message message;
-        message.setType(Type::COMMAND);
-        if (angle > -M_PI / 4 && angle < M_PI / 4) {
-            // move the robot right
-            message.addDirection(Direction::RIGHT);
-        } else if (angle > M_PI / 4 && angle < 3 * M_PI / 4) {
-            // move the camera up
-            message.addCameraDirection(Direction::FORWARD);
-        } else if (angle < -M_PI / 4 && angle > -3 * M_PI / 4) {
-            // move the camera down
-            message.addCameraDirection(Direction::BACKWARD);
-        } else {
-            // move the robot left
-            message.addDirection(Direction::LEFT);
-        }
-        // send the message
-        write(message);
+    if (displacement <= maxDisplacement) {
+        return std::nullopt;
     }
+    Message message;
+    message.setType(Type::COMMAND);
+    message.setSessionId(frame.getSessionId());
+    if (angle > -M_PI / 4 && angle < M_PI / 4) {
+        // move the robot right
+        message.addDirection(Direction::RIGHT);
+    } else if (angle > M_PI / 4 && angle < 3 * M_PI / 4) {
+        // move the camera up
+        message.addCameraDirection(Direction::FORWARD);
+    } else if (angle < -M_PI / 4 && angle > -3 * M_PI / 4) {
+        // move the camera down
+        message.addCameraDirection(Direction::BACKWARD);
+    } else {
+        // move the robot left
+        message.addDirection(Direction::LEFT);
+    }
+    // echo the frame's id and timestamps so the latency of the whole round can be told apart; a robot that
+    // neither numbers nor stamps its frames does not measure latency, and the stamps added here are no use to it
+    const Timestamps &frameStamps = frame.getTimestamps();
+    if (frame.getFrameId() != 0 || frameStamps.capture != 0 || frameStamps.sent != 0) {
+        Timestamps stamps = frameStamps;
+        stamps.commandSent = stamps.sent = monotonicMicros();
+        stamps.echoCommandSent = stamps.echoCommandReceived = 0;
+        message.setFrameId(frame.getFrameId());
+        message.setTimestamps(stamps);
+    }
+    return message;
 }
 
 bool CommunicationHandler::hasMessages() const {
-    return !messageQueue.empty();
+    return queuedMessages > 0 || !received.empty();
 }
 
-uint32_t CommunicationHandler::ntohl(uint32_t net) {
-    return ((net & 0xFF000000) >> 24) |
-           ((net & 0x00FF0000) >> 8) |
-           ((net & 0x0000FF00) << 8) |
-           ((net & 0x000000FF) << 24);
+bool CommunicationHandler::waitForMessages(std::chrono::milliseconds timeout) {
+    receivedNotifier.wait([this] { return hasMessages() || !isRunning; }, timeout);
+    return hasMessages();
 }
 
 CommunicationHandler::~CommunicationHandler() {
     close();
 }
 
-std::mutex &CommunicationHandler::getMtx() {
-    return mtx;
+void CommunicationHandler::setQueuePolicy(Type type, QueuePolicy policy) {
+    queuePolicies[static_cast<size_t>(type)] = policy;
+    for (auto &[id, inbox] : inboxes) {
+        inbox.setPolicy(type, policy);
+    }
+}
+
+QueueStats CommunicationHandler::getQueueStats() const {
+    return {messagesDropped, messagesCoalesced, messagesOverflowed};
+}
+
+ReadStats CommunicationHandler::getReadStats() const {
+    return {framesReceived, readCalls, bytesRead, bytesCopied};
+}
+
+DatagramStats CommunicationHandler::getDatagramStats() const {
+    return {datagramsReceived, datagramFrames, datagramFramesDiscarded, datagramsUnknown};
+}
+
+ReceiveBackend CommunicationHandler::getBackend() const {
+    return backend;
 }
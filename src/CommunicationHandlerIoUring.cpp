@@ -0,0 +1,192 @@
+#include "../include/CommunicationHandler.hpp"
+
+#ifdef RVR_WITH_IO_URING
+
+#include <cerrno>
+#include <memory>
+#include <liburing.h>
+#include <poll.h>
+
+namespace {
+    // user_data layout: operation in the upper half, session id in the lower half
+    constexpr uint64_t pollOp = 1;
+    constexpr uint64_t receiveOp = 2;
+
+    constexpr unsigned ringEntries = 256;
+    constexpr unsigned bufferCount = 64;        ///< Must be a power of two.
+    constexpr unsigned bufferSize = 16 * 1024;
+    constexpr int bufferGroup = 0;
+
+    uint64_t userData(uint64_t op, uint32_t id) {
+        return (op << 32) | id;
+    }
+}
+
+/**
+ * @brief The ring and the buffer ring its multishot receives are completed into.
+ */
+struct CommunicationHandler::IoUring {
+    io_uring ring{};
+    bool initialised = false;
+    io_uring_buf_ring *buffers = nullptr;
+    std::unique_ptr<unsigned char[]> storage{new unsigned char[bufferCount * bufferSize]};
+
+    ~IoUring() {
+        if (buffers) {
+            io_uring_free_buf_ring(&ring, buffers, bufferCount, bufferGroup);
+        }
+        if (initialised) {
+            io_uring_queue_exit(&ring);
+        }
+    }
+
+    unsigned char *buffer(unsigned id) {
+        return storage.get() + static_cast<size_t>(id) * bufferSize;
+    }
+
+    /**
+     * @brief Hands a buffer back to the kernel once its data has been consumed.
+     */
+    void recycle(unsigned id) {
+        io_uring_buf_ring_add(buffers, buffer(id), bufferSize, id, io_uring_buf_ring_mask(bufferCount), 0);
+        io_uring_buf_ring_advance(buffers, 1);
+    }
+
+    io_uring_sqe *nextSqe() {
+        io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        if (!sqe) {
+            // the submission queue is full, make room
+            io_uring_submit(&ring);
+            sqe = io_uring_get_sqe(&ring);
+        }
+        return sqe;
+    }
+};
+
+void CommunicationHandler::IoUringDeleter::operator()(IoUring *ring) const {
+    delete ring;
+}
+
+bool CommunicationHandler::startIoUring() {
+    auto state = std::unique_ptr<IoUring, IoUringDeleter>(new IoUring());
+    if (io_uring_queue_init(ringEntries, &state->ring, 0) < 0) {
+        return false;
+    }
+    state->initialised = true;
+
+    int result = 0;
+    state->buffers = io_uring_setup_buf_ring(&state->ring, bufferCount, bufferGroup, 0, &result);
+    if (!state->buffers) {
+        return false;
+    }
+    for (unsigned id = 0; id < bufferCount; ++id) {
+        io_uring_buf_ring_add(state->buffers, state->buffer(id), bufferSize, id, io_uring_buf_ring_mask(bufferCount),
+                              static_cast<int>(id));
+    }
+    io_uring_buf_ring_advance(state->buffers, bufferCount);
+
+    // the epoll set still reports new connections, writability and shutdown
+    io_uring_sqe *sqe = state->nextSqe();
+    io_uring_prep_poll_multishot(sqe, epollFd, POLLIN);
+    io_uring_sqe_set_data64(sqe, userData(pollOp, 0));
+    if (io_uring_submit(&state->ring) < 0) {
+        return false;
+    }
+
+    uring = std::move(state);
+    return true;
+}
+
+void CommunicationHandler::armReceive(const Session &session) {
+    io_uring_sqe *sqe = uring->nextSqe();
+    io_uring_prep_recv_multishot(sqe, session.connection->nativeHandle(), nullptr, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufferGroup;
+    io_uring_sqe_set_data64(sqe, userData(receiveOp, session.id));
+}
+
+void CommunicationHandler::ioUringLoop() {
+    while (isRunning) {
+        int result = io_uring_submit_and_wait(&uring->ring, 1);
+        if (result < 0 && result != -EINTR) {
+            break;
+        }
+
+        unsigned head;
+        unsigned handled = 0;
+        io_uring_cqe *cqe;
+        io_uring_for_each_cqe(&uring->ring, head, cqe) {
+            handled++;
+            const uint64_t data = io_uring_cqe_get_data64(cqe);
+            const auto op = data >> 32;
+            const auto id = static_cast<uint32_t>(data);
+
+            if (op == pollOp) {
+                if (!handleEvents(0)) {
+                    isRunning = false;
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE) && isRunning) {
+                    io_uring_sqe *sqe = uring->nextSqe();
+                    io_uring_prep_poll_multishot(sqe, epollFd, POLLIN);
+                    io_uring_sqe_set_data64(sqe, userData(pollOp, 0));
+                }
+                continue;
+            }
+
+            std::shared_ptr<Session> session;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (auto it = sessions.find(id); it != sessions.end()) {
+                    session = it->second;
+                }
+            }
+
+            bool alive = cqe->res > 0 || cqe->res == -ENOBUFS;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                const unsigned buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                if (session && cqe->res > 0) {
+                    readCalls++;
+                    try {
+                        consume(*session, uring->buffer(buffer), static_cast<size_t>(cqe->res));
+                    } catch (const std::exception &) {
+                        // a malformed frame leaves the stream out of sync, drop the robot and let it reconnect
+                        alive = false;
+                    }
+                }
+                uring->recycle(buffer);
+            }
+
+            if (!session) {
+                continue;
+            }
+            if (!alive) {
+                closeSession(id);
+            } else if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                // the kernel ended the multishot receive, e.g. because it ran out of buffers
+                armReceive(*session);
+            }
+        }
+        io_uring_cq_advance(&uring->ring, handled);
+    }
+}
+
+#else
+
+struct CommunicationHandler::IoUring {
+};
+
+void CommunicationHandler::IoUringDeleter::operator()(IoUring *ring) const {
+    delete ring;
+}
+
+bool CommunicationHandler::startIoUring() {
+    return false;
+}
+
+void CommunicationHandler::ioUringLoop() {
+}
+
+void CommunicationHandler::armReceive(const Session &) {
+}
+
+#endif
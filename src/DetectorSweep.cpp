@@ -0,0 +1,128 @@
+// Accuracy and latency of the bundled YOLO models at several network input sizes, to pick the smallest input
+// that still finds the target. Frames are scaled to the camera's 320x240 first, like the frames robots send.
+//
+// Usage: detector_sweep [--target NAME] [--runs N] IMAGE...
+
+#include "ObjectDetector.hpp"
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+    const std::vector<std::string> models = {"yolov4-tiny", "yolov7-tiny"};
+    // the first is the size the models were trained at, the reference for the others
+    const std::vector<cv::Size> inputSizes = {{416, 416}, {416, 320}, {320, 256}, {256, 192}, {224, 160}, {160, 128}};
+    const cv::Size cameraSize(320, 240);    // CAMERA_WIDTH x CAMERA_HEIGHT
+
+    double iou(const cv::Rect &a, const cv::Rect &b) {
+        const double overlap = (a & b).area();
+        return overlap > 0 ? overlap / (a.area() + b.area() - overlap) : 0;
+    }
+
+    // Share of the reference detections found again: same class, boxes overlapping by half or more
+    double recall(const std::vector<std::vector<Detection>> &found, const std::vector<std::vector<Detection>> &reference) {
+        size_t total = 0;
+        size_t matched = 0;
+        for (size_t i = 0; i < reference.size(); ++i) {
+            for (const auto &expected: reference[i]) {
+                total++;
+                for (const auto &detection: found[i]) {
+                    if (detection.classId == expected.classId && iou(detection.box, expected.box) >= 0.5) {
+                        matched++;
+                        break;
+                    }
+                }
+            }
+        }
+        return total > 0 ? static_cast<double>(matched) / static_cast<double>(total) : 1;
+    }
+
+    int classId(const std::string &name) {
+        std::ifstream classes(YOLO_DATA_DIR "/coco.names");
+        std::string line;
+        for (int id = 0; std::getline(classes, line); ++id) {
+            if (line == name) {
+                return id;
+            }
+        }
+        return -1;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    std::string target = "bottle";
+    int runs = 20;
+    std::vector<cv::Mat> frames;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--target" && i + 1 < argc) {
+            target = argv[++i];
+        } else if (arg == "--runs" && i + 1 < argc) {
+            runs = std::max(1, std::stoi(argv[++i]));
+        } else {
+            cv::Mat image = cv::imread(arg);
+            if (image.empty()) {
+                std::cerr << "Cannot read image " << arg << std::endl;
+                return 1;
+            }
+            cv::resize(image, frames.emplace_back(), cameraSize);
+        }
+    }
+    const int targetId = classId(target);
+    if (frames.empty() || targetId < 0) {
+        std::cerr << "Usage: " << argv[0] << " [--target NAME] [--runs N] IMAGE..." << std::endl
+                  << "NAME is a class of coco.names, " << target << " by default." << std::endl;
+        return 1;
+    }
+
+    std::cout << std::left << std::setw(14) << "model" << std::setw(10) << "input" << std::right << std::setw(12)
+              << "ms/frame" << std::setw(10) << "recall" << std::setw(10) << target << std::endl;
+    for (const auto &model: models) {
+        const std::string config = YOLO_DATA_DIR "/" + model + ".cfg";
+        const std::string weights = YOLO_DATA_DIR "/" + model + ".weights";
+        if (!std::filesystem::exists(weights)) {
+            std::cout << model << ": no weights at " << weights << std::endl;
+            continue;
+        }
+        std::vector<std::vector<Detection>> reference;
+        for (const auto &inputSize: inputSizes) {
+            ObjectDetector detector(config, weights, YOLO_DATA_DIR "/coco.names", inputSize);
+            std::vector<std::vector<Detection>> found;
+            for (const auto &frame: frames) {
+                found.push_back(detector.detect({frame}).front());
+            }
+            if (reference.empty()) {
+                reference = found;
+            }
+
+            // one frame at a time, as a single robot sends them; the first round above warmed the network up
+            const auto start = std::chrono::steady_clock::now();
+            for (int run = 0; run < runs; ++run) {
+                for (const auto &frame: frames) {
+                    detector.detect({frame});
+                }
+            }
+            const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                                      .count() / static_cast<double>(runs * frames.size());
+
+            size_t withTarget = 0;
+            for (const auto &detections: found) {
+                withTarget += std::any_of(detections.begin(), detections.end(),
+                                          [targetId](const Detection &d) { return d.classId == targetId; });
+            }
+            std::cout << std::left << std::setw(14) << model
+                      << std::setw(10) << std::to_string(inputSize.width) + "x" + std::to_string(inputSize.height)
+                      << std::right << std::fixed << std::setprecision(2) << std::setw(12) << ms
+                      << std::setw(10) << recall(found, reference)
+                      << std::setw(10) << std::to_string(withTarget) + "/" + std::to_string(frames.size())
+                      << std::endl;
+        }
+    }
+}
@@ -0,0 +1,160 @@
+#include "../include/ImageDecoder.hpp"
+#include <stdexcept>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace {
+    cv::Rect rectOf(const ImageTile &tile) {
+        return {static_cast<int>(tile.x), static_cast<int>(tile.y), static_cast<int>(tile.width),
+                static_cast<int>(tile.height)};
+    }
+
+    uint64_t positionOf(const ImageTile &tile) {
+        return (static_cast<uint64_t>(tile.x) << 32) | tile.y;
+    }
+}
+
+cv::Mat ImageDecoder::decode(const Message &message) {
+    changed = {};
+    if (!message.getImageTiles().empty()) {
+        return applyTiles(message);
+    }
+    const auto &image = message.getImage();
+    if (!image) {
+        return {};
+    }
+    cv::Mat decoded = decodeImage(*image, message.getImageFormat());
+    changed = cv::Rect(0, 0, decoded.cols, decoded.rows);
+    return decoded;
+}
+
+cv::Mat ImageDecoder::decodeImage(const SharedBuffer &image, const ImageFormat &format) {
+    if (image.size() == 0) {
+        return {};
+    }
+    if (!format.isRaw()) {
+        // decode straight from the buffer the frame was received in
+        cv::Mat bytes(1, static_cast<int>(image.size()), CV_8UC1, const_cast<unsigned char *>(image.data()));
+        return cv::imdecode(bytes, cv::IMREAD_COLOR);
+    }
+
+    if (format.width > maxDimension || format.height > maxDimension) {
+        return {};
+    }
+    try {
+        pixels = codec.decompress(image, format);
+    } catch (const std::runtime_error &) {
+        return {};
+    }
+    // cv::Mat has no read-only view; nothing writes through it, see decode()
+    auto *data = const_cast<unsigned char *>(pixels.data());
+    const int width = static_cast<int>(format.width);
+    const int height = static_cast<int>(format.height);
+    switch (format.encoding) {
+        case ImageEncoding::BGR:
+            return cv::Mat(height, width, CV_8UC3, data);
+        case ImageEncoding::GRAY:
+            cv::cvtColor(cv::Mat(height, width, CV_8UC1, data), converted, cv::COLOR_GRAY2BGR);
+            return converted;
+        case ImageEncoding::YUV420:
+            // the three planes stacked as one single-channel image, which is how OpenCV takes I420
+            cv::cvtColor(cv::Mat(height * 3 / 2, width, CV_8UC1, data), converted, cv::COLOR_YUV2BGR_I420);
+            return converted;
+        default:
+            return {};
+    }
+}
+
+cv::Mat ImageDecoder::applyTiles(const Message &message) {
+    const ImageFormat &format = message.getImageFormat();
+    const auto &tiles = message.getImageTiles();
+    if (format.width == 0 || format.height == 0 || format.width > maxDimension || format.height > maxDimension) {
+        return {};
+    }
+    const cv::Size size(static_cast<int>(format.width), static_cast<int>(format.height));
+    const bool keyframe = message.getBaseFrameId() == 0;
+    auto found = canvases.find(message.getSessionId());
+    if (!keyframe && (found == canvases.end() || found->second.keyframeId != message.getBaseFrameId() ||
+                      found->second.frame.size() != size)) {
+        return {};
+    }
+
+    // a tile the previous update sent with the same bytes is already in the frame
+    unchangedTiles.assign(tiles.size(), false);
+    repeatedTiles.clear();
+    if (!keyframe) {
+        const auto &previous = found->second.applied;
+        applied.clear();
+        for (size_t i = 0; i < previous.size(); ++i) {
+            applied.emplace(positionOf(previous[i]), i);
+        }
+        repeatedTiles.assign(previous.size(), false);
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            auto match = applied.find(positionOf(tiles[i]));
+            if (match != applied.end() && previous[match->second] == tiles[i]) {
+                unchangedTiles[i] = true;
+                repeatedTiles[match->second] = true;
+            }
+        }
+    }
+
+    // decode everything before touching the frame, so a broken update leaves it as it was
+    if (decodedTiles.size() < tiles.size()) {
+        decodedTiles.resize(tiles.size());
+    }
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        const ImageTile &tile = tiles[i];
+        if (unchangedTiles[i]) {
+            continue;
+        }
+        if (tile.width == 0 || tile.height == 0 || static_cast<uint64_t>(tile.x) + tile.width > format.width ||
+            static_cast<uint64_t>(tile.y) + tile.height > format.height) {
+            return {};
+        }
+        const cv::Mat decoded = decodeImage(tile.pixels, tile.formatIn(format));
+        if (decoded.size() != rectOf(tile).size()) {
+            return {};
+        }
+        decoded.copyTo(decodedTiles[i]);
+    }
+
+    if (keyframe) {
+        if (found == canvases.end()) {
+            if (canvases.size() >= maxCanvases) {
+                canvases.erase(canvases.begin());
+            }
+            found = canvases.try_emplace(message.getSessionId()).first;
+        }
+        Canvas &canvas = found->second;
+        canvas.keyframe.create(size, CV_8UC3);
+        canvas.keyframe.setTo(cv::Scalar::all(0));
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            decodedTiles[i].copyTo(canvas.keyframe(rectOf(tiles[i])));
+        }
+        canvas.keyframe.copyTo(canvas.frame);
+        canvas.keyframeId = message.getFrameId();
+        canvas.applied.clear();
+        changed = cv::Rect(cv::Point(), size);
+    } else {
+        Canvas &canvas = found->second;
+        // undo what the previous update changed and this one does not repeat, then draw the new tiles
+        for (size_t i = 0; i < canvas.applied.size(); ++i) {
+            if (!repeatedTiles[i]) {
+                const cv::Rect rect = rectOf(canvas.applied[i]);
+                canvas.keyframe(rect).copyTo(canvas.frame(rect));
+                changed |= rect;
+            }
+        }
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            if (!unchangedTiles[i]) {
+                const cv::Rect rect = rectOf(tiles[i]);
+                decodedTiles[i].copyTo(canvas.frame(rect));
+                changed |= rect;
+            }
+        }
+        canvas.applied.assign(tiles.begin(), tiles.end());
+    }
+    // the caller draws into the image, which must not end up in the next update's frame
+    found->second.frame.copyTo(output);
+    return output;
+}
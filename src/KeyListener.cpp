@@ -22,7 +22,6 @@ void KeyListener::detectKeys() {
     while (isRunning) {
         Message message;
         if ((ch = getch()) != ERR) {
-            keyQueue.push(ch);
             updateSpeed(ch);
             previousKey = ch;
             switch (ch) {
@@ -65,35 +64,29 @@ void KeyListener::detectKeys() {
             }
             message.setSpeed(speed);
             message.setType(Type::COMMAND);
-            std::lock_guard<std::mutex> lock(mtx);
-            messageQueue.push(message);
-            cv.notify_one();
+            // the key goes first, so it is there once hasMessages() sees the message; keys typed while the
+            // queues are full are dropped
+            keyQueue.push(static_cast<char>(ch));
+            messageQueue.push(std::move(message));
+            notifier.notify();
         }
     }
 }
 
 Message KeyListener::getMessage() {
-    Message message;
-    std::lock_guard<std::mutex> lock(mtx);
-    if (!messageQueue.empty()) {
-        message = messageQueue.front();
-        messageQueue.pop();
-    } else {
+    auto message = messageQueue.pop();
+    if (!message) {
         throw std::runtime_error("No message available");
     }
-    return message;
+    return std::move(*message);
 }
 
 char KeyListener::getKey() {
-    char key;
-    std::lock_guard<std::mutex> lock(mtx);
-    if (!keyQueue.empty()) {
-        key = keyQueue.front();
-        keyQueue.pop();
-    } else {
+    auto key = keyQueue.pop();
+    if (!key) {
         throw std::runtime_error("No key available");
     }
-    return key;
+    return *key;
 }
 
 void KeyListener::updateSpeed(int ch) {
@@ -104,12 +97,13 @@ void KeyListener::updateSpeed(int ch) {
     }
 }
 
-std::mutex &KeyListener::getMtx() {
-    return mtx;
+bool KeyListener::hasMessages() const {
+    return !messageQueue.empty();
 }
 
-bool KeyListener::hasMessages() const {
-    return !messageQueue.empty() || !keyQueue.empty();
+bool KeyListener::waitForMessages(std::chrono::milliseconds timeout) {
+    notifier.wait([this] { return hasMessages() || !isRunning; }, timeout);
+    return hasMessages();
 }
 
 bool KeyListener::running() const {
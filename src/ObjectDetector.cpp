@@ -1,7 +1,17 @@
 
 #include "ObjectDetector.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+ObjectDetector::ObjectDetector(std::string modelConfigurationPath, std::string modelWeightsPath, std::string classesFilePath,
+                               Size inputSize) : inputSize(inputSize) {
+    if (inputSize.width <= 0 || inputSize.height <= 0 || inputSize.width % inputStride != 0 ||
+        inputSize.height % inputStride != 0) {
+        throw std::invalid_argument("Network input size must be a positive multiple of " +
+                                    std::to_string(inputStride));
+    }
 
-ObjectDetector::ObjectDetector(std::string modelConfigurationPath, std::string modelWeightsPath, std::string classesFilePath) {
     // Load the neural network
     net = readNetFromDarknet(modelConfigurationPath, modelWeightsPath);
     net.setPreferableBackend(DNN_BACKEND_OPENCV);
@@ -9,6 +19,10 @@ ObjectDetector::ObjectDetector(std::string modelConfigurationPath, std::string m
 
     // Load class names
     classNames = getClassNames(classesFilePath);
+    for (size_t i = 0; i < classNames.size(); ++i) {
+        classIds.emplace(classNames[i], static_cast<int>(i));
+    }
+    outputNames = getOutputsNames(net);
 }
 
 // Function to get class names
@@ -23,18 +37,15 @@ std::vector<std::string> ObjectDetector::getClassNames(const std::string &classF
 }
 
 // Function to get YOLO output layer names
-const std::vector<String> &ObjectDetector::getOutputsNames(const Net &net) {
-    static std::vector<String> names;
-    if (names.empty()) {
-        // Get indices of output layers
-        const std::vector<int> outLayers = net.getUnconnectedOutLayers();
-        // Get names of all layers in the network
-        const std::vector<String> layersNames = net.getLayerNames();
-        // Get the names of the output layers using their indices
-        names.resize(outLayers.size());
-        for (size_t i = 0; i < outLayers.size(); ++i) {
-            names[i] = layersNames[outLayers[i] - 1];
-        }
+std::vector<String> ObjectDetector::getOutputsNames(const Net &net) {
+    // Get indices of output layers
+    const std::vector<int> outLayers = net.getUnconnectedOutLayers();
+    // Get names of all layers in the network
+    const std::vector<String> layersNames = net.getLayerNames();
+    // Get the names of the output layers using their indices
+    std::vector<String> names(outLayers.size());
+    for (size_t i = 0; i < outLayers.size(); ++i) {
+        names[i] = layersNames[outLayers[i] - 1];
     }
     return names;
 }
@@ -64,63 +75,257 @@ void ObjectDetector::drawPred(int classId, float conf, int left, int top, int ri
     putText(frame, label, Point(left, top), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0, 0, 0), 1);
 }
 
-// Function to detect objects in an image
-Mat ObjectDetector::detectObjects(Mat frame, std::vector<int>& coords, const std::string &objectName) {
-    // Read the image
-    Mat blob;
-    Size size(416, 416);
+void ObjectDetector::setBatching(size_t maxBatch, std::chrono::microseconds maxWait) {
+    std::lock_guard lock(batchMtx);
+    ObjectDetector::maxBatch = std::max<size_t>(maxBatch, 1);
+    ObjectDetector::maxWait = maxWait;
+}
 
-    blobFromImage(frame, blob, 1/255.0, size, {}, true, false);
-    net.setInput(blob);
+void ObjectDetector::setTargetClasses(const std::vector<std::string> &names) {
+    std::vector<int> ids;
+    for (const auto &name: names) {
+        const auto id = classIds.find(name);
+        if (id == classIds.end()) {
+            throw std::invalid_argument("Unknown class " + name);
+        }
+        ids.push_back(id->second);
+    }
+    targetClasses = std::move(ids);
+}
+
+// Function to run the network on several images and collect what it found in each
+std::vector<std::vector<Detection>> ObjectDetector::detect(const std::vector<Mat> &images) {
+    if (images.empty()) {
+        return {};
+    }
+    std::vector<Mat> inputs(images.size());
+    std::vector<Letterbox> placements;
+    for (size_t i = 0; i < images.size(); ++i) {
+        placements.push_back(letterbox(images[i], inputs[i]));
+    }
+    Mat blob;
+    blobFromImages(inputs, blob, 1/255.0, inputSize, {}, true, false);
 
     // Run forward pass
     std::vector<Mat> outs;
-    net.forward(outs, getOutputsNames(net));
+    {
+        std::lock_guard lock(netMtx);
+        net.setInput(blob);
+        net.forward(outs, outputNames);
+    }
 
-    // Post-process the output
-    std::vector<int> classIds;
-    std::vector<float> confidences;
-    std::vector<Rect> boxes;
+    // candidate buffers are sized for one image once and reused for the others
+    yolo::Candidates candidates;
+    size_t rowsPerImage = 0;
+    for (const auto &out: outs) {
+        rowsPerImage += out.dims == 3 ? static_cast<size_t>(out.size[1]) : static_cast<size_t>(out.rows) / images.size();
+    }
+    candidates.reserve(rowsPerImage);
+
+    std::vector<std::vector<Detection>> detections;
+    for (size_t i = 0; i < images.size(); ++i) {
+        detections.push_back(collect(outs, i, images.size(), placements[i], candidates));
+    }
+    return detections;
+}
+
+// Function to scale an image into the network input without distorting it, padding the rest with grey
+ObjectDetector::Letterbox ObjectDetector::letterbox(const Mat &image, Mat &input) const {
+    if (image.size() == inputSize) {
+        input = image;
+        return {1.0, Point()};
+    }
+    const double scale = std::min(static_cast<double>(inputSize.width) / image.cols,
+                                  static_cast<double>(inputSize.height) / image.rows);
+    const Size scaled(std::max(1, static_cast<int>(std::lround(image.cols * scale))),
+                      std::max(1, static_cast<int>(std::lround(image.rows * scale))));
+    const Point offset((inputSize.width - scaled.width) / 2, (inputSize.height - scaled.height) / 2);
+    input.create(inputSize, image.type());
+    input.setTo(Scalar::all(127));
+    Mat content = input(Rect(offset, scaled));
+    if (scaled == image.size()) {
+        image.copyTo(content);
+    } else {
+        resize(image, content, scaled);
+    }
+    return {scale, offset};
+}
+
+// Function to post-process the network's output for one image of a batch
+std::vector<Detection> ObjectDetector::collect(const std::vector<Mat> &outs, size_t index, size_t batchSize,
+                                               const Letterbox &placement, yolo::Candidates &candidates) {
     float confThreshold = 0.5f;
     float nmsThreshold = 0.4f;
 
-    for (const auto &out: outs) {
-        auto data = reinterpret_cast<float *>(out.data);
-        for (int j = 0; j < out.rows; ++j, data += out.cols) {
-            Mat scores = out.row(j).colRange(5, out.cols);
-            Point classIdPoint;
-            double confidence;
-            minMaxLoc(scores, nullptr, &confidence, nullptr, &classIdPoint);
-            if (confidence > confThreshold) {
-                int centerX = static_cast<int>(data[0] * frame.cols);
-                int centerY = static_cast<int>(data[1] * frame.rows);
-                int width = static_cast<int>(data[2] * frame.cols);
-                int height = static_cast<int>(data[3] * frame.rows);
-                int left = centerX - width / 2;
-                int top = centerY - height / 2;
-                classIds.push_back(classIdPoint.x);
-                confidences.emplace_back(static_cast<float>(confidence));
-                boxes.emplace_back(left, top, width, height);
-            }
+    candidates.clear();
+    for (const auto &batchOut: outs) {
+        // one row per candidate box; a batch adds a leading dimension, one plane per image
+        const float *rows;
+        int count;
+        int cols;
+        if (batchOut.dims == 3) {
+            count = batchOut.size[1];
+            cols = batchOut.size[2];
+            rows = batchOut.ptr<float>(static_cast<int>(index));
+        } else {
+            count = batchOut.rows / static_cast<int>(batchSize);
+            cols = batchOut.cols;
+            rows = batchOut.ptr<float>(static_cast<int>(index) * count);
+        }
+        if (targetClasses.empty()) {
+            yolo::decode(rows, static_cast<size_t>(count), static_cast<size_t>(cols), confThreshold, candidates);
+        } else {
+            yolo::decode(rows, static_cast<size_t>(count), static_cast<size_t>(cols), confThreshold, targetClasses,
+                         candidates);
         }
+    }
 
+    std::vector<Rect> boxes;
+    boxes.reserve(candidates.size());
+    // boxes are relative to the network input; back into the image's pixels
+    const double scaleX = inputSize.width / placement.scale;
+    const double scaleY = inputSize.height / placement.scale;
+    const double offsetX = placement.offset.x / placement.scale;
+    const double offsetY = placement.offset.y / placement.scale;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        int centerX = static_cast<int>(candidates.centerX[i] * scaleX - offsetX);
+        int centerY = static_cast<int>(candidates.centerY[i] * scaleY - offsetY);
+        int width = static_cast<int>(candidates.width[i] * scaleX);
+        int height = static_cast<int>(candidates.height[i] * scaleY);
+        int left = centerX - width / 2;
+        int top = centerY - height / 2;
+        boxes.emplace_back(left, top, width, height);
     }
 
     // Non-maximum suppression to remove redundant overlapping boxes
     std::vector<int> indices;
-    NMSBoxes(boxes, confidences, confThreshold, nmsThreshold, indices);
+    NMSBoxes(boxes, candidates.score, confThreshold, nmsThreshold, indices);
 
+    std::vector<Detection> detections;
     for (int idx: indices) {
-        Rect box = boxes[idx];
+        detections.push_back({candidates.classId[idx], candidates.score[idx], boxes[idx]});
+    }
+    return detections;
+}
+
+// Function to detect objects in one image, batched with those other threads detect meanwhile
+std::vector<Detection> ObjectDetector::infer(const Mat &image) {
+    Request request{image, std::chrono::steady_clock::now(), {}, {}};
+    std::unique_lock lock(batchMtx);
+    pending.push_back(&request);
+    batchChanged.notify_all();
+    while (!request.done) {
+        if (busy || pending.empty()) {
+            batchChanged.wait(lock);
+            continue;
+        }
+        // images submitted while the network was busy go in together; wait for more only until the batch is full
+        // or its oldest image has waited long enough
+        busy = true;
+        batchChanged.wait_until(lock, pending.front()->submitted + maxWait,
+                                [this] { return pending.size() >= maxBatch; });
+        const auto taken = static_cast<std::ptrdiff_t>(std::min(pending.size(), maxBatch));
+        const std::vector<Request *> batch(pending.begin(), pending.begin() + taken);
+        pending.erase(pending.begin(), pending.begin() + taken);
+        lock.unlock();
+
+        std::vector<Mat> images;
+        for (const Request *member: batch) {
+            images.push_back(member->image);
+        }
+        std::vector<std::vector<Detection>> detections;
+        std::exception_ptr error;
+        try {
+            detections = detect(images);
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        lock.lock();
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (error) {
+                batch[i]->error = error;
+            } else {
+                batch[i]->detections = std::move(detections[i]);
+            }
+            batch[i]->done = true;
+        }
+        // whoever is left over runs the next batch
+        busy = false;
+        batchChanged.notify_all();
+    }
+    if (request.error) {
+        std::rethrow_exception(request.error);
+    }
+    return std::move(request.detections);
+}
+
+// Function to choose the part of a frame to run the network on after the changed region
+Rect ObjectDetector::regionToInfer(const Size &frameSize, const Rect &changed, const std::vector<Detection> &previous) {
+    const Rect whole(Point(), frameSize);
+    Rect region = Rect(changed.x - regionMargin, changed.y - regionMargin, changed.width + 2 * regionMargin,
+                       changed.height + 2 * regionMargin) & whole;
+    // objects reaching into the region are detected again, so they must fit into it as a whole
+    for (bool grown = true; grown;) {
+        grown = false;
+        for (const auto &detection: previous) {
+            const Rect merged = region | (detection.box & whole);
+            if ((detection.box & region).area() > 0 && merged != region) {
+                region = merged;
+                grown = true;
+            }
+        }
+    }
+    return region;
+}
+
+// Function to report the objects found: coordinates of the first one named objectName, and boxes drawn
+Mat ObjectDetector::report(Mat frame, const std::vector<Detection> &detections, std::vector<int> &coords,
+                           const std::string &objectName) {
+    const auto object = classIds.find(objectName);
+    const int objectId = object != classIds.end() ? object->second : -1;
+    for (const auto &detection: detections) {
+        const Rect &box = detection.box;
         // push coordinates of the center of the object to the vector
-        if (classNames[classIds[idx]] == objectName && coords.size() < 2) {
+        if (detection.classId == objectId && coords.size() < 2) {
             coords.push_back(box.x + box.width / 2);
             coords.push_back(box.y + box.height / 2);
         }
         // draw bounding box
-        drawPred(classIds[idx], confidences[idx], box.x, box.y, box.x + box.width, box.y + box.height, frame,
-                 classNames);
+        drawPred(detection.classId, detection.confidence, box.x, box.y, box.x + box.width, box.y + box.height,
+                 frame, classNames);
     }
 
     return frame;
 }
+
+// Function to detect objects in an image
+Mat ObjectDetector::detectObjects(Mat frame, std::vector<int>& coords, const std::string &objectName) {
+    return report(frame, infer(frame), coords, objectName);
+}
+
+// Function to detect objects in the changed part of an image
+Mat ObjectDetector::detectObjects(Mat frame, std::vector<int>& coords, const std::string &objectName,
+                                  const Rect &changed, DetectionCache &cache) {
+    if (cache.frameSize != frame.size()) {
+        cache.detections = infer(frame);
+    } else if (!changed.empty()) {
+        const Rect region = regionToInfer(frame.size(), changed, cache.detections);
+        if (region.area() > maxRegionShare * frame.size().area()) {
+            cache.detections = infer(frame);
+        } else {
+            // everything in the region is detected again; the crop is scaled to the network input like a frame
+            std::erase_if(cache.detections, [&region](const Detection &detection) {
+                return (detection.box & region).area() > 0;
+            });
+            for (auto detection: infer(frame(region))) {
+                detection.box += region.tl();
+                cache.detections.push_back(detection);
+            }
+            std::stable_sort(cache.detections.begin(), cache.detections.end(),
+                             [](const Detection &a, const Detection &b) { return a.confidence > b.confidence; });
+        }
+    }
+    cache.frameSize = frame.size();
+    return report(frame, cache.detections, coords, objectName);
+}
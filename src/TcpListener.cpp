@@ -0,0 +1,140 @@
+#include "../include/TcpListener.hpp"
+#include <stdexcept>
+#include <string>
+#include <cerrno>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+TcpConnection::TcpConnection(int fd) : fd(fd) {}
+
+int TcpConnection::read(unsigned char *buffer, size_t size) {
+    ssize_t n;
+    do {
+        n = ::recv(fd, buffer, size, 0);
+    } while (n < 0 && errno == EINTR);
+    return static_cast<int>(n);
+}
+
+bool TcpConnection::write(const unsigned char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+int TcpConnection::writeSome(const unsigned char *data, size_t size) {
+    ssize_t n;
+    do {
+        n = ::send(fd, data, size, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    return static_cast<int>(n);
+}
+
+namespace {
+    void setNonBlockingFlag(int fd, bool enabled) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags < 0) {
+            return;
+        }
+        fcntl(fd, F_SETFL, enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+    }
+}
+
+void TcpConnection::setNonBlocking(bool enabled) {
+    setNonBlockingFlag(fd, enabled);
+}
+
+void TcpConnection::setLowLatency(bool enabled) {
+    int value = enabled ? 1 : 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+#ifdef TCP_QUICKACK
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &value, sizeof(value));
+#endif
+}
+
+uint32_t TcpConnection::peerAddress() const {
+    sockaddr_in address{};
+    socklen_t length = sizeof(address);
+    if (::getpeername(fd, reinterpret_cast<sockaddr *>(&address), &length) < 0 || address.sin_family != AF_INET) {
+        return 0;
+    }
+    return ntohl(address.sin_addr.s_addr);
+}
+
+int TcpConnection::nativeHandle() const {
+    return fd;
+}
+
+void TcpConnection::close() {
+    int old = fd.exchange(-1);
+    if (old >= 0) {
+        ::shutdown(old, SHUT_RDWR);
+        ::close(old);
+    }
+}
+
+TcpConnection::~TcpConnection() {
+    close();
+}
+
+TcpListener::TcpListener(uint16_t port, int backlog) : fd(::socket(AF_INET, SOCK_STREAM, 0)) {
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create socket");
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || ::listen(fd, backlog) < 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to bind to port " + std::to_string(port));
+    }
+}
+
+std::unique_ptr<TcpConnection> TcpListener::accept() {
+    int client;
+    do {
+        client = ::accept(fd, nullptr, nullptr);
+    } while (client < 0 && errno == EINTR);
+    if (client < 0) {
+        return nullptr;
+    }
+    return std::make_unique<TcpConnection>(client);
+}
+
+void TcpListener::setNonBlocking(bool enabled) {
+    setNonBlockingFlag(fd, enabled);
+}
+
+int TcpListener::nativeHandle() const {
+    return fd;
+}
+
+void TcpListener::close() {
+    int old = fd.exchange(-1);
+    if (old >= 0) {
+        ::shutdown(old, SHUT_RDWR);
+        ::close(old);
+    }
+}
+
+TcpListener::~TcpListener() {
+    close();
+}
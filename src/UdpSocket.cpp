@@ -0,0 +1,68 @@
+#include "../include/UdpSocket.hpp"
+#include <stdexcept>
+#include <cerrno>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+UdpSocket::UdpSocket(uint16_t port, int receiveBufferSize)
+        : fd(::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) {
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create socket");
+    }
+    if (receiveBufferSize > 0) {
+        // capped by net.core.rmem_max
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receiveBufferSize, sizeof(receiveBufferSize));
+    }
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to bind to port " + std::to_string(port));
+    }
+}
+
+int UdpSocket::receive(unsigned char *buffer, size_t size, uint32_t &sourceAddress, uint16_t &sourcePort) {
+    sockaddr_in source{};
+    socklen_t length = sizeof(source);
+    ssize_t n;
+    do {
+        n = ::recvfrom(fd, buffer, size, 0, reinterpret_cast<sockaddr *>(&source), &length);
+    } while (n < 0 && errno == EINTR);
+    sourceAddress = ntohl(source.sin_addr.s_addr);
+    sourcePort = ntohs(source.sin_port);
+    return static_cast<int>(n);
+}
+
+bool UdpSocket::sendTo(const unsigned char *data, size_t size, const std::string &host, uint16_t port) {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1) {
+        return false;
+    }
+    ssize_t n;
+    do {
+        n = ::sendto(fd, data, size, 0, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+    } while (n < 0 && errno == EINTR);
+    return n == static_cast<ssize_t>(size);
+}
+
+int UdpSocket::nativeHandle() const {
+    return fd;
+}
+
+void UdpSocket::close() {
+    int old = fd.exchange(-1);
+    if (old >= 0) {
+        ::close(old);
+    }
+}
+
+UdpSocket::~UdpSocket() {
+    close();
+}
@@ -0,0 +1,143 @@
+#ifndef RVR_SERVER_BUFFERPOOL_HPP
+#define RVR_SERVER_BUFFERPOOL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * @class BufferPool
+ * @brief Hands out uninitialised byte buffers of an exact size and takes them back for reuse when released.
+ *
+ * Used for frame payloads so that a steady stream of similarly sized camera frames does not allocate
+ * (or zero-fill) a new buffer per frame. Buffers may be released from any thread, and may outlive the pool.
+ */
+class BufferPool {
+private:
+    struct Block {
+        std::unique_ptr<unsigned char[]> data;
+        size_t capacity = 0;
+    };
+
+    /**
+     * @brief The free list, shared with outstanding buffers so they can be released after the pool is gone.
+     */
+    struct State {
+        std::mutex mtx;
+        std::vector<Block> freeBlocks;
+        size_t maxPooled;
+
+        void release(Block block) {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (freeBlocks.size() < maxPooled) {
+                freeBlocks.push_back(std::move(block));
+            }
+        }
+    };
+
+    std::shared_ptr<State> state;
+
+public:
+    /**
+     * @class Buffer
+     * @brief Move-only handle to a pooled buffer; returns the memory to its pool on destruction.
+     */
+    class Buffer {
+    private:
+        std::shared_ptr<State> pool;
+        Block block;
+        size_t length = 0;
+
+        friend class BufferPool;
+
+        Buffer(std::shared_ptr<State> pool, Block block, size_t length)
+                : pool(std::move(pool)), block(std::move(block)), length(length) {}
+
+    public:
+        Buffer() = default;
+
+        Buffer(Buffer &&other) noexcept
+                : pool(std::move(other.pool)), block(std::move(other.block)),
+                  length(std::exchange(other.length, 0)) {}
+
+        Buffer &operator=(Buffer &&other) noexcept {
+            if (this != &other) {
+                reset();
+                pool = std::move(other.pool);
+                block = std::move(other.block);
+                length = std::exchange(other.length, 0);
+            }
+            return *this;
+        }
+
+        ~Buffer() {
+            reset();
+        }
+
+        unsigned char *data() {
+            return block.data.get();
+        }
+
+        const unsigned char *data() const {
+            return block.data.get();
+        }
+
+        size_t size() const {
+            return length;
+        }
+
+        std::string_view view() const {
+            return {reinterpret_cast<const char *>(block.data.get()), length};
+        }
+
+        /**
+         * @brief Returns the memory to the pool (if any) and leaves the handle empty.
+         */
+        void reset() {
+            if (pool && block.data) {
+                pool->release(std::move(block));
+            }
+            pool.reset();
+            block = {};
+            length = 0;
+        }
+    };
+
+    explicit BufferPool(size_t maxPooled = 8) : state(std::make_shared<State>()) {
+        state->maxPooled = maxPooled;
+    }
+
+    /**
+     * @brief Takes a buffer of exactly size bytes from the pool, allocating one if no pooled buffer is large enough.
+     *        The contents are uninitialised.
+     *
+     * @param size The number of bytes required.
+     * @return A handle that returns the buffer to this pool when destroyed.
+     */
+    Buffer acquire(size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(state->mtx);
+            auto &freeBlocks = state->freeBlocks;
+            // pick the smallest pooled block that fits
+            auto best = freeBlocks.end();
+            for (auto it = freeBlocks.begin(); it != freeBlocks.end(); ++it) {
+                if (it->capacity >= size && (best == freeBlocks.end() || it->capacity < best->capacity)) {
+                    best = it;
+                }
+            }
+            if (best != freeBlocks.end()) {
+                Block block = std::move(*best);
+                freeBlocks.erase(best);
+                return {state, std::move(block), size};
+            }
+        }
+        Block block{std::unique_ptr<unsigned char[]>(new unsigned char[std::max<size_t>(size, 1)]), size};
+        return {state, std::move(block), size};
+    }
+};
+
+#endif //RVR_SERVER_BUFFERPOOL_HPP
@@ -0,0 +1,248 @@
+#ifndef RVR_SERVER_DATAGRAMREASSEMBLER_HPP
+#define RVR_SERVER_DATAGRAMREASSEMBLER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @class DatagramReassembler
+ * @brief Splits frames into UDP datagrams and puts them back together, tolerating loss and reordering.
+ *
+ * Every datagram starts with a 12-byte header in network byte order:
+ * ```
+ * uint32 frameId        increases by one per frame (wrapping)
+ * uint16 fragmentIndex  0 .. fragmentCount - 1
+ * uint16 fragmentCount  number of datagrams the frame was split into
+ * uint32 frameLength    total payload length of the frame
+ * ```
+ * followed by the fragment's share of the payload. All fragments but the last carry
+ * ceil(frameLength / fragmentCount) bytes, so each one can be copied straight to its final position.
+ *
+ * Only the newest frame matters, so a frame is dropped as soon as a newer one has been completed, and
+ * incomplete frames are dropped once they are older than the deadline. Nothing is ever retransmitted.
+ * The buffer of a frame is allocated from its first datagram's header, so frames announcing more than
+ * the maximum frame size are ignored rather than trusted.
+ */
+class DatagramReassembler {
+public:
+    static constexpr size_t headerSize = 12;
+    static constexpr size_t defaultDatagramSize = 1400;     ///< Fits an Ethernet MTU with IP and UDP headers.
+    static constexpr size_t maxDatagramSize = 65507;        ///< Largest UDP payload over IPv4.
+    static constexpr size_t defaultMaxFrameSize = 4 * 1024 * 1024; ///< Ample for a compressed camera frame.
+
+    using Clock = std::chrono::steady_clock;
+
+private:
+    struct PartialFrame {
+        std::string data;
+        std::vector<bool> received;
+        uint16_t missing = 0;
+        Clock::time_point started;
+    };
+
+    std::map<uint32_t, PartialFrame> frames;    ///< Incomplete frames by id.
+    std::optional<uint32_t> lastCompleted;
+    const Clock::duration deadline;
+    const size_t maxFrames;
+    const size_t maxFrameSize;
+    uint64_t discarded = 0;
+
+    static uint32_t read32(const unsigned char *p) {
+        return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+               (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+    }
+
+    static uint16_t read16(const unsigned char *p) {
+        return static_cast<uint16_t>((p[0] << 8) | p[1]);
+    }
+
+    static void write32(char *p, uint32_t value) {
+        p[0] = static_cast<char>(value >> 24);
+        p[1] = static_cast<char>(value >> 16);
+        p[2] = static_cast<char>(value >> 8);
+        p[3] = static_cast<char>(value);
+    }
+
+    static void write16(char *p, uint16_t value) {
+        p[0] = static_cast<char>(value >> 8);
+        p[1] = static_cast<char>(value);
+    }
+
+    /**
+     * @brief Whether frame id a was sent after b, allowing for wrap-around.
+     */
+    static bool newer(uint32_t a, uint32_t b) {
+        return static_cast<int32_t>(a - b) > 0;
+    }
+
+    std::map<uint32_t, PartialFrame>::iterator oldest() {
+        auto result = frames.begin();
+        for (auto it = frames.begin(); it != frames.end(); ++it) {
+            if (newer(result->first, it->first)) {
+                result = it;
+            }
+        }
+        return result;
+    }
+
+    void discard(std::map<uint32_t, PartialFrame>::iterator it) {
+        frames.erase(it);
+        discarded++;
+    }
+
+public:
+    /**
+     * @param deadline How long an incomplete frame is kept waiting for its missing fragments.
+     * @param maxFrames Maximum number of incomplete frames kept at once; the oldest is dropped beyond that.
+     * @param maxFrameSize Largest frame accepted, in bytes; datagrams of longer frames are ignored.
+     */
+    explicit DatagramReassembler(Clock::duration deadline = std::chrono::milliseconds(100), size_t maxFrames = 4,
+                                 size_t maxFrameSize = defaultMaxFrameSize)
+            : deadline(deadline), maxFrames(std::max<size_t>(maxFrames, 1)), maxFrameSize(maxFrameSize) {}
+
+    /**
+     * @brief Splits a frame into datagrams of at most datagramSize bytes, headers included.
+     *
+     * @throws std::invalid_argument if the frame needs more than 65535 datagrams or datagramSize is out of range.
+     */
+    static std::vector<std::string> fragment(std::string_view frame, uint32_t frameId,
+                                             size_t datagramSize = defaultDatagramSize) {
+        if (datagramSize <= headerSize || datagramSize > maxDatagramSize) {
+            throw std::invalid_argument("Datagram size out of range");
+        }
+        const size_t capacity = datagramSize - headerSize;
+        const size_t count = std::max<size_t>(1, (frame.size() + capacity - 1) / capacity);
+        if (count > UINT16_MAX) {
+            throw std::invalid_argument("Frame too large to fragment");
+        }
+        const size_t share = (frame.size() + count - 1) / count;
+
+        std::vector<std::string> datagrams;
+        datagrams.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            const size_t offset = std::min(i * share, frame.size());
+            const size_t length = std::min(share, frame.size() - offset);
+            std::string datagram(headerSize + length, '\0');
+            write32(datagram.data(), frameId);
+            write16(datagram.data() + 4, static_cast<uint16_t>(i));
+            write16(datagram.data() + 6, static_cast<uint16_t>(count));
+            write32(datagram.data() + 8, static_cast<uint32_t>(frame.size()));
+            std::memcpy(datagram.data() + headerSize, frame.data() + offset, length);
+            datagrams.push_back(std::move(datagram));
+        }
+        return datagrams;
+    }
+
+    /**
+     * @brief Adds a received datagram.
+     *
+     * @param datagram The datagram, header included. Malformed, oversized, duplicate and late datagrams are
+     *        ignored.
+     * @param now The current time, for the deadline.
+     * @return The frame payload if this datagram completed a frame.
+     */
+    std::optional<std::string> add(std::string_view datagram, Clock::time_point now = Clock::now()) {
+        if (datagram.size() < headerSize) {
+            return std::nullopt;
+        }
+        const auto *header = reinterpret_cast<const unsigned char *>(datagram.data());
+        const uint32_t frameId = read32(header);
+        const uint16_t index = read16(header + 4);
+        const uint16_t count = read16(header + 6);
+        const uint32_t length = read32(header + 8);
+        const std::string_view payload = datagram.substr(headerSize);
+        if (count == 0 || index >= count || length > maxFrameSize) {
+            return std::nullopt;
+        }
+        // a newer frame was already delivered
+        if (lastCompleted && !newer(frameId, *lastCompleted)) {
+            return std::nullopt;
+        }
+
+        // all fragments but the last carry the same share, the last one the rest
+        const size_t share = (static_cast<size_t>(length) + count - 1) / count;
+        if (share > maxDatagramSize - headerSize) {
+            return std::nullopt;
+        }
+        const size_t offset = static_cast<size_t>(index) * share;
+        const size_t expected = index + 1 < count ? share : (offset <= length ? length - offset : SIZE_MAX);
+        if (payload.size() != expected) {
+            return std::nullopt;
+        }
+
+        auto it = frames.find(frameId);
+        if (it == frames.end()) {
+            expire(now);
+            if (frames.size() >= maxFrames) {
+                discard(oldest());
+            }
+            PartialFrame frame;
+            frame.data.resize(length);
+            frame.received.assign(count, false);
+            frame.missing = count;
+            frame.started = now;
+            it = frames.emplace(frameId, std::move(frame)).first;
+        }
+        auto &frame = it->second;
+        if (frame.data.size() != length || frame.received.size() != count || frame.received[index]) {
+            return std::nullopt;
+        }
+        std::memcpy(frame.data.data() + offset, payload.data(), payload.size());
+        frame.received[index] = true;
+        if (--frame.missing > 0) {
+            return std::nullopt;
+        }
+
+        std::string complete = std::move(frame.data);
+        frames.erase(it);
+        lastCompleted = frameId;
+        // everything older is superseded
+        for (auto older = frames.begin(); older != frames.end();) {
+            if (newer(frameId, older->first)) {
+                older = frames.erase(older);
+                discarded++;
+            } else {
+                ++older;
+            }
+        }
+        return complete;
+    }
+
+    /**
+     * @brief Drops incomplete frames that have waited longer than the deadline.
+     */
+    void expire(Clock::time_point now = Clock::now()) {
+        for (auto it = frames.begin(); it != frames.end();) {
+            if (now - it->second.started > deadline) {
+                it = frames.erase(it);
+                discarded++;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    /**
+     * @brief Returns the number of frames dropped incomplete, because they were superseded or timed out.
+     */
+    uint64_t discardedFrames() const {
+        return discarded;
+    }
+
+    /**
+     * @brief Returns the number of incomplete frames currently kept.
+     */
+    size_t pendingFrames() const {
+        return frames.size();
+    }
+};
+
+#endif //RVR_SERVER_DATAGRAMREASSEMBLER_HPP
@@ -0,0 +1,151 @@
+#ifndef RVR_SERVER_DIRECTIONSET_HPP
+#define RVR_SERVER_DIRECTIONSET_HPP
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <vector>
+
+enum class Direction {
+    FORWARD,
+    BACKWARD,
+    LEFT,
+    RIGHT
+};
+
+/**
+ * @class DirectionSet
+ * @brief Set of Directions stored as a 4-bit mask, bit i standing for the Direction with value i.
+ *
+ * Replaces the std::vector<Direction> Message used to hold: adding a direction never allocates, copies are a
+ * single byte and equality is a single comparison. It offers the read-only part of the vector interface
+ * (size(), operator[], iteration) so code written against the vector keeps working; directions are visited in
+ * the order of the enum, and adding a direction twice has no effect.
+ */
+class DirectionSet {
+private:
+    uint8_t mask = 0;
+
+    static constexpr uint8_t bitOf(Direction direction) {
+        return static_cast<uint8_t>(1u << static_cast<unsigned>(direction));
+    }
+
+public:
+    static constexpr uint8_t allBits = 0x0f;
+
+    /**
+     * @brief Visits the directions of a set, lowest bit first.
+     */
+    class Iterator {
+    private:
+        uint8_t remaining = 0;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Direction;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = Direction;
+
+        constexpr Iterator() = default;
+
+        constexpr explicit Iterator(uint8_t remaining) : remaining(remaining) {}
+
+        constexpr Direction operator*() const {
+            return static_cast<Direction>(std::countr_zero(remaining));
+        }
+
+        constexpr Iterator &operator++() {
+            remaining &= static_cast<uint8_t>(remaining - 1);
+            return *this;
+        }
+
+        constexpr Iterator operator++(int) {
+            Iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        constexpr bool operator==(const Iterator &rhs) const = default;
+    };
+
+    constexpr DirectionSet() = default;
+
+    constexpr DirectionSet(std::initializer_list<Direction> directions) {
+        for (auto direction: directions) {
+            insert(direction);
+        }
+    }
+
+    DirectionSet(const std::vector<Direction> &directions) {
+        for (auto direction: directions) {
+            insert(direction);
+        }
+    }
+
+    /**
+     * @brief Builds a set from its mask; bits above allBits are ignored.
+     */
+    static constexpr DirectionSet fromBits(uint8_t bits) {
+        DirectionSet set;
+        set.mask = bits & allBits;
+        return set;
+    }
+
+    constexpr uint8_t bits() const {
+        return mask;
+    }
+
+    constexpr void insert(Direction direction) {
+        mask |= bitOf(direction);
+    }
+
+    constexpr void erase(Direction direction) {
+        mask &= static_cast<uint8_t>(~bitOf(direction));
+    }
+
+    constexpr bool contains(Direction direction) const {
+        return mask & bitOf(direction);
+    }
+
+    constexpr void clear() {
+        mask = 0;
+    }
+
+    constexpr size_t size() const {
+        return static_cast<size_t>(std::popcount(mask));
+    }
+
+    constexpr bool empty() const {
+        return mask == 0;
+    }
+
+    /**
+     * @brief Returns the index-th direction in enum order; index must be below size().
+     */
+    constexpr Direction operator[](size_t index) const {
+        auto it = begin();
+        while (index-- > 0) {
+            ++it;
+        }
+        return *it;
+    }
+
+    constexpr Iterator begin() const {
+        return Iterator(mask);
+    }
+
+    constexpr Iterator end() const {
+        return Iterator();
+    }
+
+    std::vector<Direction> toVector() const {
+        return {begin(), end()};
+    }
+
+    constexpr bool operator==(const DirectionSet &rhs) const = default;
+};
+
+#endif //RVR_SERVER_DIRECTIONSET_HPP
@@ -0,0 +1,174 @@
+#ifndef RVR_SERVER_FRAMEBUFFER_HPP
+#define RVR_SERVER_FRAMEBUFFER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+/**
+ * @class FrameBuffer
+ * @brief Per-connection receive buffer that reassembles length-prefixed frames.
+ *
+ * Incoming bytes are appended at the write cursor and complete frames are handed out as views
+ * starting at the read cursor. Consumed bytes are never erased from the front; the unread tail
+ * is only moved back to the start of the storage when the buffer runs out of room, so each byte
+ * is moved at most once and complete frames are never copied.
+ *
+ * Every frame is preceded by its length as a 4-byte unsigned integer in network byte order. If the highest bit
+ * of the prefix is set (chunkFlag), the frame is one chunk of a larger message rather than a message of its own.
+ * The next bit (networkOrderFlag) takes no part in the length either; a peer sets it to announce that it reads
+ * prefixes in network byte order too, see networkOrderAnnounced().
+ */
+class FrameBuffer {
+public:
+    static constexpr uint32_t chunkFlag = 0x80000000u;
+    static constexpr uint32_t networkOrderFlag = 0x40000000u;
+
+    /**
+     * @brief A complete frame; payload points into the buffer.
+     */
+    struct Frame {
+        std::string_view payload;
+        bool chunk;             ///< Whether the prefix carried chunkFlag.
+    };
+
+private:
+    static constexpr size_t headerSize = sizeof(uint32_t);
+
+    std::vector<unsigned char> storage;
+    size_t readPos = 0;                     ///< Start of the unread data.
+    size_t writePos = 0;                    ///< End of the unread data.
+    std::optional<uint32_t> frameLength;    ///< Length of the frame being assembled, once its prefix is parsed.
+    bool frameIsChunk = false;              ///< Whether the frame being assembled is a chunk.
+    bool networkOrder = false;              ///< Whether any prefix so far carried networkOrderFlag.
+
+    size_t available() const {
+        return writePos - readPos;
+    }
+
+public:
+    explicit FrameBuffer(size_t initialCapacity = 4096) : storage(initialCapacity) {}
+
+    /**
+     * @brief Returns a writable region of at least minSize bytes at the end of the buffered data.
+     *        Views returned by nextFrame() are invalidated by this call.
+     *
+     * @param minSize Minimum number of bytes the caller wants to write.
+     * @return The writable region; its size may exceed minSize.
+     */
+    std::span<unsigned char> prepare(size_t minSize) {
+        if (readPos == writePos) {
+            readPos = writePos = 0;
+        }
+        // grow to hold the whole pending frame at once rather than one chunk at a time
+        size_t needed = minSize;
+        if (frameLength && *frameLength > available()) {
+            needed = std::max(needed, *frameLength - available());
+        }
+        if (storage.size() - writePos < needed) {
+            if (readPos > 0) {
+                std::memmove(storage.data(), storage.data() + readPos, available());
+                writePos -= readPos;
+                readPos = 0;
+            }
+            if (storage.size() - writePos < needed) {
+                storage.resize(writePos + needed);
+            }
+        }
+        return {storage.data() + writePos, storage.size() - writePos};
+    }
+
+    /**
+     * @brief Marks n bytes of the region returned by prepare() as received.
+     */
+    void commit(size_t n) {
+        writePos += n;
+    }
+
+    /**
+     * @brief Extracts the next complete frame, if one has been fully received.
+     *
+     * @return The frame payload (without its length prefix), valid until the next call to prepare(),
+     *         or std::nullopt if more data is needed.
+     */
+    std::optional<Frame> nextFrame() {
+        if (!frameLength) {
+            if (available() < headerSize) {
+                return std::nullopt;
+            }
+            const unsigned char *header = storage.data() + readPos;
+            const uint32_t prefix = (static_cast<uint32_t>(header[0]) << 24) |
+                                    (static_cast<uint32_t>(header[1]) << 16) |
+                                    (static_cast<uint32_t>(header[2]) << 8) |
+                                    static_cast<uint32_t>(header[3]);
+            frameLength = prefix & ~(chunkFlag | networkOrderFlag);
+            frameIsChunk = (prefix & chunkFlag) != 0;
+            networkOrder = networkOrder || (prefix & networkOrderFlag) != 0;
+            readPos += headerSize;
+        }
+
+        if (available() < *frameLength) {
+            return std::nullopt;
+        }
+
+        std::string_view payload(reinterpret_cast<const char *>(storage.data() + readPos), *frameLength);
+        readPos += *frameLength;
+        frameLength.reset();
+        return Frame{payload, frameIsChunk};
+    }
+
+    /**
+     * @brief Returns the length of the frame whose prefix has been parsed but whose payload is still incomplete.
+     */
+    std::optional<uint32_t> pendingFrameLength() const {
+        return frameLength;
+    }
+
+    /**
+     * @brief Returns whether the pending frame is a chunk; only meaningful while pendingFrameLength() is set.
+     */
+    bool pendingFrameIsChunk() const {
+        return frameIsChunk;
+    }
+
+    /**
+     * @brief Returns whether any prefix parsed so far carried networkOrderFlag.
+     */
+    bool networkOrderAnnounced() const {
+        return networkOrder;
+    }
+
+    /**
+     * @brief Hands the pending frame over to the caller: copies the part of its payload that has already been
+     *        received into dst and forgets the frame. The caller is responsible for reading the remaining
+     *        pendingFrameLength() - returned bytes itself.
+     *
+     * @param dst Destination with room for at least pendingFrameLength() bytes.
+     * @return The number of payload bytes copied into dst.
+     */
+    size_t takePendingFrame(unsigned char *dst) {
+        if (!frameLength) {
+            return 0;
+        }
+        size_t buffered = std::min<size_t>(available(), *frameLength);
+        std::memcpy(dst, storage.data() + readPos, buffered);
+        readPos += buffered;
+        frameLength.reset();
+        return buffered;
+    }
+
+    /**
+     * @brief Discards all buffered data, e.g. after the connection was lost.
+     */
+    void clear() {
+        readPos = writePos = 0;
+        frameLength.reset();
+        networkOrder = false;
+    }
+};
+
+#endif //RVR_SERVER_FRAMEBUFFER_HPP
@@ -0,0 +1,263 @@
+#ifndef RVR_SERVER_IMAGECODEC_HPP
+#define RVR_SERVER_IMAGECODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include "BufferPool.hpp"
+#include "SharedBuffer.hpp"
+
+#ifdef RVR_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef RVR_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+/**
+ * @brief How the pixels of a camera image are encoded.
+ */
+enum class ImageEncoding : uint8_t {
+    JPEG,       ///< A JPEG file; needs decoding. The default, and the only encoding older robots send.
+    BGR,        ///< Raw 8-bit BGR pixels, row by row: width * height * 3 bytes.
+    GRAY,       ///< Raw 8-bit luma: width * height bytes.
+    YUV420      ///< Planar I420: the Y plane, then the U and V planes at half resolution; even sizes only.
+};
+
+/**
+ * @brief Lossless compression applied to the pixels of a raw image.
+ */
+enum class ImageCompression : uint8_t {
+    UNCOMPRESSED,
+    LZ4,        ///< Available if built with USE_LZ4.
+    ZSTD        ///< Available if built with USE_ZSTD.
+};
+
+/**
+ * @brief What the bytes of a message's image are; width and height are only needed for raw encodings.
+ */
+struct ImageFormat {
+    static constexpr uint32_t maxSide = 16384;  ///< Longest side of a raw image; longer ones have no rawSize().
+
+    ImageEncoding encoding = ImageEncoding::JPEG;
+    ImageCompression compression = ImageCompression::UNCOMPRESSED;
+    uint32_t width = 0;
+    uint32_t height = 0;
+
+    bool isRaw() const {
+        return encoding != ImageEncoding::JPEG;
+    }
+
+    /**
+     * @brief Size of the uncompressed pixels of a raw image, or 0 if the format does not describe a raw image
+     *        (including one with a side longer than maxSide, whose size could overflow).
+     */
+    size_t rawSize() const {
+        if (width > maxSide || height > maxSide) {
+            return 0;
+        }
+        const size_t pixels = static_cast<size_t>(width) * height;
+        switch (encoding) {
+            case ImageEncoding::BGR:
+                return pixels * 3;
+            case ImageEncoding::GRAY:
+                return pixels;
+            case ImageEncoding::YUV420:
+                return width % 2 == 0 && height % 2 == 0 ? pixels * 3 / 2 : 0;
+            default:
+                return 0;
+        }
+    }
+
+    bool operator==(const ImageFormat &rhs) const = default;
+};
+
+/**
+ * @brief A rectangle of a frame sent on its own, see Message::getImageTiles(). Its pixels are encoded like a
+ *        whole image of the tile's size in the message's ImageFormat.
+ */
+struct ImageTile {
+    uint32_t x = 0;
+    uint32_t y = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    SharedBuffer pixels;    ///< Shared with the frame the tile was received in.
+
+    /**
+     * @brief Format of the tile's pixels, given the format of the frame it belongs to.
+     */
+    ImageFormat formatIn(const ImageFormat &frame) const {
+        return {frame.encoding, frame.compression, width, height};
+    }
+
+    bool operator==(const ImageTile &rhs) const = default;
+};
+
+/**
+ * @class ImageCodec
+ * @brief Compresses and decompresses the pixels of raw images, reusing its buffers and compression contexts.
+ *
+ * Uncompressed images are passed through without a copy. One codec per thread.
+ */
+class ImageCodec {
+public:
+    static constexpr size_t defaultMaxRawSize = 4096 * 4096 * 3;  ///< A 4K BGR frame, with room to spare.
+
+private:
+    BufferPool pool;
+    const size_t maxRawSize;
+#ifdef RVR_WITH_ZSTD
+    struct ZstdDeleter {
+        void operator()(ZSTD_CCtx *context) const {
+            ZSTD_freeCCtx(context);
+        }
+
+        void operator()(ZSTD_DCtx *context) const {
+            ZSTD_freeDCtx(context);
+        }
+    };
+
+    std::unique_ptr<ZSTD_CCtx, ZstdDeleter> zstdCompressor{ZSTD_createCCtx()};
+    std::unique_ptr<ZSTD_DCtx, ZstdDeleter> zstdDecompressor{ZSTD_createDCtx()};
+#endif
+
+    [[noreturn]] static void unsupported(ImageCompression compression) {
+        throw std::runtime_error("Image compression " + std::to_string(static_cast<int>(compression)) +
+                                 " is not built in");
+    }
+
+public:
+    /**
+     * @param maxRawSize Largest image decompress() accepts, in bytes of raw pixels. The size comes from the
+     *        sender, so it is checked before a buffer is allocated for it.
+     */
+    explicit ImageCodec(size_t maxRawSize = defaultMaxRawSize) : maxRawSize(maxRawSize) {}
+
+    /**
+     * @brief Whether this build can compress and decompress with the given method.
+     */
+    static constexpr bool supports(ImageCompression compression) {
+        switch (compression) {
+            case ImageCompression::UNCOMPRESSED:
+                return true;
+            case ImageCompression::LZ4:
+#ifdef RVR_WITH_LZ4
+                return true;
+#else
+                return false;
+#endif
+            case ImageCompression::ZSTD:
+#ifdef RVR_WITH_ZSTD
+                return true;
+#else
+                return false;
+#endif
+        }
+        return false;
+    }
+
+    /**
+     * @brief Compresses raw pixels, e.g. on the robot or in tests.
+     *
+     * @param pixels The raw image.
+     * @param compression The method; UNCOMPRESSED copies the pixels.
+     * @param out Receives the compressed bytes, reusing its capacity.
+     * @param level zstd compression level; LZ4 always uses its fast default.
+     * @throws std::runtime_error if the method is not built in.
+     */
+    void compress(std::string_view pixels, ImageCompression compression, std::string &out, int level = 1) {
+        switch (compression) {
+            case ImageCompression::UNCOMPRESSED:
+                out.assign(pixels);
+                return;
+            case ImageCompression::LZ4: {
+#ifdef RVR_WITH_LZ4
+                out.resize(static_cast<size_t>(LZ4_compressBound(static_cast<int>(pixels.size()))));
+                const int n = LZ4_compress_default(pixels.data(), out.data(), static_cast<int>(pixels.size()),
+                                                   static_cast<int>(out.size()));
+                if (n <= 0) {
+                    throw std::runtime_error("LZ4 compression failed");
+                }
+                out.resize(static_cast<size_t>(n));
+                return;
+#else
+                unsupported(compression);
+#endif
+            }
+            case ImageCompression::ZSTD: {
+#ifdef RVR_WITH_ZSTD
+                out.resize(ZSTD_compressBound(pixels.size()));
+                const size_t n = ZSTD_compressCCtx(zstdCompressor.get(), out.data(), out.size(), pixels.data(),
+                                                   pixels.size(), level);
+                if (ZSTD_isError(n)) {
+                    throw std::runtime_error(std::string("zstd compression failed: ") + ZSTD_getErrorName(n));
+                }
+                out.resize(n);
+                return;
+#else
+                (void) level;
+                unsupported(compression);
+#endif
+            }
+        }
+        unsupported(compression);
+    }
+
+    /**
+     * @brief Returns the raw pixels of an image in the given raw format. Uncompressed images are returned as
+     *        they are, compressed ones are decompressed into a pooled buffer.
+     *
+     * @throws std::runtime_error if the format is not a raw one, the image is larger than the maximum raw
+     *         size, the method is not built in, or the image does not hold exactly format.rawSize() bytes of pixels.
+     */
+    SharedBuffer decompress(const SharedBuffer &image, const ImageFormat &format) {
+        const size_t rawSize = format.rawSize();
+        if (rawSize == 0) {
+            throw std::runtime_error("Not a raw image format");
+        }
+        if (rawSize > maxRawSize) {
+            throw std::runtime_error("Raw image of " + std::to_string(format.width) + "x" +
+                                     std::to_string(format.height) + " exceeds the maximum size");
+        }
+        switch (format.compression) {
+            case ImageCompression::UNCOMPRESSED:
+                if (image.size() != rawSize) {
+                    throw std::runtime_error("Raw image has the wrong size");
+                }
+                return image;
+            case ImageCompression::LZ4: {
+#ifdef RVR_WITH_LZ4
+                auto pixels = pool.acquire(rawSize);
+                const int n = LZ4_decompress_safe(reinterpret_cast<const char *>(image.data()),
+                                                  reinterpret_cast<char *>(pixels.data()),
+                                                  static_cast<int>(image.size()), static_cast<int>(rawSize));
+                if (n < 0 || static_cast<size_t>(n) != rawSize) {
+                    throw std::runtime_error("Corrupt LZ4 image");
+                }
+                return SharedBuffer::adopt(std::move(pixels));
+#else
+                unsupported(format.compression);
+#endif
+            }
+            case ImageCompression::ZSTD: {
+#ifdef RVR_WITH_ZSTD
+                auto pixels = pool.acquire(rawSize);
+                const size_t n = ZSTD_decompressDCtx(zstdDecompressor.get(), pixels.data(), rawSize,
+                                                     image.data(), image.size());
+                if (ZSTD_isError(n) || n != rawSize) {
+                    throw std::runtime_error("Corrupt zstd image");
+                }
+                return SharedBuffer::adopt(std::move(pixels));
+#else
+                unsupported(format.compression);
+#endif
+            }
+        }
+        unsupported(format.compression);
+    }
+};
+
+#endif //RVR_SERVER_IMAGECODEC_HPP
@@ -0,0 +1,137 @@
+#ifndef RVR_SERVER_LATENCY_HPP
+#define RVR_SERVER_LATENCY_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <optional>
+
+/**
+ * @brief Current time of this process's monotonic clock in microseconds, the unit of all Timestamps.
+ */
+inline uint64_t monotonicMicros() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+/**
+ * @brief Points in the life of a camera frame and the command derived from it, in microseconds of a monotonic
+ *        clock. Robot and server clocks have unrelated origins, see ClockOffsetEstimator. 0 means not taken.
+ */
+struct Timestamps {
+    uint64_t capture = 0;               ///< Robot clock: the camera captured the frame.
+    uint64_t sent = 0;                  ///< Sender's clock: the message was handed to the socket.
+    uint64_t received = 0;              ///< Server clock: the frame was completely received.
+    uint64_t decoded = 0;               ///< Server clock: the frame was parsed into a Message.
+    uint64_t detected = 0;              ///< Server clock: object detection on the frame finished.
+    uint64_t commandSent = 0;           ///< Server clock: the command derived from the frame was sent.
+    uint64_t echoCommandSent = 0;       ///< Robot to server: commandSent of the last command the robot received.
+    uint64_t echoCommandReceived = 0;   ///< Robot clock: when that command arrived.
+
+    bool operator==(const Timestamps &rhs) const = default;
+};
+
+/**
+ * @brief Where the time between capturing a frame and acting on it went, in microseconds.
+ */
+struct LatencyBreakdown {
+    int64_t transfer;       ///< Capture on the robot to complete receipt on the server, clock offset corrected.
+    int64_t decode;         ///< Receipt to the parsed Message.
+    int64_t detect;         ///< Parsed Message to finished object detection.
+    int64_t command;        ///< Finished detection to the command being sent.
+    int64_t total;          ///< Capture to command sent: glass to wheel, apart from the way back to the robot.
+
+    /**
+     * @brief Splits up the latency of a command that echoes its frame's timestamps.
+     *
+     * @param stamps Timestamps of the command, see CommunicationHandler::sendMessage().
+     * @param clockOffset Server clock minus robot clock, see ClockOffsetEstimator.
+     * @return The breakdown, or std::nullopt if a timestamp is missing.
+     */
+    static std::optional<LatencyBreakdown> of(const Timestamps &stamps, int64_t clockOffset) {
+        if (!stamps.capture || !stamps.received || !stamps.decoded || !stamps.detected || !stamps.commandSent) {
+            return std::nullopt;
+        }
+        const auto capture = static_cast<int64_t>(stamps.capture) + clockOffset;
+        const auto received = static_cast<int64_t>(stamps.received);
+        const auto decoded = static_cast<int64_t>(stamps.decoded);
+        const auto detected = static_cast<int64_t>(stamps.detected);
+        const auto commandSent = static_cast<int64_t>(stamps.commandSent);
+        return LatencyBreakdown{received - capture, decoded - received, detected - decoded,
+                                commandSent - detected, commandSent - capture};
+    }
+};
+
+/**
+ * @class ClockOffsetEstimator
+ * @brief Estimates the offset between a robot's clock and the server's from the timestamps on its frames.
+ *
+ * If the robot echoes the last command it received (echoCommandSent, echoCommandReceived), each frame gives an
+ * NTP-style round trip: the server sent at t1, the robot received at t2 and sent the frame at t3, the server
+ * received it at t4. The offset is ((t1 - t2) + (t4 - t3)) / 2, and like NTP the sample with the shortest
+ * round trip among the recent ones is trusted most, since queueing delay is what skews a sample.
+ *
+ * Without echoes only one-way samples t4 - t3 are available. Their minimum is the offset plus the shortest
+ * transfer time, so latencies computed with it leave out the network's base delay but still show queueing.
+ */
+class ClockOffsetEstimator {
+private:
+    struct Sample {
+        int64_t offset;
+        int64_t delay;
+    };
+
+    std::deque<Sample> roundTrips;
+    std::deque<int64_t> oneWay;
+    const size_t window;
+
+    template<typename T>
+    void keep(std::deque<T> &samples, T sample) {
+        samples.push_back(sample);
+        if (samples.size() > window) {
+            samples.pop_front();
+        }
+    }
+
+public:
+    /**
+     * @param window Number of recent samples the estimate is taken from.
+     */
+    explicit ClockOffsetEstimator(size_t window = 16) : window(std::max<size_t>(window, 1)) {}
+
+    /**
+     * @brief Adds the timestamps of a frame received from the robot, after received was stamped.
+     */
+    void add(const Timestamps &stamps) {
+        if (!stamps.sent || !stamps.received) {
+            return;
+        }
+        const auto t3 = static_cast<int64_t>(stamps.sent);
+        const auto t4 = static_cast<int64_t>(stamps.received);
+        if (stamps.echoCommandSent && stamps.echoCommandReceived) {
+            const auto t1 = static_cast<int64_t>(stamps.echoCommandSent);
+            const auto t2 = static_cast<int64_t>(stamps.echoCommandReceived);
+            keep(roundTrips, Sample{((t1 - t2) + (t4 - t3)) / 2, (t4 - t1) - (t3 - t2)});
+        } else {
+            keep(oneWay, t4 - t3);
+        }
+    }
+
+    /**
+     * @brief Returns the server clock minus the robot clock in microseconds, or std::nullopt without samples.
+     */
+    std::optional<int64_t> offset() const {
+        if (!roundTrips.empty()) {
+            return std::min_element(roundTrips.begin(), roundTrips.end(), [](const Sample &a, const Sample &b) {
+                return a.delay < b.delay;
+            })->offset;
+        }
+        if (!oneWay.empty()) {
+            return *std::min_element(oneWay.begin(), oneWay.end());
+        }
+        return std::nullopt;
+    }
+};
+
+#endif //RVR_SERVER_LATENCY_HPP
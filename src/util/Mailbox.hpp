@@ -0,0 +1,135 @@
+#ifndef RVR_SERVER_MAILBOX_HPP
+#define RVR_SERVER_MAILBOX_HPP
+
+#include <array>
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include "Message.hpp"
+
+/**
+ * @brief What a mailbox does with a new message of a given type.
+ */
+enum class DropPolicy {
+    KEEP,           ///< Queue every message; nothing is ever dropped.
+    DROP_OLDEST,    ///< Keep at most `capacity` messages of the type, evicting the oldest one when full.
+    COALESCE        ///< Keep at most one message of the type; a newer one replaces it in its queue position.
+};
+
+struct QueuePolicy {
+    DropPolicy drop = DropPolicy::KEEP;
+    size_t capacity = 0;    ///< Limit for DROP_OLDEST, and for KEEP in a StageQueue; 0 means unbounded.
+};
+
+/**
+ * @class Mailbox
+ * @brief Inbound message queue with a bound and drop policy per message type.
+ *
+ * Messages are kept in two lanes (see Lane): CONTROL messages are always delivered before BULK ones, and each
+ * lane is delivered in arrival order. By default IMAGE messages keep only the newest frame, so a slow consumer
+ * always acts on the latest camera image, while COMMAND messages are never dropped.
+ * Not thread-safe; the owner is expected to guard it.
+ */
+class Mailbox {
+public:
+    enum class PushResult {
+        QUEUED,         ///< The message was appended.
+        DROPPED_OLDEST, ///< The message was appended and the oldest one of its type was evicted.
+        COALESCED       ///< The message replaced a queued one of its type.
+    };
+
+    using Policies = std::array<QueuePolicy, 3>;
+
+    /**
+     * @brief The default policies: IMAGE keeps only the newest frame, everything else is kept.
+     */
+    static Policies defaultPolicies() {
+        Policies policies{};
+        policies[index(Type::IMAGE)] = {DropPolicy::DROP_OLDEST, 1};
+        return policies;
+    }
+
+private:
+    std::array<std::deque<Message>, 2> lanes;
+    std::array<size_t, 3> typeCounts{};
+    Policies policies = defaultPolicies();
+
+    static size_t index(Type type) {
+        return static_cast<size_t>(type);
+    }
+
+    std::deque<Message> &laneFor(Type type) {
+        return lanes[static_cast<size_t>(laneOf(type))];
+    }
+
+    std::deque<Message>::iterator findFirst(std::deque<Message> &lane, Type type) {
+        for (auto it = lane.begin(); it != lane.end(); ++it) {
+            if (it->getType() == type) {
+                return it;
+            }
+        }
+        return lane.end();
+    }
+
+public:
+    void setPolicy(Type type, QueuePolicy policy) {
+        policies[index(type)] = policy;
+    }
+
+    void setPolicies(const Policies &newPolicies) {
+        policies = newPolicies;
+    }
+
+    /**
+     * @brief Adds a message according to the policy of its type.
+     *
+     * @param message The received message.
+     * @return Whether the message was simply queued, evicted an older one or replaced one.
+     */
+    PushResult push(Message &&message) {
+        const size_t type = index(message.getType());
+        const QueuePolicy &policy = policies[type];
+        auto &lane = laneFor(message.getType());
+
+        if (policy.drop == DropPolicy::COALESCE && typeCounts[type] > 0) {
+            *findFirst(lane, message.getType()) = std::move(message);
+            return PushResult::COALESCED;
+        }
+
+        PushResult result = PushResult::QUEUED;
+        if (policy.drop == DropPolicy::DROP_OLDEST && policy.capacity > 0 && typeCounts[type] >= policy.capacity) {
+            lane.erase(findFirst(lane, message.getType()));
+            typeCounts[type]--;
+            result = PushResult::DROPPED_OLDEST;
+        }
+        lane.push_back(std::move(message));
+        typeCounts[type]++;
+        return result;
+    }
+
+    /**
+     * @brief Removes and returns the oldest CONTROL message, or the oldest BULK message if there is none,
+     *        or std::nullopt if the mailbox is empty.
+     */
+    std::optional<Message> pop() {
+        for (auto &lane : lanes) {
+            if (!lane.empty()) {
+                Message message = std::move(lane.front());
+                lane.pop_front();
+                typeCounts[index(message.getType())]--;
+                return message;
+            }
+        }
+        return std::nullopt;
+    }
+
+    bool empty() const {
+        return lanes[0].empty() && lanes[1].empty();
+    }
+
+    size_t size() const {
+        return lanes[0].size() + lanes[1].size();
+    }
+};
+
+#endif //RVR_SERVER_MAILBOX_HPP
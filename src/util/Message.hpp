@@ -1,10 +1,20 @@
 #ifndef RVR_SERVER_MESSAGE_HPP
 #define RVR_SERVER_MESSAGE_HPP
 
-#include <set>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <arpa/inet.h>
+#include <iterator>
+#include <string_view>
 #include <utility>
+#include <vector>
 #include "json.hpp"
 #include "base64.hpp"
+#include "DirectionSet.hpp"
+#include "ImageCodec.hpp"
+#include "Latency.hpp"
+#include "SharedBuffer.hpp"
 #include "Image.pb.h"
 
 enum class Type {
@@ -12,22 +22,43 @@ enum class Type {
     IMAGE,
     EMPTY
 };
-enum class Direction {
-    FORWARD,
-    BACKWARD,
-    LEFT,
-    RIGHT
+
+/**
+ * @brief Transmission priority class of a message. CONTROL traffic (commands, telemetry) is always dequeued
+ *        and sent before BULK traffic (camera frames).
+ */
+enum class Lane : uint8_t {
+    CONTROL = 0,
+    BULK = 1
 };
 
+inline Lane laneOf(Type type) {
+    return type == Type::IMAGE ? Lane::BULK : Lane::CONTROL;
+}
+
 class Message {
 private:
-    Type type;
-    uint16_t distance;
-    uint8_t speed;
-    uint8_t battery_percentage;
-    std::vector<Direction> directions;
-    std::vector<Direction> cameraDirections;
-    std::optional<std::string> image;
+    Type type = Type::EMPTY;
+    uint16_t distance = 0;
+    uint8_t speed = 0;
+    uint8_t battery_percentage = 0;
+    uint32_t sessionId = 0;             ///< Robot session the message was received from or is addressed to; 0 for none.
+    uint64_t frameId = 0;               ///< Sequence number of an image, or of the image a command was derived from.
+    Timestamps timestamps;              ///< Latency stamps of the frame and of the command derived from it.
+    DirectionSet directions;
+    DirectionSet cameraDirections;
+    std::optional<SharedBuffer> image;  ///< Encoded camera image; shared with the frame it was received in.
+    ImageFormat imageFormat;            ///< What the image bytes are; JPEG unless the robot sends raw frames.
+    std::vector<ImageTile> imageTiles;  ///< Partial update of a frame instead of an image, see getImageTiles().
+    uint64_t baseFrameId = 0;           ///< Keyframe the tiles apply to; 0 if they make up a keyframe.
+
+    static std::optional<SharedBuffer> adoptImage(std::optional<std::string> &&image) {
+        if (!image) {
+            return std::nullopt;
+        }
+        return SharedBuffer(std::move(*image));
+    }
+
 public:
 
     uint16_t getDistance() const {
@@ -54,36 +85,80 @@ public:
         Message::speed = speed;
     }
 
-    const std::vector<Direction> &getDirections() const {
+    const DirectionSet &getDirections() const {
         return directions;
     }
 
-    void setDirections(const std::vector<Direction> &directions) {
+    void setDirections(DirectionSet directions) {
         Message::directions = directions;
     }
 
-    const std::vector<Direction> &getCameraDirections() const {
+    const DirectionSet &getCameraDirections() const {
         return cameraDirections;
     }
 
-    void setCameraDirections(const std::vector<Direction> &directions) {
+    void setCameraDirections(DirectionSet directions) {
         Message::cameraDirections = directions;
     }
 
     void addDirection(Direction direction) {
-        directions.push_back(direction);
+        directions.insert(direction);
     }
 
     void addCameraDirection(Direction direction) {
-        cameraDirections.push_back(direction);
+        cameraDirections.insert(direction);
     }
 
-    const std::optional<std::string> &getImage() const {
+    /**
+     * @brief Returns the encoded image. Copying the returned buffer shares the bytes rather than copying them.
+     */
+    const std::optional<SharedBuffer> &getImage() const {
         return image;
     }
 
+    void setImage(SharedBuffer image) {
+        Message::image = std::move(image);
+    }
+
     void setImageFromString(const std::string &image) {
-        Message::image = image;
+        Message::image = SharedBuffer::copyOf(image);
+    }
+
+    const ImageFormat &getImageFormat() const {
+        return imageFormat;
+    }
+
+    void setImageFormat(const ImageFormat &format) {
+        imageFormat = format;
+    }
+
+    /**
+     * @brief Returns the tiles of a partial frame update, empty for a message with a whole image.
+     *
+     * A robot whose camera sees a mostly static scene may send the parts of the frame that changed instead of the
+     * whole frame. The image format then describes the whole frame, and each tile holds a rectangle of it.
+     * Tiles of one message must not overlap. With a base frame id of 0 the tiles make up a keyframe, drawn on
+     * a black frame; otherwise they are every part of the frame that differs from the keyframe with that frame
+     * id. Since each update only depends on its keyframe, updates may be dropped, see ImageDecoder.
+     */
+    const std::vector<ImageTile> &getImageTiles() const {
+        return imageTiles;
+    }
+
+    void setImageTiles(std::vector<ImageTile> tiles) {
+        imageTiles = std::move(tiles);
+    }
+
+    void addImageTile(ImageTile tile) {
+        imageTiles.push_back(std::move(tile));
+    }
+
+    uint64_t getBaseFrameId() const {
+        return baseFrameId;
+    }
+
+    void setBaseFrameId(uint64_t id) {
+        baseFrameId = id;
     }
 
     uint8_t getBatteryPercentage() const {
@@ -94,19 +169,43 @@ public:
         battery_percentage = batteryPercentage;
     }
 
+    uint32_t getSessionId() const {
+        return sessionId;
+    }
+
+    void setSessionId(uint32_t id) {
+        sessionId = id;
+    }
+
+    uint64_t getFrameId() const {
+        return frameId;
+    }
+
+    void setFrameId(uint64_t id) {
+        frameId = id;
+    }
+
+    const Timestamps &getTimestamps() const {
+        return timestamps;
+    }
+
+    void setTimestamps(const Timestamps &stamps) {
+        timestamps = stamps;
+    }
+
     Message() = default;
 
-    Message(uint8_t speed, std::vector<Direction> directions) : speed(speed), directions(std::move(directions)), image(std::nullopt) {}
+    Message(uint8_t speed, DirectionSet directions) : speed(speed), directions(directions), image(std::nullopt) {}
 
-    Message(uint8_t speed, std::vector<Direction> directions, std::optional<std::string> image) : speed(speed), directions(std::move(directions)), image(std::move(image)) {}
+    Message(uint8_t speed, DirectionSet directions, std::optional<std::string> image) : speed(speed), directions(directions), image(adoptImage(std::move(image))) {}
 
-    Message(Type type, uint16_t distance, uint8_t speed, std::vector<Direction> directions, std::vector<Direction> cameraDirections, std::optional<std::string> image, uint8_t battery_percentage) :
+    Message(Type type, uint16_t distance, uint8_t speed, DirectionSet directions, DirectionSet cameraDirections, std::optional<std::string> image, uint8_t battery_percentage) :
             type(type),
             distance(distance),
             speed(speed),
-            directions(std::move(directions)),
-            cameraDirections(std::move(cameraDirections)),
-            image(std::move(image)),
+            directions(directions),
+            cameraDirections(cameraDirections),
+            image(adoptImage(std::move(image))),
             battery_percentage(battery_percentage){}
 
     /**
@@ -118,9 +217,9 @@ public:
     static Message fromJSONString(const std::string &str) {
         nlohmann::json json = nlohmann::json::parse(str);
         Message message;
-        message.speed = json["speed"];
-        message.distance = json["distance"];
-        switch (json["type"].get<int>()) {
+        message.speed = json.value("speed", 0);
+        message.distance = json.value("distance", 0);
+        switch (json.value("type", -1)) {
             case 0:
                 message.type = Type::IMAGE;
                 break;
@@ -130,131 +229,719 @@ public:
         }
         for (const auto &direction : json["directions"]) {
             if (direction == "forward") {
-                message.directions.push_back(Direction::FORWARD);
+                message.directions.insert(Direction::FORWARD);
             } else if (direction == "backward") {
-                message.directions.push_back(Direction::BACKWARD);
+                message.directions.insert(Direction::BACKWARD);
             } else if (direction == "left") {
-                message.directions.push_back(Direction::LEFT);
+                message.directions.insert(Direction::LEFT);
             } else if (direction == "right") {
-                message.directions.push_back(Direction::RIGHT);
+                message.directions.insert(Direction::RIGHT);
             }
         }
         if (json.contains("image")) {
-            message.image = base64::from_base64(json["image"].get<std::string>());
+            message.image = SharedBuffer(base64::from_base64(json["image"].get_ref<const std::string &>()));
         } else {
             message.image = std::nullopt;
         }
         return message;
     }
 
-    std::string toJSONString() const {
-        nlohmann::json json;
-        json["speed"] = speed;
-        json["distance"] = distance;
-        switch(type) {
+    /**
+     * @brief Writes the message as JSON without building a DOM, handing the text to sink in pieces.
+     *
+     * The output is byte for byte what nlohmann::json would dump for the same fields (keys in alphabetical
+     * order, no whitespace), so fromJSONString() and other JSON tools read it unchanged. The image is base64
+     * encoded block by block straight into a small buffer, so the frame is never copied as a whole.
+     *
+     * @param sink Callable taking a std::string_view, e.g. appending to a buffer or writing to a socket.
+     * @param maxImageBytes Image bytes to include: 0 leaves the image out, anything smaller than the image
+     *        truncates it (the result is valid base64 of the first maxImageBytes bytes).
+     */
+    template<typename Sink>
+    void writeJSON(Sink &&sink, size_t maxImageBytes = SIZE_MAX) const {
+        static constexpr std::string_view directionNames[] = {"\"forward\"", "\"backward\"", "\"left\"", "\"right\""};
+        char number[8];
+        auto writeNumber = [&](std::string_view key, unsigned value) {
+            sink(key);
+            const auto result = std::to_chars(number, number + sizeof(number), value);
+            sink(std::string_view(number, result.ptr - number));
+        };
+
+        char separator = '{';
+        if (!directions.empty()) {
+            sink("{\"directions\":");
+            separator = '[';
+            for (auto direction : directions) {
+                sink(std::string_view(&separator, 1));
+                sink(directionNames[static_cast<size_t>(direction)]);
+                separator = ',';
+            }
+            sink("]");
+        }
+        writeNumber(separator == '{' ? "{\"distance\":" : ",\"distance\":", distance);
+        if (image.has_value() && maxImageBytes > 0) {
+            sink(",\"image\":\"");
+            const std::string_view bytes = image->view().substr(0, maxImageBytes);
+            // whole groups of 3 bytes per block, so only the last block is padded
+            char encoded[4096];
+            constexpr size_t block = sizeof(encoded) / 4 * 3;
+            for (size_t offset = 0; offset < bytes.size(); offset += block) {
+                const size_t n = base64::encode_to(bytes.substr(offset, block), encoded);
+                sink(std::string_view(encoded, n));
+            }
+            sink("\"");
+        }
+        writeNumber(",\"speed\":", speed);
+        switch (type) {
             case Type::COMMAND:
-                json["type"] = 1;
+                sink(",\"type\":1");
                 break;
             case Type::IMAGE:
-                json["type"] = 0;
+                sink(",\"type\":0");
+                break;
+            case Type::EMPTY:
                 break;
         }
-        for (const auto &direction : directions) {
-            if (direction == Direction::FORWARD) {
-                json["directions"].push_back("forward");
-            } else if (direction == Direction::BACKWARD) {
-                json["directions"].push_back("backward");
-            } else if (direction == Direction::LEFT) {
-                json["directions"].push_back("left");
-            } else if (direction == Direction::RIGHT) {
-                json["directions"].push_back("right");
-            }
-        }
-        if (image.has_value()) {
-            std::string base64Image = base64::to_base64(image.value());
-            json["image"] = base64Image;
+        sink("}");
+    }
+
+    /**
+     * @brief Writes the message as JSON into out, see writeJSON(). Any previous content is replaced and the
+     *        buffer's capacity is reused.
+     */
+    void toJSON(std::string &out, size_t maxImageBytes = SIZE_MAX) const {
+        out.clear();
+        if (image.has_value() && maxImageBytes > 0) {
+            out.reserve(base64::encoded_size(std::min(image->size(), maxImageBytes)) + 128);
         }
-        return json.dump();
+        writeJSON([&out](std::string_view piece) { out.append(piece); }, maxImageBytes);
+    }
+
+    std::string toJSONString() const {
+        std::string json;
+        toJSON(json);
+        return json;
     }
 
+    // the session id, frame ids and timestamps say where a message came from, not what it says, and are ignored
     bool operator==(const Message &rhs) const {
-        // compare directions as a set
-        std::set<Direction> lhsSet(directions.begin(), directions.end());
-        std::set<Direction> rhsSet(rhs.directions.begin(), rhs.directions.end());
-        std::set<Direction> lhsCameraSet(cameraDirections.begin(), cameraDirections.end());
-        std::set<Direction> rhsCameraSet(rhs.cameraDirections.begin(), rhs.cameraDirections.end());
         return speed == rhs.speed &&
-               lhsSet == rhsSet &&
-               image == rhs.image &&
+               directions == rhs.directions &&
                type == rhs.type &&
                distance == rhs.distance &&
-               lhsCameraSet == rhsCameraSet;
+               cameraDirections == rhs.cameraDirections &&
+               image == rhs.image &&
+               imageFormat == rhs.imageFormat &&
+               imageTiles == rhs.imageTiles;
     }
 
     bool operator!=(const Message &rhs) const {
         return !(rhs == *this);
     }
 
-    static Message fromProto(const std::string& protoMsg) {
-        proto::ProtoMessage message;
-        bool success = message.ParseFromString(protoMsg);
-        if (!success) {
+    /**
+     * A compact command is a 4-byte payload sent instead of a ProtoMessage for commands that only carry a speed
+     * and directions:
+     * ```
+     * uint8 tag              compactCommandTag; identifies the encoding and its version
+     * uint8 speed
+     * uint8 directions       one bit per Direction, bit 0 = FORWARD .. bit 3 = RIGHT
+     * uint8 cameraDirections same layout
+     * ```
+     * A serialized ProtoMessage never starts with a byte below 0x08 (that would be a tag for field number 0),
+     * so compact payloads and ProtoMessages can be told apart by their first byte and share a connection.
+     * The direction bytes are the DirectionSet masks.
+     */
+    static constexpr uint8_t compactCommandTag = 0x01;
+    static constexpr size_t compactPayloadSize = 4;
+
+    /**
+     * A batch frame packs several messages into one payload: batchTag followed by a serialized MessageBatch,
+     * whose entries are ProtoMessages. Like a compact command it is told apart from a ProtoMessage by its
+     * first byte.
+     */
+    static constexpr uint8_t batchTag = 0x02;
+
+    /**
+     * @brief Whether a frame payload holds a compact encoding rather than a ProtoMessage or a batch.
+     */
+    static bool isCompactFrame(std::string_view payload) {
+        return !payload.empty() && static_cast<uint8_t>(payload[0]) < 0x08 && !isBatchFrame(payload);
+    }
+
+    /**
+     * @brief Whether a frame payload holds a batch of messages, see batchTag.
+     */
+    static bool isBatchFrame(std::string_view payload) {
+        return !payload.empty() && static_cast<uint8_t>(payload[0]) == batchTag;
+    }
+
+    /**
+     * @brief Whether the message can be sent as a compact command without losing anything.
+     */
+    bool fitsCompactFrame() const {
+        return fitsCompactFrameWithoutEcho() && frameId == 0 && timestamps == Timestamps{};
+    }
+
+    /**
+     * @brief Whether the message can be sent as a compact command if the frame id and timestamps it echoes
+     *        (see Timestamps) are left out, as a compact command has no room for them.
+     */
+    bool fitsCompactFrameWithoutEcho() const {
+        return type == Type::COMMAND && distance == 0 && battery_percentage == 0 && !image.has_value() &&
+               imageFormat == ImageFormat{} && imageTiles.empty() && baseFrameId == 0;
+    }
+
+    /**
+     * @brief Parses a serialized ProtoMessage. The image is copied out of protoMsg once.
+     */
+    static Message fromProto(std::string_view protoMsg) {
+        return fromProto(SharedBuffer::copyOf(protoMsg));
+    }
+
+    /**
+     * @brief Parses a serialized ProtoMessage without copying the image: the message's image is a slice of frame.
+     */
+    static Message fromProto(const SharedBuffer &frame) {
+        Decoder decoder;
+        Message message;
+        decoder.decode(frame, message);
+        return message;
+    }
+
+    /**
+     * @class Decoder
+     * @brief Decoder for the ProtoMessage wire format, specialised for its fixed schema.
+     *
+     * Walks the protobuf encoding directly instead of going through libprotobuf: fields are written straight
+     * into a caller-provided Message and the image becomes a slice of the frame, so decoding allocates nothing.
+     * Accepts and rejects exactly what proto::ProtoMessage::ParseFromString does: unknown fields (including
+     * groups) are skipped, a known field with an unexpected wire type is treated as unknown, repeated
+     * directions may be packed or not, and for scalar fields the last occurrence wins.
+     */
+    class Decoder {
+    private:
+        enum WireType : uint32_t {
+            VARINT = 0,
+            FIXED64 = 1,
+            LENGTH_DELIMITED = 2,
+            START_GROUP = 3,
+            END_GROUP = 4,
+            FIXED32 = 5
+        };
+
+        static constexpr int maxGroupDepth = 100;   ///< libprotobuf's default recursion limit.
+
+        [[noreturn]] static void fail() {
             throw std::runtime_error("Failed to parse ProtoMessage");
         }
 
-        auto& directions = message.directions();
-        auto& cameraDirections = message.camera_directions();
+        /**
+         * @brief Reads a base 128 varint of at most 10 bytes at pos, advancing pos.
+         */
+        static uint64_t readVarint(std::string_view data, size_t &pos) {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (pos >= data.size()) {
+                    fail();
+                }
+                const auto byte = static_cast<uint8_t>(data[pos++]);
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) {
+                    return value;
+                }
+            }
+            fail();
+        }
 
-        std::vector<Direction> directionsVector;
-        for (const auto & direction : directions) {
-            if (direction == proto::ProtoMessage_Direction_FORWARD) {
-                directionsVector.push_back(Direction::FORWARD);
-            } else if (direction == proto::ProtoMessage_Direction_BACKWARD) {
-                directionsVector.push_back(Direction::BACKWARD);
-            } else if (direction == proto::ProtoMessage_Direction_LEFT) {
-                directionsVector.push_back(Direction::LEFT);
-            } else if (direction == proto::ProtoMessage_Direction_RIGHT) {
-                directionsVector.push_back(Direction::RIGHT);
+        /**
+         * @brief Reads a field tag the way libprotobuf does: at most 5 bytes, truncated to 32 bits, and field
+         *        number 0 is invalid.
+         */
+        static uint32_t readTag(std::string_view data, size_t &pos) {
+            uint32_t tag = 0;
+            for (int shift = 0; shift < 35; shift += 7) {
+                if (pos >= data.size()) {
+                    fail();
+                }
+                const auto byte = static_cast<uint8_t>(data[pos++]);
+                tag |= static_cast<uint32_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) {
+                    if ((tag >> 3) == 0) {
+                        fail();
+                    }
+                    return tag;
+                }
             }
+            fail();
         }
 
-        std::vector<Direction> cameraDirectionsVector;
-        for (const auto & direction : cameraDirections) {
-            if (direction == proto::ProtoMessage_Direction_FORWARD) {
-                cameraDirectionsVector.push_back(Direction::FORWARD);
-            } else if (direction == proto::ProtoMessage_Direction_BACKWARD) {
-                cameraDirectionsVector.push_back(Direction::BACKWARD);
-            } else if (direction == proto::ProtoMessage_Direction_LEFT) {
-                cameraDirectionsVector.push_back(Direction::LEFT);
-            } else if (direction == proto::ProtoMessage_Direction_RIGHT) {
-                cameraDirectionsVector.push_back(Direction::RIGHT);
+        static void skipBytes(std::string_view data, size_t &pos, uint64_t count) {
+            if (count > data.size() - pos) {
+                fail();
             }
+            pos += count;
         }
 
-        int type = message.type();
-        Type messageType;
-        switch (type) {
-            case 0:
-                messageType = Type::IMAGE;
-                break;
-            case 1:
-                messageType = Type::COMMAND;
-                break;
+        /**
+         * @brief Skips the value of a field that is not part of the schema.
+         */
+        static void skipField(std::string_view data, size_t &pos, uint32_t tag, int depth = 0) {
+            switch (tag & 7) {
+                case VARINT:
+                    readVarint(data, pos);
+                    break;
+                case FIXED64:
+                    skipBytes(data, pos, 8);
+                    break;
+                case LENGTH_DELIMITED:
+                    skipBytes(data, pos, readVarint(data, pos));
+                    break;
+                case START_GROUP: {
+                    if (depth >= maxGroupDepth) {
+                        fail();
+                    }
+                    // skip nested fields up to the matching end-group tag
+                    while (true) {
+                        const uint32_t inner = readTag(data, pos);
+                        if ((inner & 7) == END_GROUP) {
+                            if ((inner >> 3) != (tag >> 3)) {
+                                fail();
+                            }
+                            break;
+                        }
+                        skipField(data, pos, inner, depth + 1);
+                    }
+                    break;
+                }
+                case FIXED32:
+                    skipBytes(data, pos, 4);
+                    break;
+                default:
+                    // a stray end-group tag or an invalid wire type
+                    fail();
+            }
         }
 
-        uint8_t speed = message.speed();
-        uint8_t batteryPercentage = message.battery_percentage();
-        uint16_t distance = message.distance();
-        std::optional<std::string> image;
-        if (!message.image().empty()) {
-            image = message.image();
+        static void addDirection(uint64_t value, DirectionSet &to) {
+            // enum values are int32 on the wire; unknown ones are ignored
+            switch (static_cast<int32_t>(value)) {
+                case proto::ProtoMessage_Direction_FORWARD:
+                    to.insert(Direction::FORWARD);
+                    break;
+                case proto::ProtoMessage_Direction_BACKWARD:
+                    to.insert(Direction::BACKWARD);
+                    break;
+                case proto::ProtoMessage_Direction_LEFT:
+                    to.insert(Direction::LEFT);
+                    break;
+                case proto::ProtoMessage_Direction_RIGHT:
+                    to.insert(Direction::RIGHT);
+                    break;
+                default:
+                    break;
+            }
         }
 
-        return {messageType, distance, speed, directionsVector, cameraDirectionsVector, image, batteryPercentage};
-    }
+        /**
+         * @brief Merges an embedded Timestamps message into to, field by field as protobuf does.
+         */
+        static void readTimestamps(std::string_view data, size_t &pos, uint32_t tag, Timestamps &to) {
+            if ((tag & 7) != LENGTH_DELIMITED) {
+                skipField(data, pos, tag);
+                return;
+            }
+            const uint64_t size = readVarint(data, pos);
+            if (size > data.size() - pos) {
+                fail();
+            }
+            const std::string_view embedded = data.substr(pos, size);
+            pos += size;
+
+            uint64_t *const fields[] = {&to.capture, &to.sent, &to.received, &to.decoded, &to.detected,
+                                        &to.commandSent, &to.echoCommandSent, &to.echoCommandReceived};
+            size_t embeddedPos = 0;
+            while (embeddedPos < embedded.size()) {
+                const uint32_t field = readTag(embedded, embeddedPos);
+                const uint32_t number = field >> 3;
+                if ((field & 7) == VARINT && number >= 1 && number <= std::size(fields)) {
+                    *fields[number - 1] = readVarint(embedded, embeddedPos);
+                } else {
+                    skipField(embedded, embeddedPos, field);
+                }
+            }
+        }
+
+        /**
+         * @brief Appends an embedded ImageTile message to to; its pixels are a slice of frame.
+         */
+        static void readTile(const SharedBuffer &frame, size_t &pos, uint32_t tag, std::vector<ImageTile> &to) {
+            const std::string_view data = frame.view();
+            if ((tag & 7) != LENGTH_DELIMITED) {
+                skipField(data, pos, tag);
+                return;
+            }
+            const uint64_t size = readVarint(data, pos);
+            if (size > data.size() - pos) {
+                fail();
+            }
+            const size_t start = pos;
+            const std::string_view embedded = data.substr(pos, size);
+            pos += size;
+
+            ImageTile &tile = to.emplace_back();
+            uint32_t *const fields[] = {&tile.x, &tile.y, &tile.width, &tile.height};
+            size_t embeddedPos = 0;
+            while (embeddedPos < embedded.size()) {
+                const uint32_t field = readTag(embedded, embeddedPos);
+                const uint32_t number = field >> 3;
+                if ((field & 7) == VARINT && number >= 1 && number <= std::size(fields)) {
+                    *fields[number - 1] = static_cast<uint32_t>(readVarint(embedded, embeddedPos));
+                } else if ((field & 7) == LENGTH_DELIMITED && number == proto::ProtoMessage_ImageTile::kPixelsFieldNumber) {
+                    const uint64_t pixels = readVarint(embedded, embeddedPos);
+                    const size_t offset = embeddedPos;
+                    skipBytes(embedded, embeddedPos, pixels);
+                    tile.pixels = frame.slice(start + offset, pixels);
+                } else {
+                    skipField(embedded, embeddedPos, field);
+                }
+            }
+        }
+
+        static void readDirections(std::string_view data, size_t &pos, uint32_t tag, DirectionSet &to) {
+            if ((tag & 7) == VARINT) {
+                addDirection(readVarint(data, pos), to);
+            } else if ((tag & 7) == LENGTH_DELIMITED) {
+                // packed: a run of varints
+                const uint64_t size = readVarint(data, pos);
+                if (size > data.size() - pos) {
+                    fail();
+                }
+                const std::string_view packed = data.substr(pos, size);
+                size_t packedPos = 0;
+                while (packedPos < packed.size()) {
+                    addDirection(readVarint(packed, packedPos), to);
+                }
+                pos += size;
+            } else {
+                skipField(data, pos, tag);
+            }
+        }
+
+        // unknown enum values fall back to the defaults, like unknown directions are ignored
+        static ImageEncoding toImageEncoding(int32_t value) {
+            switch (value) {
+                case proto::ProtoMessage_ImageEncoding_BGR:
+                    return ImageEncoding::BGR;
+                case proto::ProtoMessage_ImageEncoding_GRAY:
+                    return ImageEncoding::GRAY;
+                case proto::ProtoMessage_ImageEncoding_YUV420:
+                    return ImageEncoding::YUV420;
+                default:
+                    return ImageEncoding::JPEG;
+            }
+        }
+
+        static ImageCompression toImageCompression(int32_t value) {
+            switch (value) {
+                case proto::ProtoMessage_Compression_LZ4:
+                    return ImageCompression::LZ4;
+                case proto::ProtoMessage_Compression_ZSTD:
+                    return ImageCompression::ZSTD;
+                default:
+                    return ImageCompression::UNCOMPRESSED;
+            }
+        }
+
+        static void decodeCompact(std::string_view data, Message &out) {
+            const auto *bytes = reinterpret_cast<const uint8_t *>(data.data());
+            if (data.size() != compactPayloadSize || bytes[0] != compactCommandTag || (bytes[2] | bytes[3]) > DirectionSet::allBits) {
+                throw std::runtime_error("Unsupported compact frame");
+            }
+            out.type = Type::COMMAND;
+            out.speed = bytes[1];
+            out.distance = 0;
+            out.battery_percentage = 0;
+            out.image.reset();
+            out.directions = DirectionSet::fromBits(bytes[2]);
+            out.cameraDirections = DirectionSet::fromBits(bytes[3]);
+        }
+
+        static void decodeProto(const SharedBuffer &frame, Message &out) {
+            const std::string_view data = frame.view();
+            int32_t type = 0;
+            uint32_t speed = 0;
+            uint32_t distance = 0;
+            uint32_t battery = 0;
+            size_t imageOffset = 0;
+            size_t imageSize = 0;
+            out.directions.clear();
+            out.cameraDirections.clear();
+            out.frameId = 0;
+            out.timestamps = {};
+            out.imageTiles.clear();
+            out.baseFrameId = 0;
+            int32_t encoding = 0;
+            int32_t compression = 0;
+            uint32_t width = 0;
+            uint32_t height = 0;
+
+            size_t pos = 0;
+            while (pos < data.size()) {
+                const uint32_t tag = readTag(data, pos);
+                const bool varint = (tag & 7) == VARINT;
+                switch (tag >> 3) {
+                    case proto::ProtoMessage::kTypeFieldNumber:
+                        if (!varint) {
+                            skipField(data, pos, tag);
+                            break;
+                        }
+                        type = static_cast<int32_t>(readVarint(data, pos));
+                        break;
+                    case proto::ProtoMessage::kImageFieldNumber:
+                        if ((tag & 7) != LENGTH_DELIMITED) {
+                            skipField(data, pos, tag);
+                            break;
+                        }
+                        imageSize = readVarint(data, pos);
+                        imageOffset = pos;
+                        skipBytes(data, pos, imageSize);
+                        break;
+                    case proto::ProtoMessage::kSpeedFieldNumber:
+                        if (!varint) {
+                            skipField(data, pos, tag);
+                            break;
+                        }
+                        speed = static_cast<uint32_t>(readVarint(data, pos));
+                        break;
+                    case proto::ProtoMessage::kDistanceFieldNumber:
+                        if (!varint) {
+                            skipField(data, pos, tag);
+                            break;
+                        }
+                        distance = static_cast<uint32_t>(readVarint(data, pos));
+                        break;
+                    case proto::ProtoMessage::kBatteryPercentageFieldNumber:
+                        if (!varint) {
+                            skipField(data, pos, tag);
+                            break;
+                        }
+                        battery = static_cast<uint32_t>(readVarint(data, pos));
+                        break;
+                    case proto::ProtoMessage::kDirectionsFieldNumber:
+                        readDirections(data, pos, tag, out.directions);
+                        break;
+                    case proto::ProtoMessage::kCameraDirectionsFieldNumber:
+                        readDirections(data, pos, tag, out.cameraDirections);
+                        break;
+                    case proto::ProtoMessage::kFrameIdFieldNumber:
+                        if (!varint) {
+                            skipField(data, pos, tag);
+                            break;
+                        }
+                        out.frameId = readVarint(data, pos);
+                        break;
+                    case proto::ProtoMessage::kTimestampsFieldNumber:
+                        readTimestamps(data, pos, tag, out.timestamps);
+                        break;
+                    case proto::ProtoMessage::kImageEncodingFieldNumber:
+                        if (!varint) {
+                            skipField(data, pos, tag);
+                            break;
+                        }
+                        encoding = static_cast<int32_t>(readVarint(data, pos));
+                        break;
+                    case proto::ProtoMessage::kImageCompressionFieldNumber:
+                        if (!varint) {
+                            skipField(data, pos, tag);
+                            break;
+                        }
+                        compression = static_cast<int32_t>(readVarint(data, pos));
+                        break;
+                    case proto::ProtoMessage::kImageWidthFieldNumber:
+                        if (!varint) {
+                            skipField(data, pos, tag);
+                            break;
+                        }
+                        width = static_cast<uint32_t>(readVarint(data, pos));
+                        break;
+                    case proto::ProtoMessage::kImageHeightFieldNumber:
+                        if (!varint) {
+                            skipField(data, pos, tag);
+                            break;
+                        }
+                        height = static_cast<uint32_t>(readVarint(data, pos));
+                        break;
+                    case proto::ProtoMessage::kImageTilesFieldNumber:
+                        readTile(frame, pos, tag, out.imageTiles);
+                        break;
+                    case proto::ProtoMessage::kBaseFrameIdFieldNumber:
+                        if (!varint) {
+                            skipField(data, pos, tag);
+                            break;
+                        }
+                        out.baseFrameId = readVarint(data, pos);
+                        break;
+                    default:
+                        skipField(data, pos, tag);
+                        break;
+                }
+            }
+
+            switch (type) {
+                case proto::ProtoMessage_MessageType_IMAGE:
+                    out.type = Type::IMAGE;
+                    break;
+                case proto::ProtoMessage_MessageType_COMMAND:
+                    out.type = Type::COMMAND;
+                    break;
+                default:
+                    out.type = Type::EMPTY;
+                    break;
+            }
+            out.speed = static_cast<uint8_t>(speed);
+            out.distance = static_cast<uint16_t>(distance);
+            out.battery_percentage = static_cast<uint8_t>(battery);
+            if (imageSize > 0) {
+                out.image = frame.slice(imageOffset, imageSize);
+            } else {
+                out.image.reset();
+            }
+            out.imageFormat = {toImageEncoding(encoding), toImageCompression(compression), width, height};
+        }
+
+    public:
+        /**
+         * @brief Parses a serialized ProtoMessage, or a compact command (see isCompactFrame()), into out,
+         *        replacing all of its fields except the session id. The image is a slice of frame, see
+         *        Message::fromProto(const SharedBuffer &).
+         *
+         * @throws std::runtime_error if the frame is not a valid ProtoMessage, or is a batch; out is
+         *         unspecified then.
+         */
+        void decode(const SharedBuffer &frame, Message &out) {
+            const std::string_view data = frame.view();
+            if (isBatchFrame(data)) {
+                throw std::runtime_error("Batch frame holds several messages");
+            }
+            if (isCompactFrame(data)) {
+                out.frameId = 0;
+                out.timestamps = {};
+                out.imageFormat = {};
+                out.imageTiles.clear();
+                out.baseFrameId = 0;
+                decodeCompact(data, out);
+                return;
+            }
+            decodeProto(frame, out);
+        }
+
+        /**
+         * @brief Parses a batch frame (see isBatchFrame()) into one Message per entry, appended to out after
+         *        clearing it. Accepts and rejects exactly what proto::MessageBatch::ParseFromString does with
+         *        the bytes after the tag; images are slices of frame.
+         *
+         * @throws std::runtime_error if the batch is malformed; out is unspecified then.
+         */
+        void decodeBatch(const SharedBuffer &frame, std::vector<Message> &out) {
+            const std::string_view data = frame.view();
+            if (!isBatchFrame(data)) {
+                fail();
+            }
+            out.clear();
+            size_t pos = 1;
+            while (pos < data.size()) {
+                const uint32_t tag = readTag(data, pos);
+                if ((tag >> 3) != proto::MessageBatch::kMessagesFieldNumber || (tag & 7) != LENGTH_DELIMITED) {
+                    skipField(data, pos, tag);
+                    continue;
+                }
+                const uint64_t size = readVarint(data, pos);
+                if (size > data.size() - pos) {
+                    fail();
+                }
+                decodeProto(frame.slice(pos, size), out.emplace_back());
+                pos += size;
+            }
+        }
+    };
 
     std::string toProto() const {
         proto::ProtoMessage message;
+        fillProto(message);
+        return message.SerializeAsString();
+    }
+
+    /**
+     * @brief Serializes the message as a complete wire frame: a 4-byte length prefix (network byte order)
+     *        followed by the ProtoMessage. The frame is written into out, reusing its capacity.
+     *
+     * @param out Buffer that receives the frame; any previous content is replaced.
+     */
+    void toFrame(std::string &out) const {
+        proto::ProtoMessage message;
+        fillProto(message);
+        const uint32_t messageLength = static_cast<uint32_t>(message.ByteSizeLong());
+        const uint32_t prefix = htonl(messageLength);
+        out.resize(sizeof(uint32_t) + messageLength);
+        std::memcpy(out.data(), &prefix, sizeof(uint32_t));
+        message.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t *>(out.data() + sizeof(uint32_t)));
+    }
+
+    /**
+     * @brief Serializes a command as a complete compact frame: the same 4-byte length prefix as toFrame()
+     *        followed by the compact payload, 8 bytes in total. Only valid if fitsCompactFrameWithoutEcho();
+     *        the frame id and timestamps are not sent.
+     *
+     * @param out Buffer that receives the frame; any previous content is replaced.
+     */
+    void toCompactFrame(std::string &out) const {
+        const uint32_t prefix = htonl(compactPayloadSize);
+        out.resize(sizeof(uint32_t) + compactPayloadSize);
+        std::memcpy(out.data(), &prefix, sizeof(uint32_t));
+        out[4] = static_cast<char>(compactCommandTag);
+        out[5] = static_cast<char>(speed);
+        out[6] = static_cast<char>(directions.bits());
+        out[7] = static_cast<char>(cameraDirections.bits());
+    }
+
+    /**
+     * @brief Starts a batch frame in out: the same 4-byte length prefix as toFrame() followed by batchTag.
+     *        Messages are added with appendToBatchFrame(); out is a complete frame after every step.
+     */
+    static void startBatchFrame(std::string &out) {
+        const uint32_t prefix = htonl(1);
+        out.resize(sizeof(uint32_t) + 1);
+        std::memcpy(out.data(), &prefix, sizeof(uint32_t));
+        out[sizeof(uint32_t)] = static_cast<char>(batchTag);
+    }
+
+    /**
+     * @brief Appends the message to a batch frame started with startBatchFrame(), updating its length prefix.
+     */
+    void appendToBatchFrame(std::string &out) const {
+        proto::ProtoMessage message;
+        fillProto(message);
+        const size_t messageLength = message.ByteSizeLong();
+        // the entry's tag and length, as MessageBatch serializes its repeated field
+        uint8_t header[1 + 10];
+        header[0] = static_cast<uint8_t>(proto::MessageBatch::kMessagesFieldNumber << 3 | 2);
+        size_t headerSize = 1;
+        for (size_t value = messageLength; ; value >>= 7) {
+            header[headerSize++] = static_cast<uint8_t>(value >= 0x80 ? (value & 0x7f) | 0x80 : value);
+            if (value < 0x80) {
+                break;
+            }
+        }
+        const size_t offset = out.size();
+        out.resize(offset + headerSize + messageLength);
+        std::memcpy(out.data() + offset, header, headerSize);
+        message.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t *>(out.data() + offset + headerSize));
+        const uint32_t prefix = htonl(static_cast<uint32_t>(out.size() - sizeof(uint32_t)));
+        std::memcpy(out.data(), &prefix, sizeof(uint32_t));
+    }
+
+    void fillProto(proto::ProtoMessage &message) const {
         message.set_speed(speed);
         message.set_distance(distance);
         message.set_battery_percentage(battery_percentage);
@@ -301,9 +988,56 @@ public:
             }
         }
         if (image.has_value()) {
-            message.set_image(image.value());
+            message.set_image(image->data(), image->size());
+        }
+        message.set_frame_id(frameId);
+        switch (imageFormat.encoding) {
+            case ImageEncoding::JPEG:
+                message.set_image_encoding(proto::ProtoMessage_ImageEncoding_JPEG);
+                break;
+            case ImageEncoding::BGR:
+                message.set_image_encoding(proto::ProtoMessage_ImageEncoding_BGR);
+                break;
+            case ImageEncoding::GRAY:
+                message.set_image_encoding(proto::ProtoMessage_ImageEncoding_GRAY);
+                break;
+            case ImageEncoding::YUV420:
+                message.set_image_encoding(proto::ProtoMessage_ImageEncoding_YUV420);
+                break;
+        }
+        switch (imageFormat.compression) {
+            case ImageCompression::UNCOMPRESSED:
+                message.set_image_compression(proto::ProtoMessage_Compression_UNCOMPRESSED);
+                break;
+            case ImageCompression::LZ4:
+                message.set_image_compression(proto::ProtoMessage_Compression_LZ4);
+                break;
+            case ImageCompression::ZSTD:
+                message.set_image_compression(proto::ProtoMessage_Compression_ZSTD);
+                break;
+        }
+        message.set_image_width(imageFormat.width);
+        message.set_image_height(imageFormat.height);
+        for (const auto &tile: imageTiles) {
+            auto *added = message.add_image_tiles();
+            added->set_x(tile.x);
+            added->set_y(tile.y);
+            added->set_width(tile.width);
+            added->set_height(tile.height);
+            added->set_pixels(tile.pixels.data(), tile.pixels.size());
+        }
+        message.set_base_frame_id(baseFrameId);
+        if (timestamps != Timestamps{}) {
+            auto *stamps = message.mutable_timestamps();
+            stamps->set_capture(timestamps.capture);
+            stamps->set_sent(timestamps.sent);
+            stamps->set_received(timestamps.received);
+            stamps->set_decoded(timestamps.decoded);
+            stamps->set_detected(timestamps.detected);
+            stamps->set_command_sent(timestamps.commandSent);
+            stamps->set_echo_command_sent(timestamps.echoCommandSent);
+            stamps->set_echo_command_received(timestamps.echoCommandReceived);
         }
-        return message.SerializeAsString();
     }
 
     std::string toString() const {
@@ -0,0 +1,114 @@
+#ifndef RVR_SERVER_NOTIFIER_HPP
+#define RVR_SERVER_NOTIFIER_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/**
+ * @class Notifier
+ * @brief Lets a consumer thread sleep until a producer signals new data, without a shared mutex.
+ *
+ * Backed by an eventfd. The consumer spins briefly before going to sleep, and the producer only issues a
+ * syscall when the consumer is actually asleep, so a busy pipeline costs one atomic load per item.
+ */
+class Notifier {
+private:
+    int fd;
+    std::atomic<bool> sleeping{false};
+    // spinning only helps if the producer can run meanwhile
+    const int spinIterations = std::thread::hardware_concurrency() > 1 ? 4000 : 0;
+
+    void drain() {
+        // a single read resets the eventfd counter
+        uint64_t value;
+        ::read(fd, &value, sizeof(value));
+    }
+
+    static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+public:
+    Notifier() : fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+        if (fd < 0) {
+            throw std::runtime_error("Failed to create eventfd");
+        }
+    }
+
+    Notifier(const Notifier &) = delete;
+    Notifier &operator=(const Notifier &) = delete;
+
+    ~Notifier() {
+        ::close(fd);
+    }
+
+    /**
+     * @brief Wakes the consumer if it is waiting. Call after publishing the data the consumer waits for.
+     */
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // clear the flag so a burst of items while the consumer is waking up costs a single syscall
+        if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false, std::memory_order_relaxed)) {
+            uint64_t one = 1;
+            ::write(fd, &one, sizeof(one));
+        }
+    }
+
+    /**
+     * @brief Blocks until ready() returns true or the timeout expires.
+     *
+     * @param ready Predicate checking for the published data; evaluated on the calling thread.
+     * @param timeout Maximum time to wait; a negative value waits indefinitely.
+     * @return The last result of ready().
+     */
+    template<typename Predicate>
+    bool wait(Predicate ready, std::chrono::milliseconds timeout = std::chrono::milliseconds(-1)) {
+        for (int i = 0; i < spinIterations; ++i) {
+            if (ready()) {
+                return true;
+            }
+            cpuRelax();
+        }
+
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (!ready()) {
+            sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // re-check after announcing the sleep, a notify() in between would otherwise be missed
+            if (ready()) {
+                sleeping.store(false, std::memory_order_relaxed);
+                return true;
+            }
+
+            int waitMs = -1;
+            if (timeout.count() >= 0) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                if (left.count() <= 0) {
+                    sleeping.store(false, std::memory_order_relaxed);
+                    return ready();
+                }
+                waitMs = static_cast<int>(left.count());
+            }
+            pollfd pfd{fd, POLLIN, 0};
+            int result = ::poll(&pfd, 1, waitMs);
+            sleeping.store(false, std::memory_order_relaxed);
+            if (result < 0 && errno != EINTR) {
+                return ready();
+            }
+            drain();
+        }
+        return true;
+    }
+};
+
+#endif //RVR_SERVER_NOTIFIER_HPP
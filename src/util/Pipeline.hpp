@@ -0,0 +1,229 @@
+#ifndef RVR_SERVER_PIPELINE_HPP
+#define RVR_SERVER_PIPELINE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "Latency.hpp"
+#include "Mailbox.hpp"
+
+/**
+ * @brief Throughput and latency of a pipeline stage since the previous Stage::takeStats().
+ */
+struct StageStats {
+    uint64_t processed = 0;     ///< Items the stage finished.
+    uint64_t dropped = 0;       ///< Items its input queue dropped under its policy.
+    double fps = 0;             ///< Items finished per second.
+    uint64_t meanWait = 0;      ///< Microseconds an item spent in the input queue, on average.
+    uint64_t meanService = 0;   ///< Microseconds the stage worked on an item, on average.
+    uint64_t maxLatency = 0;    ///< Longest wait plus service of an item, in microseconds.
+};
+
+/**
+ * @class StageQueue
+ * @brief Bounded queue handing items from one pipeline stage to the next, any number of threads on each side.
+ *
+ * The policy says what happens when a stage falls behind. KEEP never drops: once `capacity` items are queued
+ * (0 for no bound), push() blocks, which slows the stage before down to this one's pace. DROP_OLDEST evicts
+ * the oldest queued item instead, so a slow stage always works on recent frames; COALESCE keeps only the newest
+ * item. Dropped items are counted, see takeDropped().
+ */
+template<typename T>
+class StageQueue {
+public:
+    struct Entry {
+        T item;
+        uint64_t enqueued;  ///< monotonicMicros() when the item was pushed.
+    };
+
+private:
+    std::mutex mtx;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<Entry> entries;
+    const QueuePolicy policy;
+    uint64_t dropped = 0;
+    bool closed = false;
+
+    bool full() const {
+        const size_t capacity = policy.drop == DropPolicy::COALESCE ? 1 : policy.capacity;
+        return capacity > 0 && entries.size() >= capacity;
+    }
+
+public:
+    explicit StageQueue(QueuePolicy policy = {}) : policy(policy) {}
+
+    /**
+     * @brief Adds an item according to the policy; blocks while the queue is full under KEEP.
+     *
+     * @return false if the queue was closed, in which case the item is discarded.
+     */
+    bool push(T item) {
+        std::unique_lock lock(mtx);
+        if (policy.drop == DropPolicy::KEEP) {
+            notFull.wait(lock, [this] { return closed || !full(); });
+        }
+        if (closed) {
+            return false;
+        }
+        if (full()) {
+            entries.pop_front();
+            dropped++;
+        }
+        entries.push_back({std::move(item), monotonicMicros()});
+        lock.unlock();
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Removes the oldest item, blocking until there is one.
+     *
+     * @return The item, or std::nullopt once the queue is closed and empty.
+     */
+    std::optional<Entry> pop() {
+        std::unique_lock lock(mtx);
+        notEmpty.wait(lock, [this] { return closed || !entries.empty(); });
+        if (entries.empty()) {
+            return std::nullopt;
+        }
+        Entry entry = std::move(entries.front());
+        entries.pop_front();
+        lock.unlock();
+        notFull.notify_one();
+        return entry;
+    }
+
+    /**
+     * @brief Rejects further items and wakes every waiting thread. Queued items can still be popped.
+     */
+    void close() {
+        {
+            std::lock_guard lock(mtx);
+            closed = true;
+        }
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+    /**
+     * @brief Returns the number of items dropped since the previous call.
+     */
+    uint64_t takeDropped() {
+        std::lock_guard lock(mtx);
+        return std::exchange(dropped, 0);
+    }
+
+    size_t size() {
+        std::lock_guard lock(mtx);
+        return entries.size();
+    }
+};
+
+/**
+ * @class Stage
+ * @brief A step of a pipeline: worker threads taking items from a StageQueue and passing results on.
+ *
+ * Each worker pops an item and calls work(item, worker), where worker is the index of the thread, so state
+ * that must not be shared (e.g. a detection cache per thread) can be kept per worker. The work function forwards its
+ * results by pushing them into the next stage's queue itself. With several workers, items may finish out of
+ * order. An exception thrown by work() is reported and the item skipped.
+ *
+ * Destroying the stage closes its input queue and waits for the workers to finish the queued items.
+ */
+template<typename T>
+class Stage {
+private:
+    const std::string name;
+    StageQueue<T> &input;
+    const std::function<void(T &, size_t)> work;
+
+    std::mutex statsMtx;
+    uint64_t processed = 0;
+    uint64_t waitSum = 0;
+    uint64_t serviceSum = 0;
+    uint64_t maxLatency = 0;
+    std::chrono::steady_clock::time_point since = std::chrono::steady_clock::now();
+
+    std::vector<std::jthread> workers;  ///< Last, so the workers are gone before the rest of the stage.
+
+    void run(size_t worker) {
+        while (auto entry = input.pop()) {
+            const uint64_t started = monotonicMicros();
+            try {
+                work(entry->item, worker);
+            } catch (const std::exception &e) {
+                std::cerr << "Stage " << name << ": " << e.what() << std::endl;
+            }
+            const uint64_t finished = monotonicMicros();
+            std::lock_guard lock(statsMtx);
+            processed++;
+            waitSum += started - entry->enqueued;
+            serviceSum += finished - started;
+            maxLatency = std::max(maxLatency, finished - entry->enqueued);
+        }
+    }
+
+public:
+    /**
+     * @param name Name of the stage in reports.
+     * @param input Queue the stage takes its items from; must outlive the stage.
+     * @param threads Number of workers, at least one.
+     * @param work Called for every item with the item and the index of the worker.
+     */
+    Stage(std::string name, StageQueue<T> &input, size_t threads, std::function<void(T &, size_t)> work)
+            : name(std::move(name)), input(input), work(std::move(work)) {
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i) {
+            workers.emplace_back([this, i] { run(i); });
+        }
+    }
+
+    Stage(const Stage &) = delete;
+    Stage &operator=(const Stage &) = delete;
+
+    ~Stage() {
+        input.close();
+    }
+
+    const std::string &getName() const {
+        return name;
+    }
+
+    size_t getThreads() const {
+        return workers.size();
+    }
+
+    /**
+     * @brief Returns the stage's statistics since the previous call and starts a new interval.
+     */
+    StageStats takeStats() {
+        StageStats stats;
+        stats.dropped = input.takeDropped();
+        std::lock_guard lock(statsMtx);
+        const auto now = std::chrono::steady_clock::now();
+        const double seconds = std::chrono::duration<double>(now - since).count();
+        stats.processed = processed;
+        stats.fps = seconds > 0 ? static_cast<double>(processed) / seconds : 0;
+        if (processed > 0) {
+            stats.meanWait = waitSum / processed;
+            stats.meanService = serviceSum / processed;
+        }
+        stats.maxLatency = maxLatency;
+        processed = waitSum = serviceSum = maxLatency = 0;
+        since = now;
+        return stats;
+    }
+};
+
+#endif //RVR_SERVER_PIPELINE_HPP
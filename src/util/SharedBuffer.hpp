@@ -0,0 +1,103 @@
+#ifndef RVR_SERVER_SHAREDBUFFER_HPP
+#define RVR_SERVER_SHAREDBUFFER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+/**
+ * @class SharedBuffer
+ * @brief Immutable, reference-counted view of bytes owned by some other object (a string, a pooled receive
+ *        buffer, ...). Copying a SharedBuffer shares the bytes instead of copying them, and a slice keeps the
+ *        whole owner alive, so e.g. a camera image can point straight into the frame it was received in.
+ *
+ * Every place that does copy bytes into a new SharedBuffer goes through copyOf(), which counts the copies so
+ * tests can check that payloads are not copied on their way through the server.
+ */
+class SharedBuffer {
+private:
+    std::shared_ptr<const void> owner;
+    const unsigned char *bytes = nullptr;
+    size_t length = 0;
+
+    static std::atomic<uint64_t> &copyCounter() {
+        static std::atomic<uint64_t> counter{0};
+        return counter;
+    }
+
+    SharedBuffer(std::shared_ptr<const void> owner, const unsigned char *bytes, size_t length)
+            : owner(std::move(owner)), bytes(bytes), length(length) {}
+
+public:
+    SharedBuffer() = default;
+
+    /**
+     * @brief Takes ownership of a string without copying it.
+     */
+    explicit SharedBuffer(std::string &&data) : SharedBuffer(adopt(std::move(data))) {}
+
+    /**
+     * @brief Takes ownership of any object exposing data() and size() over contiguous bytes, without copying.
+     */
+    template<typename Owner>
+    static SharedBuffer adopt(Owner &&data) {
+        static_assert(!std::is_lvalue_reference_v<Owner>, "adopt() takes ownership, pass an rvalue");
+        auto owned = std::make_shared<std::remove_cv_t<Owner>>(std::move(data));
+        const auto *bytes = reinterpret_cast<const unsigned char *>(owned->data());
+        const size_t length = owned->size();
+        return {std::move(owned), bytes, length};
+    }
+
+    /**
+     * @brief Copies bytes into a new buffer; counted in copies().
+     */
+    static SharedBuffer copyOf(std::string_view data) {
+        copyCounter().fetch_add(1, std::memory_order_relaxed);
+        return adopt(std::string(data));
+    }
+
+    /**
+     * @brief Returns how many times copyOf() was called in this process.
+     */
+    static uint64_t copies() {
+        return copyCounter().load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Returns a buffer sharing ownership of a part of this one.
+     */
+    SharedBuffer slice(size_t offset, size_t size) const {
+        return {owner, bytes + offset, size};
+    }
+
+    const unsigned char *data() const {
+        return bytes;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    bool empty() const {
+        return length == 0;
+    }
+
+    std::string_view view() const {
+        return {reinterpret_cast<const char *>(bytes), length};
+    }
+
+    friend bool operator==(const SharedBuffer &lhs, const SharedBuffer &rhs) {
+        return lhs.view() == rhs.view();
+    }
+
+    friend bool operator==(const SharedBuffer &lhs, std::string_view rhs) {
+        return lhs.view() == rhs;
+    }
+};
+
+#endif //RVR_SERVER_SHAREDBUFFER_HPP
@@ -0,0 +1,159 @@
+#ifndef RVR_SERVER_SPSCQUEUE_HPP
+#define RVR_SERVER_SPSCQUEUE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
+
+/**
+ * @class SpscQueue
+ * @brief Single-producer/single-consumer queue that hands items from one thread to another without locking.
+ *
+ * Items go through a fixed-size lock-free ring and are delivered in order; neither side ever takes a lock. The
+ * queue is bounded: if the consumer falls so far behind that the ring is full, push() refuses new items instead
+ * of blocking the producer or growing without limit, and the producer decides whether to drop or retry them.
+ *
+ * Exactly one thread may call push() and pushAll(), and exactly one (other) thread may call pop() and empty().
+ */
+template<typename T>
+class SpscQueue {
+private:
+    static constexpr size_t cacheLine = 64;
+
+    struct Slot {
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    const size_t capacity;
+    const size_t mask;
+    std::unique_ptr<Slot[]> slots;
+
+    alignas(cacheLine) std::atomic<size_t> head{0};    ///< Next slot to pop, written by the consumer.
+    alignas(cacheLine) size_t cachedTail = 0;          ///< Consumer's last view of tail.
+    alignas(cacheLine) std::atomic<size_t> tail{0};    ///< Next slot to fill, written by the producer.
+    alignas(cacheLine) size_t cachedHead = 0;          ///< Producer's last view of head.
+
+    static size_t roundUp(size_t n) {
+        size_t power = 2;
+        while (power < n) {
+            power <<= 1;
+        }
+        return power;
+    }
+
+    T *slot(size_t index) {
+        return std::launder(reinterpret_cast<T *>(slots[index & mask].storage));
+    }
+
+    bool tryPushRing(T &&item) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - cachedHead == capacity) {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (t - cachedHead == capacity) {
+                return false;
+            }
+        }
+        new(slots[t & mask].storage) T(std::move(item));
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Moves as many of the items as fit into the ring, publishing them with a single store.
+     *
+     * @return The first item that did not fit.
+     */
+    template<typename Iterator>
+    Iterator tryPushRing(Iterator first, Iterator last) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        const auto wanted = static_cast<size_t>(std::distance(first, last));
+        if (capacity - (t - cachedHead) < wanted) {
+            cachedHead = head.load(std::memory_order_acquire);
+        }
+        const size_t count = std::min(wanted, capacity - (t - cachedHead));
+        for (size_t i = 0; i < count; ++i, ++first) {
+            new(slots[(t + i) & mask].storage) T(std::move(*first));
+        }
+        if (count > 0) {
+            tail.store(t + count, std::memory_order_release);
+        }
+        return first;
+    }
+
+    std::optional<T> tryPopRing() {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == cachedTail) {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (h == cachedTail) {
+                return std::nullopt;
+            }
+        }
+        T *item = slot(h);
+        std::optional<T> result(std::move(*item));
+        item->~T();
+        head.store(h + 1, std::memory_order_release);
+        return result;
+    }
+
+public:
+    /**
+     * @param capacity Number of items the lock-free ring holds; rounded up to a power of two.
+     */
+    explicit SpscQueue(size_t capacity = 256) : capacity(roundUp(capacity)), mask(roundUp(capacity) - 1),
+                                                 slots(new Slot[roundUp(capacity)]) {}
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    ~SpscQueue() {
+        while (tryPopRing()) {
+        }
+    }
+
+    /**
+     * @brief Appends an item unless the ring is full. Never blocks on the consumer.
+     *
+     * @return Whether the item was queued; if not, it was dropped.
+     */
+    bool push(T item) {
+        return tryPushRing(std::move(item));
+    }
+
+    /**
+     * @brief Appends as many items of a range as fit, moving them out of the range and publishing them with a
+     *        single store. Items that do not fit are left in the range.
+     *
+     * @return The number of items queued, from the start of the range.
+     */
+    template<typename Iterator>
+    size_t pushAll(Iterator first, Iterator last) {
+        return static_cast<size_t>(std::distance(first, tryPushRing(first, last)));
+    }
+
+    /**
+     * @brief Removes the oldest item, or returns std::nullopt if the queue is empty.
+     */
+    std::optional<T> pop() {
+        return tryPopRing();
+    }
+
+    /**
+     * @brief Returns whether there is nothing to pop. Only meaningful on the consumer thread.
+     */
+    bool empty() const {
+        return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @brief Returns the number of items the queue holds at most.
+     */
+    size_t getCapacity() const {
+        return capacity;
+    }
+};
+
+#endif //RVR_SERVER_SPSCQUEUE_HPP
@@ -0,0 +1,261 @@
+#ifndef RVR_SERVER_YOLODECODE_HPP
+#define RVR_SERVER_YOLODECODE_HPP
+
+#include <cstddef>
+#include <vector>
+
+// Vector kernels: x86 ones are compiled with per-function target attributes and picked at runtime, like those
+// of base64.hpp; NEON is part of every AArch64 CPU.
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define YOLO_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define YOLO_X86_KERNELS 0
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define YOLO_NEON_KERNELS 1
+#include <arm_neon.h>
+#else
+#define YOLO_NEON_KERNELS 0
+#endif
+
+/**
+ * @brief Decoding of the candidate rows a YOLO output layer produces.
+ *
+ * A row holds the box centre, width and height relative to the image, the objectness and one score per class.
+ * OpenCV's Darknet layers scale the class scores by the objectness, so no class of a row can score more than
+ * its objectness and rows are rejected on it before their class scores are read; in a typical frame that is
+ * nearly all of them.
+ */
+namespace yolo {
+
+    /**
+     * @brief Rows that passed the threshold, as a structure of arrays. Cleared, not shrunk, between frames.
+     */
+    struct Candidates {
+        std::vector<float> centerX;     ///< Relative to the image width, like width.
+        std::vector<float> centerY;     ///< Relative to the image height, like height.
+        std::vector<float> width;
+        std::vector<float> height;
+        std::vector<float> score;       ///< Of the best class.
+        std::vector<int> classId;       ///< The first class with the best score.
+
+        void reserve(size_t rows) {
+            for (auto *column: {&centerX, &centerY, &width, &height, &score}) {
+                column->reserve(rows);
+            }
+            classId.reserve(rows);
+        }
+
+        void clear() {
+            for (auto *column: {&centerX, &centerY, &width, &height, &score}) {
+                column->clear();
+            }
+            classId.clear();
+        }
+
+        size_t size() const {
+            return classId.size();
+        }
+    };
+
+    /**
+     * @brief Implementation of the class argmax used by decode(). All of them find the same class.
+     */
+    enum class Kernel {
+        SCALAR,
+        AVX,    ///< 8 scores per step, x86 with AVX.
+        NEON    ///< 4 scores per step, AArch64.
+    };
+
+    namespace detail {
+        constexpr size_t classOffset = 5;
+        constexpr size_t objectnessIndex = 4;
+
+        inline int argmaxScalar(const float *scores, size_t count, float &best) {
+            int bestIndex = 0;
+            best = scores[0];
+            for (size_t i = 1; i < count; ++i) {
+                if (scores[i] > best) {
+                    best = scores[i];
+                    bestIndex = static_cast<int>(i);
+                }
+            }
+            return bestIndex;
+        }
+
+#if YOLO_X86_KERNELS
+        // maximum of all lanes first, then the first lane holding it, so ties go to the lowest class
+        __attribute__((target("avx"))) inline int argmaxAvx(const float *scores, size_t count, float &best) {
+            if (count < 8) {
+                return argmaxScalar(scores, count, best);
+            }
+            const size_t vectorEnd = count & ~size_t{7};
+            __m256 maximum = _mm256_loadu_ps(scores);
+            for (size_t i = 8; i < vectorEnd; i += 8) {
+                maximum = _mm256_max_ps(maximum, _mm256_loadu_ps(scores + i));
+            }
+            __m128 half = _mm_max_ps(_mm256_castps256_ps128(maximum), _mm256_extractf128_ps(maximum, 1));
+            half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+            half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+            best = _mm_cvtss_f32(half);
+            for (size_t i = vectorEnd; i < count; ++i) {
+                best = scores[i] > best ? scores[i] : best;
+            }
+            const __m256 target = _mm256_set1_ps(best);
+            for (size_t i = 0; i < vectorEnd; i += 8) {
+                const int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(scores + i), target, _CMP_EQ_OQ));
+                if (mask != 0) {
+                    return static_cast<int>(i) + __builtin_ctz(static_cast<unsigned>(mask));
+                }
+            }
+            for (size_t i = vectorEnd; i < count; ++i) {
+                if (scores[i] == best) {
+                    return static_cast<int>(i);
+                }
+            }
+            return 0;
+        }
+#endif
+
+#if YOLO_NEON_KERNELS
+        inline int argmaxNeon(const float *scores, size_t count, float &best) {
+            if (count < 4) {
+                return argmaxScalar(scores, count, best);
+            }
+            const size_t vectorEnd = count & ~size_t{3};
+            float32x4_t maximum = vld1q_f32(scores);
+            for (size_t i = 4; i < vectorEnd; i += 4) {
+                maximum = vmaxq_f32(maximum, vld1q_f32(scores + i));
+            }
+            best = vmaxvq_f32(maximum);
+            for (size_t i = vectorEnd; i < count; ++i) {
+                best = scores[i] > best ? scores[i] : best;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                if (scores[i] == best) {
+                    return static_cast<int>(i);
+                }
+            }
+            return 0;
+        }
+#endif
+
+        template<typename Argmax>
+        void decodeRows(const float *rows, size_t count, size_t cols, float threshold, Candidates &out,
+                        Argmax argmax) {
+            const size_t classes = cols - classOffset;
+            for (const float *row = rows, *end = rows + count * cols; row != end; row += cols) {
+                if (row[objectnessIndex] <= threshold) {
+                    continue;
+                }
+                float score;
+                const int classId = argmax(row + classOffset, classes, score);
+                if (score > threshold) {
+                    out.centerX.push_back(row[0]);
+                    out.centerY.push_back(row[1]);
+                    out.width.push_back(row[2]);
+                    out.height.push_back(row[3]);
+                    out.score.push_back(score);
+                    out.classId.push_back(classId);
+                }
+            }
+        }
+    }  // namespace detail
+
+    /**
+     * @brief Whether the given kernel was compiled in and the CPU running the program supports it.
+     */
+    inline bool kernelSupported(Kernel kernel) {
+        switch (kernel) {
+            case Kernel::SCALAR:
+                return true;
+#if YOLO_X86_KERNELS
+            case Kernel::AVX:
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("avx");
+#endif
+#if YOLO_NEON_KERNELS
+            case Kernel::NEON:
+                return true;
+#endif
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * @brief The fastest kernel this CPU supports, detected on first use.
+     */
+    inline Kernel bestKernel() {
+        static const Kernel best = [] {
+            for (Kernel kernel: {Kernel::AVX, Kernel::NEON}) {
+                if (kernelSupported(kernel)) {
+                    return kernel;
+                }
+            }
+            return Kernel::SCALAR;
+        }();
+        return best;
+    }
+
+    /**
+     * @brief Appends the rows whose best class scores more than threshold to out.
+     *
+     * A kernel that is not supported on this CPU falls back to the scalar one.
+     *
+     * @param rows count rows of cols floats each, cols > 5.
+     */
+    inline void decode(const float *rows, size_t count, size_t cols, float threshold, Candidates &out,
+                       Kernel kernel = bestKernel()) {
+        if (cols <= detail::classOffset) {
+            return;
+        }
+        if (kernel != Kernel::SCALAR && kernelSupported(kernel)) {
+            switch (kernel) {
+#if YOLO_X86_KERNELS
+                case Kernel::AVX:
+                    detail::decodeRows(rows, count, cols, threshold, out, detail::argmaxAvx);
+                    return;
+#endif
+#if YOLO_NEON_KERNELS
+                case Kernel::NEON:
+                    detail::decodeRows(rows, count, cols, threshold, out, detail::argmaxNeon);
+                    return;
+#endif
+                default:
+                    break;
+            }
+        }
+        detail::decodeRows(rows, count, cols, threshold, out, detail::argmaxScalar);
+    }
+
+    /**
+     * @brief Like decode(), but only the given classes are scored; rows are kept if one of them scores more than
+     *        threshold, however well other classes score.
+     *
+     * Reads a few scores per row instead of all of them, so no vector kernel is needed.
+     *
+     * @param classes Ids of the classes to score, each below cols - 5; ties go to the one listed first.
+     */
+    inline void decode(const float *rows, size_t count, size_t cols, float threshold, const std::vector<int> &classes,
+                       Candidates &out) {
+        if (cols <= detail::classOffset || classes.empty()) {
+            return;
+        }
+        detail::decodeRows(rows, count, cols, threshold, out, [&classes](const float *scores, size_t, float &best) {
+            int bestClass = classes.front();
+            best = scores[bestClass];
+            for (int classId: classes) {
+                if (scores[classId] > best) {
+                    best = scores[classId];
+                    bestClass = classId;
+                }
+            }
+            return bestClass;
+        });
+    }
+}
+
+#endif //RVR_SERVER_YOLODECODE_HPP
@@ -14,6 +14,22 @@
 #include <bit>  // For std::bit_cast.
 #endif
 
+// Vector kernels: x86 ones are compiled with per-function target attributes and picked at runtime, so the
+// rest of the program needs no special compiler flags; NEON is part of every AArch64 CPU.
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BASE64_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define BASE64_X86_KERNELS 0
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define BASE64_NEON_KERNELS 1
+#include <arm_neon.h>
+#else
+#define BASE64_NEON_KERNELS 0
+#endif
+
 namespace base64 {
 
     namespace detail {
@@ -488,88 +504,407 @@ inline constexpr size_t decidx2{3};
                 'w', 'x', 'y', 'z', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+',
                 '/'};
 
-    }  // namespace detail
+        // Scalar loops shared by every kernel for the input a vector kernel leaves over
 
-    template <class OutputBuffer, class InputIterator>
-    inline OutputBuffer encode_into(InputIterator begin, InputIterator end) {
-        typedef std::decay_t<decltype(*begin)> input_value_type;
-        static_assert(std::is_same_v<input_value_type, char> ||
-                      std::is_same_v<input_value_type, signed char> ||
-                      std::is_same_v<input_value_type, unsigned char> ||
-                      std::is_same_v<input_value_type, std::byte>);
-        typedef typename OutputBuffer::value_type output_value_type;
-        static_assert(std::is_same_v<output_value_type, char> ||
-                      std::is_same_v<output_value_type, signed char> ||
-                      std::is_same_v<output_value_type, unsigned char> ||
-                      std::is_same_v<output_value_type, std::byte>);
-        const size_t binarytextsize = end - begin;
-        const size_t encodedsize = (binarytextsize / 3 + (binarytextsize % 3 > 0))
-                << 2;
-        OutputBuffer encoded(encodedsize, detail::padding_char);
-
-        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&*begin);
-        char* currEncoding = reinterpret_cast<char*>(&encoded[0]);
-
-        for (size_t i = binarytextsize / 3; i; --i) {
-            const uint8_t t1 = *bytes++;
-            const uint8_t t2 = *bytes++;
-            const uint8_t t3 = *bytes++;
-            *currEncoding++ = detail::encode_table_0[t1];
-            *currEncoding++ =
-                    detail::encode_table_1[((t1 & 0x03) << 4) | ((t2 >> 4) & 0x0F)];
-            *currEncoding++ =
-                    detail::encode_table_1[((t2 & 0x0F) << 2) | ((t3 >> 6) & 0x03)];
-            *currEncoding++ = detail::encode_table_1[t3];
+        inline char* encode_scalar(const uint8_t* bytes, size_t size, char* out) {
+            for (size_t i = size / 3; i; --i) {
+                const uint8_t t1 = *bytes++;
+                const uint8_t t2 = *bytes++;
+                const uint8_t t3 = *bytes++;
+                *out++ = encode_table_0[t1];
+                *out++ = encode_table_1[((t1 & 0x03) << 4) | ((t2 >> 4) & 0x0F)];
+                *out++ = encode_table_1[((t2 & 0x0F) << 2) | ((t3 >> 6) & 0x03)];
+                *out++ = encode_table_1[t3];
+            }
+
+            switch (size % 3) {
+                case 0: {
+                    break;
+                }
+                case 1: {
+                    const uint8_t t1 = bytes[0];
+                    *out++ = encode_table_0[t1];
+                    *out++ = encode_table_1[(t1 & 0x03) << 4];
+                    *out++ = padding_char;
+                    *out++ = padding_char;
+                    break;
+                }
+                case 2: {
+                    const uint8_t t1 = bytes[0];
+                    const uint8_t t2 = bytes[1];
+                    *out++ = encode_table_0[t1];
+                    *out++ = encode_table_1[((t1 & 0x03) << 4) | ((t2 >> 4) & 0x0F)];
+                    *out++ = encode_table_1[(t2 & 0x0F) << 2];
+                    *out++ = padding_char;
+                    break;
+                }
+            }
+            return out;
         }
 
-        switch (binarytextsize % 3) {
-            case 0: {
-                break;
+        [[noreturn]] inline void invalid_character() {
+            throw std::runtime_error{"Invalid base64 encoded data - Invalid character"};
+        }
+
+        // Decodes complete quadruples without padding
+        inline char* decode_scalar(const uint8_t* bytes, size_t quads, char* out) {
+            for (size_t i = quads; i; --i) {
+                const uint8_t t1 = *bytes++;
+                const uint8_t t2 = *bytes++;
+                const uint8_t t3 = *bytes++;
+                const uint8_t t4 = *bytes++;
+
+                const uint32_t d1 = decode_table_0[t1];
+                const uint32_t d2 = decode_table_1[t2];
+                const uint32_t d3 = decode_table_2[t3];
+                const uint32_t d4 = decode_table_3[t4];
+
+                const uint32_t temp = d1 | d2 | d3 | d4;
+
+                if (temp >= bad_char) {
+                    invalid_character();
+                }
+
+                // Use bit_cast instead of union and type punning to avoid
+                // undefined behaviour risk:
+                // https://en.wikipedia.org/wiki/Type_punning#Use_of_union
+                const std::array<char, 4> tempBytes =
+                        bit_cast<std::array<char, 4>, uint32_t>(temp);
+
+                *out++ = tempBytes[decidx0];
+                *out++ = tempBytes[decidx1];
+                *out++ = tempBytes[decidx2];
             }
-            case 1: {
-                const uint8_t t1 = bytes[0];
-                *currEncoding++ = detail::encode_table_0[t1];
-                *currEncoding++ = detail::encode_table_1[(t1 & 0x03) << 4];
-                // *currEncoding++ = detail::padding_char;
-                // *currEncoding++ = detail::padding_char;
-                break;
+            return out;
+        }
+
+        // Vector kernels. Each one converts as many whole blocks as it can without reading or writing past
+        // the given sizes and returns the number of input bytes it consumed; the scalar loops do the rest.
+        // Decode kernels never consume the last quadruple, which may hold padding.
+
+#if BASE64_X86_KERNELS
+        // After Muła and Lemire, "Faster Base64 Encoding and Decoding Using AVX2 Instructions"
+
+        __attribute__((target("ssse3"))) inline __m128i encode_lookup_ssse3(__m128i indices) {
+            // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12, then add the offset stored there
+            const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                                  '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                                  '/' - 63, 'A', 0, 0);
+            __m128i slot = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+            const __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+            slot = _mm_or_si128(slot, _mm_and_si128(upper, _mm_set1_epi8(13)));
+            return _mm_add_epi8(_mm_shuffle_epi8(offsets, slot), indices);
+        }
+
+        __attribute__((target("ssse3"))) inline __m128i encode_indices_ssse3(__m128i in) {
+            // spread 3 bytes over 4 lanes of 6 bits each
+            in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+            const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+            const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+            const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+            const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+            return _mm_or_si128(t1, t3);
+        }
+
+        __attribute__((target("ssse3"))) inline size_t encode_ssse3(const uint8_t* in, size_t size, char* out) {
+            size_t i = 0;
+            // 16-byte loads of which 12 bytes are used
+            for (; size - i >= 16; i += 12, out += 16) {
+                const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out), encode_lookup_ssse3(encode_indices_ssse3(block)));
             }
-            case 2: {
-                const uint8_t t1 = bytes[0];
-                const uint8_t t2 = bytes[1];
-                *currEncoding++ = detail::encode_table_0[t1];
-                *currEncoding++ =
-                        detail::encode_table_1[((t1 & 0x03) << 4) | ((t2 >> 4) & 0x0F)];
-                *currEncoding++ = detail::encode_table_1[(t2 & 0x0F) << 2];
-                // *currEncoding++ = detail::padding_char;
-                break;
+            return i;
+        }
+
+        __attribute__((target("avx2"))) inline size_t encode_avx2(const uint8_t* in, size_t size, char* out) {
+            const __m256i spread = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                                   10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+            const __m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                                     '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                                     '/' - 63, 'A', 0, 0,
+                                                     'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                                     '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                                     '/' - 63, 'A', 0, 0);
+            size_t i = 0;
+            // two 12-byte groups per iteration, one per 128-bit lane; the second load reads 4 bytes ahead
+            for (; size - i >= 28; i += 24, out += 32) {
+                const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+                const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12));
+                __m256i block = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+                block = _mm256_shuffle_epi8(block, spread);
+                const __m256i t0 = _mm256_and_si256(block, _mm256_set1_epi32(0x0fc0fc00));
+                const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+                const __m256i t2 = _mm256_and_si256(block, _mm256_set1_epi32(0x003f03f0));
+                const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+                const __m256i indices = _mm256_or_si256(t1, t3);
+
+                __m256i slot = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+                const __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+                slot = _mm256_or_si256(slot, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+                const __m256i encoded = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, slot), indices);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), encoded);
             }
-            default: {
-                throw std::runtime_error{"Invalid base64 encoded data"};
+            return i;
+        }
+
+        // Translates 16 characters to their 6-bit values; returns false if any of them is not in the alphabet
+        __attribute__((target("ssse3"))) inline bool decode_values_ssse3(__m128i in, __m128i& values) {
+            const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                                 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+            const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                                 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+            const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+            const __m128i nibble = _mm_set1_epi8(0x0f);
+
+            const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), nibble);
+            const __m128i lo_nibbles = _mm_and_si128(in, nibble);
+            const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+            const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff) {
+                return false;
             }
+            const __m128i eq_2f = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+            const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+            values = _mm_add_epi8(in, roll);
+            return true;
         }
 
-        return encoded;
+        __attribute__((target("ssse3"))) inline size_t decode_ssse3(const uint8_t* in, size_t size, char* out) {
+            size_t i = 0;
+            // each 16-byte store carries 12 decoded bytes; keeping 8 characters back leaves room for the rest
+            for (; size - i >= 24; i += 16, out += 12) {
+                __m128i values;
+                if (!decode_values_ssse3(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)), values)) {
+                    invalid_character();
+                }
+                const __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+                const __m128i packed = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+                const __m128i bytes = _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                                                             -1, -1, -1, -1));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out), bytes);
+            }
+            return i;
+        }
+
+        __attribute__((target("avx2"))) inline size_t decode_avx2(const uint8_t* in, size_t size, char* out) {
+            const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                                    0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                                    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                                    0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+            const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                                    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                                    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                                    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+            const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                                      0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+            const __m256i nibble = _mm256_set1_epi8(0x0f);
+            const __m256i gather = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+            size_t i = 0;
+            // each 32-byte store carries 24 decoded bytes; keeping 16 characters back leaves room for the rest
+            for (; size - i >= 48; i += 32, out += 24) {
+                const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+                const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(block, 4), nibble);
+                const __m256i lo_nibbles = _mm256_and_si256(block, nibble);
+                const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+                const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+                if (!_mm256_testz_si256(lo, hi)) {
+                    invalid_character();
+                }
+                const __m256i eq_2f = _mm256_cmpeq_epi8(block, _mm256_set1_epi8('/'));
+                const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+                const __m256i values = _mm256_add_epi8(block, roll);
+
+                const __m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+                const __m256i packed = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+                // 12 bytes at the start of each lane, moved next to each other
+                const __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(packed, gather),
+                                                                  _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), bytes);
+            }
+            return i;
+        }
+#endif
+
+#if BASE64_NEON_KERNELS
+        inline uint8x16x4_t neon_table(const char* table) {
+            const auto* bytes = reinterpret_cast<const uint8_t*>(table);
+            return {vld1q_u8(bytes), vld1q_u8(bytes + 16), vld1q_u8(bytes + 32), vld1q_u8(bytes + 48)};
+        }
+
+        inline size_t encode_neon(const uint8_t* in, size_t size, char* out) {
+            // encode_table_1 repeats the alphabet, its first 64 entries are the alphabet itself
+            const uint8x16x4_t alphabet = neon_table(encode_table_1.data());
+            const uint8x16_t low6 = vdupq_n_u8(0x3f);
+            size_t i = 0;
+            for (; size - i >= 48; i += 48, out += 64) {
+                const uint8x16x3_t block = vld3q_u8(in + i);
+                uint8x16x4_t indices;
+                indices.val[0] = vshrq_n_u8(block.val[0], 2);
+                indices.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(block.val[0], 4), vshrq_n_u8(block.val[1], 4)), low6);
+                indices.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(block.val[1], 2), vshrq_n_u8(block.val[2], 6)), low6);
+                indices.val[3] = vandq_u8(block.val[2], low6);
+                uint8x16x4_t encoded;
+                for (int lane = 0; lane < 4; ++lane) {
+                    encoded.val[lane] = vqtbl4q_u8(alphabet, indices.val[lane]);
+                }
+                vst4q_u8(reinterpret_cast<uint8_t*>(out), encoded);
+            }
+            return i;
+        }
+
+        inline size_t decode_neon(const uint8_t* in, size_t size, char* out) {
+            // 6-bit value of each ASCII character, 0xff where it is not in the alphabet
+            static const std::array<uint8_t, 128> values = [] {
+                std::array<uint8_t, 128> table{};
+                table.fill(0xff);
+                for (uint8_t value = 0; value < 64; ++value) {
+                    table[static_cast<uint8_t>(encode_table_1[value])] = value;
+                }
+                return table;
+            }();
+            const uint8x16x4_t low = neon_table(reinterpret_cast<const char*>(values.data()));
+            const uint8x16x4_t high = neon_table(reinterpret_cast<const char*>(values.data() + 64));
+            const uint8x16_t offset = vdupq_n_u8(64);
+            size_t i = 0;
+            for (; size - i >= 64 + 4; i += 64, out += 48) {
+                const uint8x16x4_t block = vld4q_u8(in + i);
+                uint8x16x4_t decoded;
+                uint8x16_t invalid = vdupq_n_u8(0);
+                for (int lane = 0; lane < 4; ++lane) {
+                    // characters 0..63 from the first half of the table, 64..127 from the second; anything
+                    // above 127 is left at 0 by both lookups and caught by its top bit
+                    uint8x16_t value = vqtbl4q_u8(low, block.val[lane]);
+                    value = vqtbx4q_u8(value, high, vsubq_u8(block.val[lane], offset));
+                    invalid = vorrq_u8(invalid, vorrq_u8(value, block.val[lane]));
+                    decoded.val[lane] = value;
+                }
+                // both invalid values (0xff) and non-ASCII characters have the top bit set
+                if (vmaxvq_u8(invalid) & 0x80) {
+                    invalid_character();
+                }
+                uint8x16x3_t bytes;
+                bytes.val[0] = vorrq_u8(vshlq_n_u8(decoded.val[0], 2), vshrq_n_u8(decoded.val[1], 4));
+                bytes.val[1] = vorrq_u8(vshlq_n_u8(decoded.val[1], 4), vshrq_n_u8(decoded.val[2], 2));
+                bytes.val[2] = vorrq_u8(vshlq_n_u8(decoded.val[2], 6), decoded.val[3]);
+                vst3q_u8(reinterpret_cast<uint8_t*>(out), bytes);
+            }
+            return i;
+        }
+#endif
+
+    }  // namespace detail
+
+    /**
+     * Implementation used by encode_to() and decode_to(). All of them produce identical output and reject
+     * the same input; the vector kernels only exist on the matching CPUs.
+     */
+    enum class kernel {
+        scalar,
+        ssse3,  ///< 16 characters per step, x86 with SSSE3.
+        avx2,   ///< 32 characters per step, x86 with AVX2.
+        neon    ///< 64 characters per step, AArch64.
+    };
+
+    /**
+     * Whether the given kernel was compiled in and the CPU running the program supports it.
+     */
+    inline bool kernel_supported(kernel k) {
+        switch (k) {
+            case kernel::scalar:
+                return true;
+#if BASE64_X86_KERNELS
+            case kernel::ssse3:
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("ssse3");
+            case kernel::avx2:
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("avx2");
+#endif
+#if BASE64_NEON_KERNELS
+            case kernel::neon:
+                return true;
+#endif
+            default:
+                return false;
+        }
     }
 
-    template <class OutputBuffer>
-    inline OutputBuffer encode_into(std::string_view data) {
-        return encode_into<OutputBuffer>(std::begin(data), std::end(data));
+    /**
+     * The fastest kernel this CPU supports, detected on first use.
+     */
+    inline kernel best_kernel() {
+        static const kernel best = [] {
+            for (kernel k : {kernel::avx2, kernel::neon, kernel::ssse3}) {
+                if (kernel_supported(k)) {
+                    return k;
+                }
+            }
+            return kernel::scalar;
+        }();
+        return best;
     }
 
-    inline std::string to_base64(std::string_view data) {
-        return encode_into<std::string>(std::begin(data), std::end(data));
+    /**
+     * Number of characters encode_to() writes for size input bytes, padding included.
+     */
+    constexpr size_t encoded_size(size_t size) {
+        return (size / 3 + (size % 3 > 0)) << 2;
     }
 
-    template <class OutputBuffer>
-    inline OutputBuffer decode_into(std::string_view base64Text) {
-        typedef typename OutputBuffer::value_type output_value_type;
-        static_assert(std::is_same_v<output_value_type, char> ||
-                      std::is_same_v<output_value_type, signed char> ||
-                      std::is_same_v<output_value_type, unsigned char> ||
-                      std::is_same_v<output_value_type, std::byte>);
+    /**
+     * Number of bytes decode_to() writes for the given text. Does not validate the text beyond its padding.
+     */
+    inline size_t decoded_size(std::string_view base64Text) {
+        if (base64Text.size() < 4) {
+            return 0;
+        }
+        const size_t numPadding = std::count(base64Text.rbegin(), base64Text.rbegin() + 4, '=');
+        return (base64Text.size() * 3 >> 2) - std::min<size_t>(numPadding, 2);
+    }
+
+    /**
+     * Encodes data into out, which must have room for encoded_size(data.size()) characters.
+     * A kernel that is not supported on this CPU falls back to the scalar one.
+     *
+     * @return The number of characters written.
+     */
+    inline size_t encode_to(std::string_view data, char* out, kernel k = best_kernel()) {
+        const auto* bytes = reinterpret_cast<const uint8_t*>(data.data());
+        size_t consumed = 0;
+        if (k != kernel::scalar && kernel_supported(k)) {
+            switch (k) {
+#if BASE64_X86_KERNELS
+                case kernel::ssse3:
+                    consumed = detail::encode_ssse3(bytes, data.size(), out);
+                    break;
+                case kernel::avx2:
+                    consumed = detail::encode_avx2(bytes, data.size(), out);
+                    break;
+#endif
+#if BASE64_NEON_KERNELS
+                case kernel::neon:
+                    consumed = detail::encode_neon(bytes, data.size(), out);
+                    break;
+#endif
+                default:
+                    break;
+            }
+        }
+        const char* end = detail::encode_scalar(bytes + consumed, data.size() - consumed, out + consumed / 3 * 4);
+        return static_cast<size_t>(end - out);
+    }
+
+    /**
+     * Decodes base64Text into out, which must have room for decoded_size(base64Text) bytes.
+     * A kernel that is not supported on this CPU falls back to the scalar one.
+     *
+     * @return The number of bytes written.
+     * @throws std::runtime_error if the text is not valid base64.
+     */
+    inline size_t decode_to(std::string_view base64Text, char* out, kernel k = best_kernel()) {
         if (base64Text.empty()) {
-            return OutputBuffer();
+            return 0;
         }
 
         if ((base64Text.size() & 3) != 0) {
@@ -584,40 +919,33 @@ inline constexpr size_t decidx2{3};
                     "Invalid base64 encoded data - Found more than 2 padding signs"};
         }
 
-        const size_t decodedsize = (base64Text.size() * 3 >> 2) - numPadding;
-        OutputBuffer decoded(decodedsize, '.');
-
         const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&base64Text[0]);
-        char* currDecoding = reinterpret_cast<char*>(&decoded[0]);
-
-        for (size_t i = (base64Text.size() >> 2) - (numPadding != 0); i; --i) {
-            const uint8_t t1 = *bytes++;
-            const uint8_t t2 = *bytes++;
-            const uint8_t t3 = *bytes++;
-            const uint8_t t4 = *bytes++;
-
-            const uint32_t d1 = detail::decode_table_0[t1];
-            const uint32_t d2 = detail::decode_table_1[t2];
-            const uint32_t d3 = detail::decode_table_2[t3];
-            const uint32_t d4 = detail::decode_table_3[t4];
-
-            const uint32_t temp = d1 | d2 | d3 | d4;
-
-            if (temp >= detail::bad_char) {
-                throw std::runtime_error{
-                        "Invalid base64 encoded data - Invalid character"};
+        char* currDecoding = out;
+        size_t consumed = 0;
+        if (k != kernel::scalar && kernel_supported(k)) {
+            switch (k) {
+#if BASE64_X86_KERNELS
+                case kernel::ssse3:
+                    consumed = detail::decode_ssse3(bytes, base64Text.size(), currDecoding);
+                    break;
+                case kernel::avx2:
+                    consumed = detail::decode_avx2(bytes, base64Text.size(), currDecoding);
+                    break;
+#endif
+#if BASE64_NEON_KERNELS
+                case kernel::neon:
+                    consumed = detail::decode_neon(bytes, base64Text.size(), currDecoding);
+                    break;
+#endif
+                default:
+                    break;
             }
-
-            // Use bit_cast instead of union and type punning to avoid
-            // undefined behaviour risk:
-            // https://en.wikipedia.org/wiki/Type_punning#Use_of_union
-            const std::array<char, 4> tempBytes =
-                    detail::bit_cast<std::array<char, 4>, uint32_t>(temp);
-
-            *currDecoding++ = tempBytes[detail::decidx0];
-            *currDecoding++ = tempBytes[detail::decidx1];
-            *currDecoding++ = tempBytes[detail::decidx2];
         }
+        bytes += consumed;
+        currDecoding += consumed / 4 * 3;
+        currDecoding = detail::decode_scalar(bytes, ((base64Text.size() - consumed) >> 2) - (numPadding != 0),
+                                             currDecoding);
+        bytes = reinterpret_cast<const uint8_t*>(&base64Text[0]) + base64Text.size() - 4 * (numPadding != 0);
 
         switch (numPadding) {
             case 0: {
@@ -635,8 +963,7 @@ inline constexpr size_t decidx2{3};
                 const uint32_t temp = d1 | d2 | d3;
 
                 if (temp >= detail::bad_char) {
-                    throw std::runtime_error{
-                            "Invalid base64 encoded data - Invalid character"};
+                    detail::invalid_character();
                 }
 
                 // Use bit_cast instead of union and type punning to avoid
@@ -658,8 +985,7 @@ inline constexpr size_t decidx2{3};
                 const uint32_t temp = d1 | d2;
 
                 if (temp >= detail::bad_char) {
-                    throw std::runtime_error{
-                            "Invalid base64 encoded data - Invalid character"};
+                    detail::invalid_character();
                 }
 
                 const std::array<char, 4> tempBytes =
@@ -673,6 +999,52 @@ inline constexpr size_t decidx2{3};
             }
         }
 
+        return static_cast<size_t>(currDecoding - out);
+    }
+
+    template <class OutputBuffer, class InputIterator>
+    inline OutputBuffer encode_into(InputIterator begin, InputIterator end) {
+        typedef std::decay_t<decltype(*begin)> input_value_type;
+        static_assert(std::is_same_v<input_value_type, char> ||
+                      std::is_same_v<input_value_type, signed char> ||
+                      std::is_same_v<input_value_type, unsigned char> ||
+                      std::is_same_v<input_value_type, std::byte>);
+        typedef typename OutputBuffer::value_type output_value_type;
+        static_assert(std::is_same_v<output_value_type, char> ||
+                      std::is_same_v<output_value_type, signed char> ||
+                      std::is_same_v<output_value_type, unsigned char> ||
+                      std::is_same_v<output_value_type, std::byte>);
+        const size_t binarytextsize = end - begin;
+        OutputBuffer encoded(encoded_size(binarytextsize), detail::padding_char);
+        if (binarytextsize > 0) {
+            encode_to(std::string_view(reinterpret_cast<const char*>(&*begin), binarytextsize),
+                      reinterpret_cast<char*>(&encoded[0]));
+        }
+        return encoded;
+    }
+
+    template <class OutputBuffer>
+    inline OutputBuffer encode_into(std::string_view data) {
+        return encode_into<OutputBuffer>(std::begin(data), std::end(data));
+    }
+
+    inline std::string to_base64(std::string_view data) {
+        return encode_into<std::string>(std::begin(data), std::end(data));
+    }
+
+    template <class OutputBuffer>
+    inline OutputBuffer decode_into(std::string_view base64Text) {
+        typedef typename OutputBuffer::value_type output_value_type;
+        static_assert(std::is_same_v<output_value_type, char> ||
+                      std::is_same_v<output_value_type, signed char> ||
+                      std::is_same_v<output_value_type, unsigned char> ||
+                      std::is_same_v<output_value_type, std::byte>);
+        if (base64Text.empty()) {
+            return OutputBuffer();
+        }
+
+        OutputBuffer decoded(decoded_size(base64Text), '.');
+        decode_to(base64Text, reinterpret_cast<char*>(&decoded[0]));
         return decoded;
     }
 
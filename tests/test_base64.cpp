@@ -0,0 +1,117 @@
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "base64.hpp"
+
+namespace {
+    const std::vector<std::pair<base64::kernel, const char *>> kernels = {
+            {base64::kernel::scalar, "scalar"},
+            {base64::kernel::ssse3, "SSSE3"},
+            {base64::kernel::avx2, "AVX2"},
+            {base64::kernel::neon, "NEON"},
+    };
+
+    std::string randomBytes(std::mt19937 &random, size_t size) {
+        std::string bytes(size, '\0');
+        for (char &c: bytes) {
+            c = static_cast<char>(random());
+        }
+        return bytes;
+    }
+
+    std::string encode(std::string_view data, base64::kernel k) {
+        std::string out(base64::encoded_size(data.size()), '\0');
+        out.resize(base64::encode_to(data, out.data(), k));
+        return out;
+    }
+
+    std::string decode(std::string_view text, base64::kernel k) {
+        std::string out(base64::decoded_size(text), '\0');
+        out.resize(base64::decode_to(text, out.data(), k));
+        return out;
+    }
+
+    std::string loadImage(const std::string &path) {
+        std::ifstream fileStream(path, std::ios::binary);
+        return {std::istreambuf_iterator<char>(fileStream), std::istreambuf_iterator<char>()};
+    }
+}
+
+TEST_CASE("base64 kernels agree with the scalar codec", "[base64]") {
+    std::mt19937 random(15);
+    CHECK(base64::to_base64("foobar") == "Zm9vYmFy");
+    CHECK(base64::to_base64("fooba") == "Zm9vYmE=");
+    CHECK(base64::from_base64("Zm9vYg==") == "foob");
+    std::cout << "Active base64 kernel: " << kernels[static_cast<size_t>(base64::best_kernel())].second << "\n";
+
+    for (const auto &[k, name]: kernels) {
+        if (!base64::kernel_supported(k)) {
+            continue;
+        }
+        INFO("kernel " << name);
+        // every length around the vector block sizes, so each kernel ends on every possible remainder
+        for (size_t size = 0; size < 300; ++size) {
+            const std::string data = randomBytes(random, size);
+            const std::string text = encode(data, k);
+            REQUIRE(text == encode(data, base64::kernel::scalar));
+            REQUIRE(decode(text, k) == data);
+        }
+
+        // a bad character anywhere is found, whichever part of the input the vector loop covers
+        const std::string text = encode(randomBytes(random, 200), k);
+        for (size_t i = 0; i < text.size(); ++i) {
+            for (char bad: {'*', '=', '\x80', '\0', '-', '_'}) {
+                std::string broken = text;
+                if (broken[i] == '=') {
+                    continue;
+                }
+                broken[i] = bad;
+                // '=' is accepted as padding in the last two positions only
+                if (bad == '=' && i + 2 >= broken.size() && broken.back() == '=') {
+                    continue;
+                }
+                REQUIRE_THROWS(decode(broken, k));
+            }
+        }
+    }
+}
+
+TEST_CASE("base64 kernel throughput", "[.][benchmark]") {
+    const std::string image = loadImage(IMAGE_PATH);
+    const std::string text = base64::to_base64(image);
+    std::string encoded(base64::encoded_size(image.size()), '\0');
+    std::string decoded(base64::decoded_size(text), '\0');
+
+    for (const auto &[k, name]: kernels) {
+        if (!base64::kernel_supported(k)) {
+            continue;
+        }
+        const base64::kernel kernel = k;
+        // report GB/s of binary data, on a full camera frame
+        const int rounds = 200;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; ++i) {
+            base64::encode_to(image, encoded.data(), kernel);
+        }
+        auto encodeTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; ++i) {
+            base64::decode_to(text, decoded.data(), kernel);
+        }
+        auto decodeTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << name << ": encode " << image.size() * rounds / encodeTime / 1e9 << " GB/s, decode "
+                  << image.size() * rounds / decodeTime / 1e9 << " GB/s\n";
+
+        BENCHMARK(std::string("encode ") + name) {
+            return base64::encode_to(image, encoded.data(), kernel);
+        };
+        BENCHMARK(std::string("decode ") + name) {
+            return base64::decode_to(text, decoded.data(), kernel);
+        };
+    }
+}
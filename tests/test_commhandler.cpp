@@ -1,12 +1,20 @@
 #include "CommunicationHandler.hpp"
+#include "simple_socket/TCPSocket.hpp"
 #include "Message.hpp"
 #include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
 #include <thread>
 #include <fstream>
 #include <condition_variable>
 #include <filesystem>
 #include <chrono>
 #include <iostream>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <random>
+#include <cstring>
+
+using namespace simple_socket;
 
 std::string loadImage(std::filesystem::path path) {
 
@@ -19,6 +27,34 @@ std::string loadImage(std::filesystem::path path) {
     return fileContent;
 }
 
+// Writes a frame the way the robot does: a 4-byte length in network byte order followed by the payload
+void writeFrame(SimpleConnection &conn, const std::string &payload) {
+    const uint32_t length = htonl(static_cast<uint32_t>(payload.size()));
+    conn.write(reinterpret_cast<const unsigned char *>(&length), sizeof(uint32_t));
+    conn.write(payload);
+}
+
+// Reads one frame the server wrote, length prefix included; unless the robot asked for network byte order, the
+// server writes the length in host byte order
+std::string readFrame(SimpleConnection &conn, bool networkOrder = false) {
+    std::string frame;
+    std::vector<unsigned char> buffer;
+    uint32_t length = 0;
+    while (frame.size() < sizeof(uint32_t) + length) {
+        // never read past the frame, the next one may already be waiting behind it
+        buffer.resize(frame.size() < sizeof(uint32_t) ? sizeof(uint32_t) - frame.size()
+                                                      : sizeof(uint32_t) + length - frame.size());
+        int n = conn.read(buffer);
+        REQUIRE(n > 0);
+        frame.append(buffer.begin(), buffer.begin() + n);
+        if (frame.size() >= sizeof(uint32_t)) {
+            std::memcpy(&length, frame.data(), sizeof(uint32_t));
+            length = networkOrder ? ntohl(length) : length;
+        }
+    }
+    return frame;
+}
+
 TEST_CASE("CommunicationHandler read/write") {
     uint16_t port = 8000;
     std::condition_variable cv;
@@ -27,17 +63,10 @@ TEST_CASE("CommunicationHandler read/write") {
 
     std::string image = loadImage(IMAGE_PATH);
 
-    Message message1 = Message::fromJSONString("{\"speed\": 100, \"directions\": [\"forward\", \"left\"]}");
-    Message message2 = Message::fromJSONString("{\"speed\": 50, \"directions\": [\"backward\", \"right\"]}");
+    Message message1 = Message::fromJSONString("{\"speed\": 100, \"directions\": [\"forward\", \"left\"], \"type\": 1}");
+    Message message2 = Message::fromJSONString("{\"speed\": 50, \"directions\": [\"backward\", \"right\"], \"type\": 0}");
     message2.setImageFromString(image);
 
-    // Store message sizes
-    const uint32_t message1Size = message1.toProto().size();
-    const uint32_t message2Size = message2.toProto().size();
-
-
-
-
     std::thread serverThread([&] {
         CommunicationHandler server(port);
         // Signal that the server is ready
@@ -72,11 +101,9 @@ TEST_CASE("CommunicationHandler read/write") {
         const auto conn = client.connect("127.0.0.1", port);
         REQUIRE(conn);
         // send first message
-        conn->write(reinterpret_cast<const unsigned char *>(&message1Size), sizeof(uint32_t));
-        conn->write(message1.toProto());
+        writeFrame(*conn, message1.toProto());
         // send second message
-        conn->write(reinterpret_cast<const unsigned char *>(&message2Size), sizeof(uint32_t));
-        conn->write(message2.toProto());
+        writeFrame(*conn, message2.toProto());
 
     });
 
@@ -94,17 +121,16 @@ TEST_CASE("CommunicationHandler message processing rate") {
     std::string image = loadImage(IMAGE_PATH);
 
     // Prepare a message with an image
-    Message imageMessage = Message::fromJSONString("{\"speed\": 100, \"directions\": [\"forward\", \"left\"]}");
+    Message imageMessage = Message::fromJSONString("{\"speed\": 100, \"directions\": [\"forward\", \"left\"], \"type\": 0}");
     imageMessage.setImageFromString(image);
 
-    // Store message size
-    const uint32_t messageSize = imageMessage.toProto().size();
-
     const int messageCount = 300; // Define the number of messages to send for the test
     int receivedCount = 0;
 
     std::thread serverThread([&] {
         CommunicationHandler server(port);
+        // measure raw throughput, every frame has to arrive
+        server.setQueuePolicy(Type::IMAGE, {DropPolicy::KEEP});
 
         // Signal that the server is ready
         {
@@ -144,11 +170,1115 @@ TEST_CASE("CommunicationHandler message processing rate") {
         REQUIRE(conn);
 
         for (int i = 0; i < messageCount; ++i) {
-            conn->write(reinterpret_cast<const unsigned char *>(&messageSize), sizeof(uint32_t));
-            conn->write(imageMessage.toProto());
+            writeFrame(*conn, imageMessage.toProto());
         }
     });
 
     clientThread.join();
     serverThread.join();
-}
\ No newline at end of file
+}
+TEST_CASE("FrameBuffer reassembly") {
+    Message command = Message::fromJSONString("{\"speed\": 10, \"directions\": [\"left\"], \"type\": 1}");
+    Message imageMessage = Message::fromJSONString("{\"speed\": 20, \"directions\": [\"right\"], \"type\": 0}");
+    imageMessage.setImageFromString(loadImage(IMAGE_PATH));
+
+    // two frames back to back as they would arrive on the wire
+    std::string wire;
+    for (const auto &payload : {command.toProto(), imageMessage.toProto()}) {
+        const uint32_t length = htonl(static_cast<uint32_t>(payload.size()));
+        wire.append(reinterpret_cast<const char *>(&length), sizeof(uint32_t));
+        wire.append(payload);
+    }
+
+    FrameBuffer buffer(64);
+    std::vector<Message> received;
+    // feed the stream in uneven chunks so prefixes and payloads are split across reads
+    size_t offset = 0;
+    size_t chunk = 3;
+    while (offset < wire.size()) {
+        size_t n = std::min(chunk, wire.size() - offset);
+        auto space = buffer.prepare(n);
+        std::memcpy(space.data(), wire.data() + offset, n);
+        buffer.commit(n);
+        offset += n;
+        chunk = chunk * 2 + 1;
+        while (auto frame = buffer.nextFrame()) {
+            received.push_back(Message::fromProto(frame->payload));
+        }
+    }
+
+    REQUIRE(received.size() == 2);
+    CHECK(received[0] == command);
+    CHECK(received[1] == imageMessage);
+    CHECK_FALSE(buffer.nextFrame().has_value());
+}
+
+TEST_CASE("FrameBuffer reads the frames Message writes") {
+    Message command(Type::COMMAND, 0, 40, {Direction::FORWARD}, {Direction::LEFT}, std::nullopt, 0);
+    Message imageMessage = Message::fromJSONString("{\"speed\": 20, \"directions\": [\"right\"], \"type\": 0}");
+    imageMessage.setImageFromString(loadImage(IMAGE_PATH));
+
+    // outbound frames use the same prefix as inbound ones, so a server could read what it writes
+    std::string wire;
+    std::string frame;
+    imageMessage.toFrame(frame);
+    wire += frame;
+    command.toCompactFrame(frame);
+    wire += frame;
+    Message::startBatchFrame(frame);
+    command.appendToBatchFrame(frame);
+    wire += frame;
+
+    FrameBuffer buffer(64);
+    auto space = buffer.prepare(wire.size());
+    std::memcpy(space.data(), wire.data(), wire.size());
+    buffer.commit(wire.size());
+
+    auto first = buffer.nextFrame();
+    REQUIRE(first);
+    CHECK(Message::fromProto(first->payload) == imageMessage);
+    auto second = buffer.nextFrame();
+    REQUIRE(second);
+    CHECK(second->payload.size() == Message::compactPayloadSize);
+    CHECK(Message::isCompactFrame(second->payload));
+    auto third = buffer.nextFrame();
+    REQUIRE(third);
+    CHECK(Message::isBatchFrame(third->payload));
+    CHECK_FALSE(buffer.nextFrame().has_value());
+}
+
+TEST_CASE("CommunicationHandler reads frames with exact-size reads") {
+    uint16_t port = 8001;
+    std::string image = loadImage(IMAGE_PATH);
+
+    Message imageMessage = Message::fromJSONString("{\"speed\": 100, \"directions\": [\"forward\"], \"type\": 0}");
+    imageMessage.setImageFromString(image);
+    const std::string payload = imageMessage.toProto();
+    const int messageCount = 20;
+
+    CommunicationHandler server(port);
+
+    TCPClientContext client;
+    const auto conn = client.connect("127.0.0.1", port);
+    REQUIRE(conn);
+    std::thread clientThread([&] {
+        for (int i = 0; i < messageCount; ++i) {
+            writeFrame(*conn, payload);
+        }
+    });
+    clientThread.join();
+
+    // keep the connection open until everything arrived so only reads that returned data are counted
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.getReadStats().frames < messageCount && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    ReadStats stats = server.getReadStats();
+    conn->close();
+    REQUIRE(stats.frames == messageCount);
+    double readsPerFrame = static_cast<double>(stats.readCalls) / messageCount;
+    double copiedPerFrame = static_cast<double>(stats.bytesCopied) / messageCount;
+    std::cout << "Frame of " << payload.size() << " bytes: " << readsPerFrame << " reads and "
+              << copiedPerFrame << " bytes copied per frame.\n";
+
+    // a 1024-byte read loop would need payload.size() / 1024 reads per frame
+    CHECK(readsPerFrame < static_cast<double>(payload.size()) / 1024 / 4);
+    // only the payload bytes that arrived together with the prefix are copied
+    CHECK(copiedPerFrame <= 1024);
+    CHECK(server.getLatestMessage() == imageMessage);
+}
+
+TEST_CASE("CommunicationHandler writes a frame with a single write") {
+    uint16_t port = 8002;
+    CommunicationHandler server(port);
+
+    TCPClientContext client;
+    const auto conn = client.connect("127.0.0.1", port);
+    REQUIRE(conn);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.connectionCount == 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(server.connectionCount == 1);
+
+    Message command;
+    command.setType(Type::COMMAND);
+    command.setSpeed(42);
+    command.addDirection(Direction::RIGHT);
+    server.write(command);
+    server.write(command);
+
+    // both frames arrive intact, each as a host-order length followed by the payload
+    const std::string payload = command.toProto();
+    std::string received;
+    std::vector<unsigned char> buffer(256);
+    while (received.size() < 2 * (sizeof(uint32_t) + payload.size())) {
+        int n = conn->read(buffer);
+        REQUIRE(n > 0);
+        received.append(buffer.begin(), buffer.begin() + n);
+    }
+    for (int i = 0; i < 2; ++i) {
+        uint32_t length;
+        std::memcpy(&length, received.data(), sizeof(uint32_t));
+        REQUIRE(length == payload.size());
+        CHECK(Message::fromProto(std::string_view(received).substr(sizeof(uint32_t), length)) == command);
+        received.erase(0, sizeof(uint32_t) + length);
+    }
+}
+
+TEST_CASE("CommunicationHandler writes network-order prefixes to robots that ask for them") {
+    uint16_t port = 8020;
+    CommunicationHandler server(port);
+
+    TCPClientContext client;
+    const auto legacy = client.connect("127.0.0.1", port);
+    const auto current = client.connect("127.0.0.1", port);
+    REQUIRE(legacy);
+    REQUIRE(current);
+    Message hello(Type::COMMAND, 0, 0, {}, {}, std::nullopt, 0);
+    writeFrame(*legacy, hello.toProto());
+    // the same frame, with the flag that asks for network order
+    std::string frame;
+    hello.toFrame(frame);
+    uint32_t prefix;
+    std::memcpy(&prefix, frame.data(), sizeof(uint32_t));
+    prefix = htonl(ntohl(prefix) | FrameBuffer::networkOrderFlag);
+    std::memcpy(frame.data(), &prefix, sizeof(uint32_t));
+    current->write(frame);
+
+    std::vector<Message> received;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (received.size() < 2 && std::chrono::steady_clock::now() < deadline) {
+        if (server.waitForMessages(std::chrono::milliseconds(10))) {
+            received.push_back(server.getLatestMessage());
+        }
+    }
+    REQUIRE(received.size() == 2);
+    CHECK(received[0] == hello);
+    CHECK(received[1] == hello);
+
+    // answer both: the first robot reads host order, the second network order
+    Message command = Message::fromJSONString("{\"speed\": 30, \"directions\": [\"left\"], \"type\": 1}");
+    for (const auto &message : received) {
+        command.setSessionId(message.getSessionId());
+        server.write(command);
+    }
+    std::string expected;
+    command.toFrame(expected);
+    CHECK(readFrame(*current, true) == expected);
+    const std::string legacyFrame = readFrame(*legacy);
+    uint32_t length;
+    std::memcpy(&length, legacyFrame.data(), sizeof(uint32_t));
+    CHECK(length == expected.size() - sizeof(uint32_t));
+    CHECK(legacyFrame.substr(sizeof(uint32_t)) == expected.substr(sizeof(uint32_t)));
+}
+
+TEST_CASE("CommunicationHandler serves several robots at once") {
+    uint16_t port = 8003;
+    CommunicationHandler server(port);
+
+    Message command1 = Message::fromJSONString("{\"speed\": 10, \"directions\": [\"left\"], \"type\": 1}");
+    Message command2 = Message::fromJSONString("{\"speed\": 20, \"directions\": [\"right\"], \"type\": 1}");
+
+    TCPClientContext client;
+    const auto robot1 = client.connect("127.0.0.1", port);
+    const auto robot2 = client.connect("127.0.0.1", port);
+    REQUIRE(robot1);
+    REQUIRE(robot2);
+
+    // send half a frame from the first robot so its reassembly state is mid-frame while the second one sends
+    const std::string payload1 = command1.toProto();
+    const uint32_t length1 = htonl(static_cast<uint32_t>(payload1.size()));
+    robot1->write(reinterpret_cast<const unsigned char *>(&length1), sizeof(uint32_t));
+    writeFrame(*robot2, command2.toProto());
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    robot1->write(payload1);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    std::vector<Message> received;
+    while (received.size() < 2 && std::chrono::steady_clock::now() < deadline) {
+        Message message = server.getLatestMessage();
+        if (message != Message()) {
+            received.push_back(message);
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    REQUIRE(received.size() == 2);
+    REQUIRE(server.getSessionIds().size() == 2);
+    // sessions are served in turn, so the order depends on timing
+    if (received[0] == command1) {
+        std::swap(received[0], received[1]);
+    }
+    CHECK(received[0] == command2);
+    CHECK(received[1] == command1);
+    CHECK(received[0].getSessionId() != received[1].getSessionId());
+
+    // a reply addressed to one session only reaches that robot
+    Message reply;
+    reply.setType(Type::COMMAND);
+    reply.addDirection(Direction::FORWARD);
+    reply.setSessionId(received[1].getSessionId());
+    server.write(reply);
+
+    std::vector<unsigned char> buffer(256);
+    int n = robot1->read(buffer);
+    REQUIRE(n == static_cast<int>(sizeof(uint32_t) + reply.toProto().size()));
+    CHECK(Message::fromProto(std::string_view(reinterpret_cast<const char *>(buffer.data()) + sizeof(uint32_t),
+                                              n - sizeof(uint32_t))) == reply);
+
+    // a disconnected robot's session is removed while the other one stays
+    robot2->close();
+    deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.connectionCount != 1 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    CHECK(server.getSessionIds() == std::vector<uint32_t>{received[1].getSessionId()});
+}
+
+TEST_CASE("Mailbox drop policies") {
+    Message image = Message::fromJSONString("{\"speed\": 1, \"type\": 0}");
+    Message command = Message::fromJSONString("{\"speed\": 2, \"type\": 1}");
+
+    Mailbox mailbox;
+    mailbox.setPolicy(Type::IMAGE, {DropPolicy::DROP_OLDEST, 2});
+
+    Message image1 = image, image2 = image, image3 = image;
+    image1.setDistance(1);
+    image2.setDistance(2);
+    image3.setDistance(3);
+    CHECK(mailbox.push(Message(image1)) == Mailbox::PushResult::QUEUED);
+    CHECK(mailbox.push(Message(command)) == Mailbox::PushResult::QUEUED);
+    CHECK(mailbox.push(Message(image2)) == Mailbox::PushResult::QUEUED);
+    CHECK(mailbox.push(Message(image3)) == Mailbox::PushResult::DROPPED_OLDEST);
+
+    // the oldest image is gone, arrival order within each lane is kept
+    REQUIRE(mailbox.size() == 3);
+    CHECK(*mailbox.pop() == command);
+    CHECK(*mailbox.pop() == image2);
+    CHECK(*mailbox.pop() == image3);
+    CHECK_FALSE(mailbox.pop().has_value());
+
+    mailbox.setPolicy(Type::IMAGE, {DropPolicy::COALESCE});
+    CHECK(mailbox.push(Message(image1)) == Mailbox::PushResult::QUEUED);
+    CHECK(mailbox.push(Message(command)) == Mailbox::PushResult::QUEUED);
+    CHECK(mailbox.push(Message(image2)) == Mailbox::PushResult::COALESCED);
+    REQUIRE(mailbox.size() == 2);
+    // commands are delivered before images regardless of arrival order
+    CHECK(*mailbox.pop() == command);
+    CHECK(*mailbox.pop() == image2);
+}
+
+TEST_CASE("CommunicationHandler keeps only the newest image") {
+    uint16_t port = 8004;
+    CommunicationHandler server(port);
+
+    Message command = Message::fromJSONString("{\"speed\": 10, \"directions\": [\"left\"], \"type\": 1}");
+    const int imageCount = 10;
+
+    TCPClientContext client;
+    const auto conn = client.connect("127.0.0.1", port);
+    REQUIRE(conn);
+    for (int i = 1; i <= imageCount; ++i) {
+        Message image = Message::fromJSONString("{\"speed\": 10, \"type\": 0}");
+        image.setDistance(i);
+        writeFrame(*conn, image.toProto());
+        if (i == imageCount / 2) {
+            writeFrame(*conn, command.toProto());
+        }
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.getReadStats().frames < imageCount + 1 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // nothing was consumed, so all but the last image were replaced while the command survived
+    CHECK(server.getLatestMessage() == command);
+    CHECK(server.getQueueStats().dropped == imageCount - 1);
+    Message newest = server.getLatestMessage();
+    CHECK(newest.getType() == Type::IMAGE);
+    CHECK(newest.getDistance() == imageCount);
+    CHECK_FALSE(server.hasMessages());
+}
+
+TEST_CASE("CommunicationHandler drops messages instead of buffering them for a stalled consumer") {
+    uint16_t port = 8017;
+    CommunicationHandler server(port);
+    const int commandCount = 3000;
+
+    TCPClientContext client;
+    const auto conn = client.connect("127.0.0.1", port);
+    REQUIRE(conn);
+    std::string stream;
+    for (int i = 0; i < commandCount; ++i) {
+        Message command(Type::COMMAND, static_cast<uint16_t>(i), 10, {Direction::LEFT}, {}, std::nullopt, 0);
+        const std::string payload = command.toProto();
+        const uint32_t length = htonl(static_cast<uint32_t>(payload.size()));
+        stream.append(reinterpret_cast<const char *>(&length), sizeof(uint32_t));
+        stream.append(payload);
+    }
+    conn->write(stream);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.getReadStats().frames < commandCount && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(server.getReadStats().frames == commandCount);
+
+    // the consumer took nothing: the handoff queue filled up and the rest was counted, not kept
+    const uint64_t overflowed = server.getQueueStats().overflowed;
+    CHECK(overflowed > 0);
+    int retrieved = 0;
+    while (server.hasMessages()) {
+        Message message = server.getLatestMessage();
+        REQUIRE(message.getDistance() == retrieved);
+        retrieved++;
+    }
+    CHECK(retrieved + overflowed == commandCount);
+}
+
+// Writes one chunk of a larger message, as sent on a priority lane
+void writeChunk(SimpleConnection &conn, Lane lane, bool last, std::string_view data) {
+    const uint32_t length = htonl(static_cast<uint32_t>(data.size() + 1) | FrameBuffer::chunkFlag);
+    std::string frame(reinterpret_cast<const char *>(&length), sizeof(uint32_t));
+    frame.push_back(static_cast<char>(static_cast<uint8_t>(lane) | (last ? 0x80 : 0)));
+    frame.append(data);
+    conn.write(frame);
+}
+
+TEST_CASE("CommunicationHandler interleaves commands with chunked images") {
+    uint16_t port = 8005;
+    CommunicationHandler server(port);
+
+    Message command = Message::fromJSONString("{\"speed\": 10, \"directions\": [\"left\"], \"type\": 1}");
+    Message imageMessage = Message::fromJSONString("{\"speed\": 20, \"type\": 0}");
+    imageMessage.setImageFromString(loadImage(IMAGE_PATH));
+    const std::string image = imageMessage.toProto();
+    const size_t chunk = 16 * 1024;
+
+    TCPClientContext client;
+    const auto conn = client.connect("127.0.0.1", port);
+    REQUIRE(conn);
+
+    // the first half of the image, then a command, which must not wait for the rest of the image
+    size_t offset = 0;
+    for (; offset < image.size() / 2; offset += chunk) {
+        writeChunk(*conn, Lane::BULK, false, std::string_view(image).substr(offset, chunk));
+    }
+    writeFrame(*conn, command.toProto());
+
+    auto waitForMessage = [&server] {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (!server.hasMessages() && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return server.getLatestMessage();
+    };
+    CHECK(waitForMessage() == command);
+
+    for (; offset < image.size(); offset += chunk) {
+        writeChunk(*conn, Lane::BULK, offset + chunk >= image.size(), std::string_view(image).substr(offset, chunk));
+    }
+    CHECK(waitForMessage() == imageMessage);
+
+    // the robot sent chunks, so a large outgoing image is chunked and a later command overtakes it
+    Message bigImage = imageMessage;
+    std::string bigPayload;
+    for (int i = 0; i < 16; ++i) {
+        bigPayload += imageMessage.getImage()->view();
+    }
+    bigImage.setImageFromString(bigPayload);
+    server.write(bigImage);
+    server.write(command);
+
+    std::string stream;
+    std::vector<unsigned char> buffer(64 * 1024);
+    std::string partial;
+    bool commandFirst = false;
+    bool imageDone = false;
+    while (!imageDone) {
+        int n = conn->read(buffer);
+        REQUIRE(n > 0);
+        stream.append(buffer.begin(), buffer.begin() + n);
+        while (stream.size() >= sizeof(uint32_t)) {
+            uint32_t prefix;
+            std::memcpy(&prefix, stream.data(), sizeof(uint32_t));
+            const uint32_t length = prefix & ~FrameBuffer::chunkFlag;
+            if (stream.size() < sizeof(uint32_t) + length) {
+                break;
+            }
+            std::string_view payload = std::string_view(stream).substr(sizeof(uint32_t), length);
+            if (prefix & FrameBuffer::chunkFlag) {
+                REQUIRE(length <= chunk + 1);
+                CHECK((payload[0] & 0x7f) == static_cast<char>(Lane::BULK));
+                partial.append(payload.substr(1));
+                if (payload[0] & 0x80) {
+                    CHECK(Message::fromProto(partial) == bigImage);
+                    imageDone = true;
+                }
+            } else {
+                CHECK(Message::fromProto(payload) == command);
+                commandFirst = !imageDone;
+            }
+            stream.erase(0, sizeof(uint32_t) + length);
+        }
+    }
+    CHECK(commandFirst);
+}
+
+TEST_CASE("CommunicationHandler receives through the io_uring backend") {
+    uint16_t port = 8006;
+    std::string image = loadImage(IMAGE_PATH);
+
+    Message imageMessage = Message::fromJSONString("{\"speed\": 100, \"directions\": [\"forward\"], \"type\": 0}");
+    imageMessage.setImageFromString(image);
+    Message command = Message::fromJSONString("{\"speed\": 50, \"directions\": [\"left\"], \"type\": 1}");
+    const int messageCount = 10;
+
+    // falls back to epoll where io_uring is not built in or not permitted; both must behave the same
+    CommunicationHandler server(port, true, ReceiveBackend::IO_URING);
+    server.setQueuePolicy(Type::IMAGE, {DropPolicy::KEEP, 0});
+    std::cout << "Receive backend: " << (server.getBackend() == ReceiveBackend::IO_URING ? "io_uring" : "epoll") << "\n";
+
+    TCPClientContext client;
+    const auto conn = client.connect("127.0.0.1", port);
+    REQUIRE(conn);
+    for (int i = 0; i < messageCount; ++i) {
+        writeFrame(*conn, imageMessage.toProto());
+        writeFrame(*conn, command.toProto());
+    }
+
+    int images = 0;
+    int commands = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (images + commands < 2 * messageCount && std::chrono::steady_clock::now() < deadline) {
+        server.waitForMessages(std::chrono::milliseconds(100));
+        while (server.hasMessages()) {
+            Message message = server.getLatestMessage();
+            if (message.getType() == Type::IMAGE) {
+                CHECK(message == imageMessage);
+                images++;
+            } else {
+                CHECK(message == command);
+                commands++;
+            }
+        }
+    }
+    CHECK(images == messageCount);
+    CHECK(commands == messageCount);
+
+    // a hangup ends the session
+    conn->close();
+    deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.connectionCount > 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK(server.connectionCount == 0);
+}
+
+TEST_CASE("Receive backends on loopback", "[.][benchmark]") {
+    std::string image = loadImage(IMAGE_PATH);
+    Message imageMessage;
+    imageMessage.setType(Type::IMAGE);
+    imageMessage.setImageFromString(image);
+    const std::string payload = imageMessage.toProto();
+    const int messageCount = 100;
+
+    auto run = [&](CommunicationHandler &server, SimpleConnection &conn) {
+        std::thread clientThread([&] {
+            for (int i = 0; i < messageCount; ++i) {
+                writeFrame(conn, payload);
+            }
+        });
+        int received = 0;
+        while (received < messageCount) {
+            server.waitForMessages();
+            while (server.hasMessages()) {
+                server.getLatestMessage();
+                received++;
+            }
+        }
+        clientThread.join();
+        return received;
+    };
+
+    uint16_t port = 8007;
+    for (auto backend : {ReceiveBackend::EPOLL, ReceiveBackend::IO_URING}) {
+        CommunicationHandler server(port++, true, backend);
+        server.setQueuePolicy(Type::IMAGE, {DropPolicy::KEEP, 0});
+        TCPClientContext client;
+        const auto conn = client.connect("127.0.0.1", port - 1);
+        REQUIRE(conn);
+
+        const std::string name = backend == ReceiveBackend::EPOLL ? "epoll" : "io_uring";
+        if (server.getBackend() != backend) {
+            WARN(name + " is not available, skipping");
+            continue;
+        }
+        BENCHMARK(name + ", 100 camera frames") {
+            return run(server, *conn);
+        };
+        ReadStats stats = server.getReadStats();
+        std::cout << name << ": " << static_cast<double>(stats.readCalls) / stats.frames << " reads and "
+                  << static_cast<double>(stats.bytesCopied) / stats.frames << " bytes copied per frame\n";
+    }
+}
+
+TEST_CASE("DatagramReassembler tolerates loss and reordering") {
+    auto frameOf = [](uint32_t id) {
+        std::string frame(5000 + id * 7, '\0');
+        for (size_t i = 0; i < frame.size(); ++i) {
+            frame[i] = static_cast<char>(i * 31 + id);
+        }
+        return frame;
+    };
+    DatagramReassembler reassembler(std::chrono::milliseconds(100));
+    const auto now = DatagramReassembler::Clock::now();
+
+    // reversed fragments still make up the frame
+    auto first = DatagramReassembler::fragment(frameOf(1), 1, 1000);
+    REQUIRE(first.size() == 6);
+    std::optional<std::string> result;
+    for (auto it = first.rbegin(); it != first.rend(); ++it) {
+        REQUIRE(!result);
+        result = reassembler.add(*it, now);
+    }
+    CHECK(result == frameOf(1));
+
+    // frame 2 loses a fragment and is superseded once frame 3 completes
+    auto second = DatagramReassembler::fragment(frameOf(2), 2, 1000);
+    auto third = DatagramReassembler::fragment(frameOf(3), 3, 1000);
+    for (size_t i = 1; i < second.size(); ++i) {
+        CHECK(!reassembler.add(second[i], now));
+    }
+    std::swap(third[0], third[3]);
+    result.reset();
+    for (const auto &datagram : third) {
+        REQUIRE(!result);
+        result = reassembler.add(datagram, now);
+    }
+    CHECK(result == frameOf(3));
+    CHECK(reassembler.discardedFrames() == 1);
+    CHECK(reassembler.pendingFrames() == 0);
+
+    // the late fragment and duplicates of delivered frames are ignored
+    CHECK(!reassembler.add(second[0], now));
+    CHECK(!reassembler.add(third[1], now));
+    CHECK(reassembler.pendingFrames() == 0);
+
+    // an incomplete frame is dropped after the deadline
+    auto fourth = DatagramReassembler::fragment(frameOf(4), 4, 1000);
+    CHECK(!reassembler.add(fourth[0], now));
+    reassembler.expire(now + std::chrono::milliseconds(200));
+    CHECK(reassembler.pendingFrames() == 0);
+    CHECK(reassembler.discardedFrames() == 2);
+
+    // malformed datagrams are ignored
+    std::string truncated = DatagramReassembler::fragment(frameOf(5), 5, 1000)[0];
+    truncated.pop_back();
+    CHECK(!reassembler.add(truncated, now));
+    CHECK(!reassembler.add("short", now));
+    CHECK(reassembler.pendingFrames() == 0);
+}
+
+TEST_CASE("DatagramReassembler ignores frames announcing more than the maximum size") {
+    DatagramReassembler reassembler(std::chrono::milliseconds(100), 4, 10000);
+    const auto now = DatagramReassembler::Clock::now();
+
+    // the largest header a datagram can carry: 65535 fragments of a full datagram each, close to 4 GiB
+    const size_t share = DatagramReassembler::maxDatagramSize - DatagramReassembler::headerSize;
+    const auto length = static_cast<uint32_t>(share * UINT16_MAX);
+    std::string hostile(DatagramReassembler::headerSize + share, '\0');
+    const unsigned char header[] = {0, 0, 0, 1, 0, 0, 0xff, 0xff, static_cast<unsigned char>(length >> 24),
+                                    static_cast<unsigned char>(length >> 16), static_cast<unsigned char>(length >> 8),
+                                    static_cast<unsigned char>(length)};
+    std::memcpy(hostile.data(), header, sizeof(header));
+    CHECK(!reassembler.add(hostile, now));
+    CHECK(reassembler.pendingFrames() == 0);
+    CHECK(!DatagramReassembler().add(hostile, now));
+
+    // up to the limit frames still get through
+    CHECK(!reassembler.add(DatagramReassembler::fragment(std::string(10001, 'x'), 2, 1000)[0], now));
+    CHECK(reassembler.pendingFrames() == 0);
+    std::optional<std::string> result;
+    for (const auto &datagram : DatagramReassembler::fragment(std::string(10000, 'y'), 3, 1000)) {
+        REQUIRE(!result);
+        result = reassembler.add(datagram, now);
+    }
+    CHECK(result == std::string(10000, 'y'));
+}
+
+TEST_CASE("DatagramReassembler delivers only intact frames under random loss") {
+    std::mt19937 random(42);
+    std::bernoulli_distribution lost(0.02);
+    DatagramReassembler reassembler;
+    const auto now = DatagramReassembler::Clock::now();
+
+    std::vector<std::string> sent;
+    std::vector<std::string> datagrams;
+    for (uint32_t id = 0; id < 200; ++id) {
+        std::string frame(3000 + random() % 20000, '\0');
+        for (auto &c : frame) {
+            c = static_cast<char>(random());
+        }
+        for (auto &datagram : DatagramReassembler::fragment(frame, id)) {
+            if (!lost(random)) {
+                datagrams.push_back(std::move(datagram));
+            }
+        }
+        sent.push_back(std::move(frame));
+    }
+    // reorder within a small window, like a network with several paths
+    for (size_t i = 0; i + 8 < datagrams.size(); i += 4) {
+        std::shuffle(datagrams.begin() + static_cast<long>(i), datagrams.begin() + static_cast<long>(i + 8), random);
+    }
+
+    size_t delivered = 0;
+    size_t lastId = 0;
+    for (const auto &datagram : datagrams) {
+        if (auto frame = reassembler.add(datagram, now)) {
+            auto it = std::find(sent.begin(), sent.end(), *frame);
+            REQUIRE(it != sent.end());
+            const auto id = static_cast<size_t>(it - sent.begin());
+            CHECK((delivered == 0 || id > lastId));
+            lastId = id;
+            delivered++;
+        }
+    }
+    std::cout << "Delivered " << delivered << " of " << sent.size() << " frames at 2% datagram loss, "
+              << reassembler.discardedFrames() << " discarded.\n";
+    // about 80% of the frames lose none of their datagrams
+    CHECK(delivered > sent.size() / 2);
+}
+
+TEST_CASE("CommunicationHandler receives images over UDP next to commands over TCP") {
+    uint16_t port = 8010;
+    uint16_t imagePort = 8011;
+
+    auto imageOf = [](char fill) {
+        Message message;
+        message.setType(Type::IMAGE);
+        message.setImageFromString(std::string(30000, fill));
+        return message;
+    };
+    Message command = Message::fromJSONString("{\"speed\": 50, \"directions\": [\"left\"], \"type\": 1}");
+
+    CommunicationHandler server(port, true, ReceiveBackend::EPOLL, imagePort);
+    server.setQueuePolicy(Type::IMAGE, {DropPolicy::KEEP, 0});
+
+    TCPClientContext client;
+    const auto conn = client.connect("127.0.0.1", port);
+    REQUIRE(conn);
+    writeFrame(*conn, command.toProto());
+    // images are only taken from robots whose connection has been accepted
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.connectionCount < 1 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(server.connectionCount == 1);
+
+    auto send = [&](UdpSocket &socket, const std::string &datagram) {
+        REQUIRE(socket.sendTo(reinterpret_cast<const unsigned char *>(datagram.data()), datagram.size(),
+                              "127.0.0.1", imagePort));
+    };
+    UdpSocket robot;
+    // frame 1 arrives reordered, frame 2 loses a fragment, frame 3 is intact
+    auto first = DatagramReassembler::fragment(imageOf('a').toProto(), 1);
+    auto second = DatagramReassembler::fragment(imageOf('b').toProto(), 2);
+    auto third = DatagramReassembler::fragment(imageOf('c').toProto(), 3);
+    std::reverse(first.begin(), first.end());
+    for (const auto &datagram : first) {
+        send(robot, datagram);
+    }
+    for (size_t i = 0; i + 1 < second.size(); ++i) {
+        send(robot, second[i]);
+    }
+    for (const auto &datagram : third) {
+        send(robot, datagram);
+    }
+
+    std::vector<Message> images;
+    std::vector<Message> commands;
+    deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while ((images.size() < 2 || commands.empty()) && std::chrono::steady_clock::now() < deadline) {
+        server.waitForMessages(std::chrono::milliseconds(100));
+        while (server.hasMessages()) {
+            Message message = server.getLatestMessage();
+            (message.getType() == Type::IMAGE ? images : commands).push_back(message);
+        }
+    }
+
+    REQUIRE(commands.size() == 1);
+    CHECK(commands[0] == command);
+    REQUIRE(images.size() == 2);
+    CHECK(images[0] == imageOf('a'));
+    CHECK(images[1] == imageOf('c'));
+    // datagrams are attributed to the robot's TCP session
+    CHECK(images[0].getSessionId() == commands[0].getSessionId());
+
+    DatagramStats stats = server.getDatagramStats();
+    CHECK(stats.datagrams == first.size() + second.size() - 1 + third.size());
+    CHECK(stats.frames == 2);
+    CHECK(stats.discarded == 1);
+    CHECK(stats.unknown == 0);
+}
+
+TEST_CASE("CommunicationHandler ignores images from addresses no robot is connected from") {
+    uint16_t port = 8018;
+    uint16_t imagePort = 8019;
+    CommunicationHandler server(port, true, ReceiveBackend::EPOLL, imagePort);
+
+    Message image;
+    image.setType(Type::IMAGE);
+    image.setImageFromString(std::string(3000, 'x'));
+    const auto datagrams = DatagramReassembler::fragment(image.toProto(), 1);
+    UdpSocket stranger;
+    auto sendImage = [&] {
+        for (const auto &datagram : datagrams) {
+            REQUIRE(stranger.sendTo(reinterpret_cast<const unsigned char *>(datagram.data()), datagram.size(),
+                                    "127.0.0.1", imagePort));
+        }
+    };
+    auto waitForDatagrams = [&](uint64_t count) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (server.getDatagramStats().datagrams < count && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    };
+    sendImage();
+    waitForDatagrams(datagrams.size());
+    // the datagrams are dropped before anything is reassembled from them
+    DatagramStats stats = server.getDatagramStats();
+    CHECK(stats.unknown == datagrams.size());
+    CHECK(stats.frames == 0);
+    CHECK_FALSE(server.hasMessages());
+
+    // a frame of no session steers nobody, rather than every robot
+    TCPClientContext client;
+    const auto conn = client.connect("127.0.0.1", port);
+    REQUIRE(conn);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.connectionCount < 1 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    CHECK_FALSE(server.sendMessage({0, 0}, image).has_value());
+    Message marker = Message::fromJSONString("{\"speed\": 5, \"directions\": [\"right\"], \"type\": 1}");
+    server.write(marker);
+    const std::string frame = readFrame(*conn);
+    CHECK(Message::fromProto(std::string_view(frame).substr(sizeof(uint32_t))) == marker);
+
+    // the address is no longer trusted once the robot is gone
+    conn->close();
+    deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.connectionCount > 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(server.connectionCount == 0);
+    sendImage();
+    waitForDatagrams(2 * datagrams.size());
+    CHECK(server.getDatagramStats().unknown == 2 * datagrams.size());
+    CHECK_FALSE(server.hasMessages());
+}
+
+TEST_CASE("CommunicationHandler hands images on without copying them") {
+    uint16_t port = 8012;
+    std::string image = loadImage(IMAGE_PATH);
+
+    Message imageMessage;
+    imageMessage.setType(Type::IMAGE);
+    imageMessage.setImageFromString(image);
+    const std::string payload = imageMessage.toProto();
+    const int messageCount = 10;
+
+    CommunicationHandler server(port);
+    server.setQueuePolicy(Type::IMAGE, {DropPolicy::KEEP, 0});
+    TCPClientContext client;
+    const auto conn = client.connect("127.0.0.1", port);
+    REQUIRE(conn);
+
+    const uint64_t copiesBefore = SharedBuffer::copies();
+    for (int i = 0; i < messageCount; ++i) {
+        writeFrame(*conn, payload);
+    }
+    int received = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (received < messageCount && std::chrono::steady_clock::now() < deadline) {
+        server.waitForMessages(std::chrono::milliseconds(100));
+        while (server.hasMessages()) {
+            Message message = server.getLatestMessage();
+            REQUIRE(message.getImage().has_value());
+            CHECK(message.getImage()->view() == image);
+            received++;
+        }
+    }
+    REQUIRE(received == messageCount);
+
+    // from the socket to the consumer, the image bytes were written once, by the read into the frame buffer;
+    // only the part that arrived together with the length prefix was moved over from the header buffer
+    ReadStats stats = server.getReadStats();
+    const double copiesPerFrame = static_cast<double>(SharedBuffer::copies() - copiesBefore) / messageCount;
+    std::cout << "Image payload copies per frame: " << copiesPerFrame << ", bytes moved per frame: "
+              << static_cast<double>(stats.bytesCopied) / messageCount << "\n";
+    CHECK(copiesPerFrame == 0);
+    CHECK(stats.bytesCopied <= static_cast<uint64_t>(messageCount) * 1024);
+}
+
+TEST_CASE("CommunicationHandler sends compact commands to robots that use them") {
+    uint16_t port = 8013;
+    CommunicationHandler server(port);
+
+    Message command = Message::fromJSONString("{\"speed\": 30, \"directions\": [\"forward\", \"right\"], \"type\": 1}");
+    Message imageMessage = Message::fromJSONString("{\"speed\": 20, \"type\": 0}");
+    imageMessage.setImageFromString("not really a jpeg");
+    std::string compactFrame;
+    command.toCompactFrame(compactFrame);
+    const std::string compactPayload = compactFrame.substr(sizeof(uint32_t));
+
+    TCPClientContext client;
+    const auto legacy = client.connect("127.0.0.1", port);
+    const auto compact = client.connect("127.0.0.1", port);
+    REQUIRE(legacy);
+    REQUIRE(compact);
+
+    // compact commands and ProtoMessages share the connection
+    writeFrame(*compact, compactPayload);
+    writeFrame(*compact, imageMessage.toProto());
+    writeFrame(*legacy, command.toProto());
+
+    std::vector<Message> received;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (received.size() < 3 && std::chrono::steady_clock::now() < deadline) {
+        if (server.waitForMessages(std::chrono::milliseconds(10))) {
+            received.push_back(server.getLatestMessage());
+        }
+    }
+    REQUIRE(received.size() == 3);
+    CHECK(std::count(received.begin(), received.end(), command) == 2);
+    CHECK(std::count(received.begin(), received.end(), imageMessage) == 1);
+
+    // only the robot that sent a compact command gets compact commands back
+    server.write(command);
+    CHECK(readFrame(*compact).substr(sizeof(uint32_t)) == compactPayload);
+    const std::string legacyFrame = readFrame(*legacy);
+    CHECK(legacyFrame.size() > compactFrame.size());
+    CHECK(Message::fromProto(std::string_view(legacyFrame).substr(sizeof(uint32_t))) == command);
+}
+
+TEST_CASE("CommunicationHandler stamps frames and echoes them in commands") {
+    uint16_t port = 8014;
+    CommunicationHandler server(port);
+    const int64_t robotBehind = 5000000;    // the robot's clock started five seconds after the server's
+
+    TCPClientContext client;
+    const auto conn = client.connect("127.0.0.1", port);
+    REQUIRE(conn);
+
+    Message frame = Message::fromJSONString("{\"speed\": 20, \"type\": 0}");
+    frame.setImageFromString("not really a jpeg");
+    frame.setFrameId(42);
+    Timestamps sent;
+    sent.sent = monotonicMicros() - robotBehind;
+    sent.capture = sent.sent - 2000;
+    frame.setTimestamps(sent);
+    writeFrame(*conn, frame.toProto());
+
+    REQUIRE(server.waitForMessages(std::chrono::seconds(5)));
+    Message received = server.getLatestMessage();
+    CHECK(received.getFrameId() == 42);
+    const Timestamps &stamps = received.getTimestamps();
+    CHECK(stamps.capture == sent.capture);
+    CHECK(stamps.sent == sent.sent);
+    CHECK(stamps.received > sent.sent);
+    CHECK(stamps.decoded >= stamps.received);
+
+    // one-way samples put the offset between the real one and the real one plus the transfer time
+    auto offset = server.getClockOffset(received.getSessionId());
+    REQUIRE(offset.has_value());
+    CHECK(*offset >= robotBehind);
+    CHECK(*offset < robotBehind + 1000000);
+    CHECK_FALSE(server.getClockOffset(received.getSessionId() + 1000).has_value());
+
+    // a command derived from the frame echoes its id and timestamps
+    Timestamps detected = stamps;
+    detected.detected = monotonicMicros();
+    received.setTimestamps(detected);
+    CHECK_FALSE(server.sendMessage({static_cast<int>(CAMERA_WIDTH / 2), static_cast<int>(CAMERA_HEIGHT / 2)}, received).has_value());
+    auto command = server.sendMessage({0, 0}, received);
+    REQUIRE(command.has_value());
+    CHECK(command->getFrameId() == 42);
+    CHECK(command->getTimestamps().commandSent >= detected.detected);
+    auto latency = LatencyBreakdown::of(command->getTimestamps(), *offset);
+    REQUIRE(latency.has_value());
+    CHECK(latency->total >= latency->detect);
+
+    const std::string written = readFrame(*conn);
+    Message echoed = Message::fromProto(std::string_view(written).substr(sizeof(uint32_t)));
+    CHECK(echoed == *command);
+    CHECK(echoed.getFrameId() == 42);
+    CHECK(echoed.getTimestamps() == command->getTimestamps());
+}
+
+TEST_CASE("CommunicationHandler steers robots that asked for compact commands with compact commands") {
+    uint16_t port = 8021;
+    CommunicationHandler server(port);
+
+    TCPClientContext client;
+    const auto compact = client.connect("127.0.0.1", port);
+    const auto plain = client.connect("127.0.0.1", port);
+    REQUIRE(compact);
+    REQUIRE(plain);
+
+    // the first robot opts in to compact commands and numbers and stamps its frames, the second does neither
+    std::string hello;
+    Message(Type::COMMAND, 0, 0, {}, {}, std::nullopt, 0).toCompactFrame(hello);
+    writeFrame(*compact, hello.substr(sizeof(uint32_t)));
+    Message stamped = Message::fromJSONString("{\"speed\": 20, \"type\": 0}");
+    stamped.setImageFromString("not really a jpeg");
+    stamped.setFrameId(7);
+    Timestamps sent;
+    sent.sent = monotonicMicros();
+    stamped.setTimestamps(sent);
+    writeFrame(*compact, stamped.toProto());
+    Message unstamped = Message::fromJSONString("{\"speed\": 20, \"type\": 0}");
+    unstamped.setImageFromString("not really a jpeg either");
+    writeFrame(*plain, unstamped.toProto());
+
+    std::vector<Message> frames;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (frames.size() < 2 && std::chrono::steady_clock::now() < deadline) {
+        if (server.waitForMessages(std::chrono::milliseconds(10))) {
+            Message message = server.getLatestMessage();
+            if (message.getType() == Type::IMAGE) {
+                frames.push_back(message);
+            }
+        }
+    }
+    REQUIRE(frames.size() == 2);
+    const Message &fromCompact = frames[0].getFrameId() == 7 ? frames[0] : frames[1];
+    const Message &fromPlain = frames[0].getFrameId() == 7 ? frames[1] : frames[0];
+
+    // the compact robot gets a compact command, which leaves the echo out
+    auto command = server.sendMessage({0, 0}, fromCompact);
+    REQUIRE(command.has_value());
+    CHECK(command->getFrameId() == 7);
+    const std::string compactFrame = readFrame(*compact);
+    REQUIRE(compactFrame.size() == sizeof(uint32_t) + Message::compactPayloadSize);
+    Message decoded;
+    Message::Decoder decoder;
+    decoder.decode(SharedBuffer(compactFrame.substr(sizeof(uint32_t))), decoded);
+    CHECK(decoded.getDirections() == command->getDirections());
+    CHECK(decoded.getCameraDirections() == command->getCameraDirections());
+
+    // a frame without id or timestamps gets a command without an echo
+    command = server.sendMessage({0, 0}, fromPlain);
+    REQUIRE(command.has_value());
+    CHECK(command->getFrameId() == 0);
+    CHECK(command->getTimestamps() == Timestamps{});
+    CHECK(command->fitsCompactFrame());
+    const std::string plainFrame = readFrame(*plain);
+    CHECK(Message::fromProto(std::string_view(plainFrame).substr(sizeof(uint32_t))) == *command);
+}
+
+TEST_CASE("CommunicationHandler exchanges batch frames") {
+    uint16_t port = 8015;
+    CommunicationHandler server(port);
+
+    TCPClientContext client;
+    const auto conn = client.connect("127.0.0.1", port);
+    REQUIRE(conn);
+
+    // telemetry and a command in one frame
+    Message telemetry(Type::COMMAND, 80, 0, {}, {}, std::nullopt, 55);
+    Message command(Type::COMMAND, 0, 30, {Direction::LEFT}, {}, std::nullopt, 0);
+    std::string batch;
+    Message::startBatchFrame(batch);
+    telemetry.appendToBatchFrame(batch);
+    command.appendToBatchFrame(batch);
+    writeFrame(*conn, batch.substr(sizeof(uint32_t)));
+
+    std::vector<Message> received;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (received.size() < 2 && std::chrono::steady_clock::now() < deadline) {
+        if (server.waitForMessages(std::chrono::milliseconds(10))) {
+            received.push_back(server.getLatestMessage());
+        }
+    }
+    REQUIRE(received.size() == 2);
+    CHECK(server.getReadStats().frames == 1);
+    CHECK(std::count(received.begin(), received.end(), telemetry) == 1);
+    CHECK(std::count(received.begin(), received.end(), command) == 1);
+    CHECK(received[0].getSessionId() == received[1].getSessionId());
+    CHECK(received[0].getTimestamps().received == received[1].getTimestamps().received);
+
+    auto readBatch = [&] {
+        const std::string frame = readFrame(*conn);
+        REQUIRE(Message::isBatchFrame(std::string_view(frame).substr(sizeof(uint32_t))));
+        Message::Decoder decoder;
+        std::vector<Message> messages;
+        decoder.decodeBatch(SharedBuffer(frame.substr(sizeof(uint32_t))), messages);
+        return messages;
+    };
+
+    // messages written within the delay go out as one batch once it expires
+    const uint32_t sessionId = received[0].getSessionId();
+    server.setBatching(4096, std::chrono::milliseconds(20));
+    Message reply = command;
+    reply.setSessionId(sessionId);
+    const auto start = std::chrono::steady_clock::now();
+    for (uint8_t speed = 1; speed <= 3; ++speed) {
+        reply.setSpeed(speed);
+        server.write(reply);
+    }
+    auto messages = readBatch();
+    CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(15));
+    REQUIRE(messages.size() == 3);
+    for (uint8_t speed = 1; speed <= 3; ++speed) {
+        CHECK(messages[speed - 1].getSpeed() == speed);
+    }
+
+    // a full batch does not wait for the delay
+    server.setBatching(16, std::chrono::seconds(10));
+    server.write(reply);
+    server.write(reply);
+    messages = readBatch();
+    CHECK(messages.size() == 2);
+
+    // without batching, an open batch goes out ahead of the next message
+    server.write(reply);
+    server.setBatching(0, std::chrono::microseconds(0));
+    reply.setSpeed(99);
+    server.write(reply);
+    messages = readBatch();
+    REQUIRE(messages.size() == 1);
+    CHECK(messages[0].getSpeed() == 3);
+    const std::string single = readFrame(*conn);
+    CHECK(Message::fromProto(std::string_view(single).substr(sizeof(uint32_t))).getSpeed() == 99);
+}
+
+TEST_CASE("CommunicationHandler drops a robot announcing an oversized frame") {
+    uint16_t port = 8016;
+    CommunicationHandler server(port);
+
+    TCPClientContext client;
+    const auto conn = client.connect("127.0.0.1", port);
+    REQUIRE(conn);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.connectionCount == 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(server.connectionCount == 1);
+
+    // a prefix claiming almost 2 GiB, followed by a few bytes: nothing is allocated for it, the session ends
+    const uint32_t length = htonl(0x7FFFFFF0u);
+    conn->write(reinterpret_cast<const unsigned char *>(&length), sizeof(uint32_t));
+    conn->write(std::string(16, 'x'));
+    deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (server.connectionCount > 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK(server.connectionCount == 0);
+    CHECK_FALSE(server.hasMessages());
+}
@@ -0,0 +1,236 @@
+#include "ObjectDetector.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+    // The weights are downloaded separately; without them there is nothing to run
+    bool haveWeights() {
+        return std::filesystem::exists(YOLO_WEIGHTS_PATH);
+    }
+
+    // Lenna, mirrored, cropped and scaled: different frames of the same size and of other sizes
+    std::vector<cv::Mat> makeFrames() {
+        const cv::Mat lenna = cv::imread(IMAGE_PATH);
+        cv::Mat flipped;
+        cv::Mat scaled;
+        cv::flip(lenna, flipped, 1);
+        cv::resize(lenna, scaled, cv::Size(lenna.cols / 2, lenna.rows / 2));
+        const cv::Mat cropped = lenna(cv::Rect(lenna.cols / 4, lenna.rows / 4, lenna.cols / 2, lenna.rows / 2)).clone();
+        return {lenna, flipped, cropped, scaled};
+    }
+
+    bool close(const Detection &a, const Detection &b) {
+        return a.classId == b.classId && std::abs(a.confidence - b.confidence) < 1e-3f &&
+               std::abs(a.box.x - b.box.x) <= 1 && std::abs(a.box.y - b.box.y) <= 1 &&
+               std::abs(a.box.width - b.box.width) <= 1 && std::abs(a.box.height - b.box.height) <= 1;
+    }
+
+    // Output rows of a busy 416x416 frame: one object in twenty boxes, of a random class
+    std::vector<float> makeRows(size_t count) {
+        std::mt19937 random(24);
+        std::uniform_real_distribution<float> unit(0, 1);
+        std::uniform_int_distribution<int> anyClass(0, 79);
+        std::vector<float> rows(count * 85);
+        for (size_t r = 0; r < count; ++r) {
+            float *row = rows.data() + r * 85;
+            for (int i = 0; i < 4; ++i) {
+                row[i] = 0.1f + unit(random) * 0.8f;
+            }
+            const bool object = unit(random) < 0.05f;
+            row[4] = object ? 0.6f + unit(random) * 0.4f : unit(random) * 0.1f;
+            for (int c = 0; c < 80; ++c) {
+                row[5 + c] = row[4] * unit(random) * 0.1f;
+            }
+            if (object) {
+                row[5 + anyClass(random)] = row[4] * (0.8f + unit(random) * 0.2f);
+            }
+        }
+        return rows;
+    }
+
+    // What the detector does with the rows of a frame: decode, suppress, draw
+    size_t postProcess(const std::vector<float> &rows, const std::vector<int> &targets, yolo::Candidates &candidates,
+                       cv::Mat &frame) {
+        candidates.clear();
+        if (targets.empty()) {
+            yolo::decode(rows.data(), rows.size() / 85, 85, 0.5f, candidates);
+        } else {
+            yolo::decode(rows.data(), rows.size() / 85, 85, 0.5f, targets, candidates);
+        }
+        std::vector<cv::Rect> boxes;
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            const int width = static_cast<int>(candidates.width[i] * frame.cols);
+            const int height = static_cast<int>(candidates.height[i] * frame.rows);
+            boxes.emplace_back(static_cast<int>(candidates.centerX[i] * frame.cols) - width / 2,
+                               static_cast<int>(candidates.centerY[i] * frame.rows) - height / 2, width, height);
+        }
+        std::vector<int> indices;
+        cv::dnn::NMSBoxes(boxes, candidates.score, 0.5f, 0.4f, indices);
+        for (int idx: indices) {
+            const cv::Rect &box = boxes[idx];
+            cv::rectangle(frame, box.tl(), cv::Point(box.x + box.width, box.y + box.height), cv::Scalar(255, 178, 50), 3);
+            int baseLine;
+            const std::string label = "class: " + std::to_string(candidates.score[idx]);
+            const cv::Size labelSize = cv::getTextSize(label, cv::FONT_HERSHEY_SIMPLEX, 0.5, 1, &baseLine);
+            cv::rectangle(frame, cv::Point(box.x, box.y - labelSize.height),
+                          cv::Point(box.x + labelSize.width, box.y + baseLine), cv::Scalar::all(255), cv::FILLED);
+            cv::putText(frame, label, box.tl(), cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 0, 0), 1);
+        }
+        return indices.size();
+    }
+
+    void requireClose(const std::vector<Detection> &actual, const std::vector<Detection> &expected) {
+        REQUIRE(actual.size() == expected.size());
+        for (size_t i = 0; i < actual.size(); ++i) {
+            CHECK(close(actual[i], expected[i]));
+        }
+    }
+}
+
+TEST_CASE("ObjectDetector batches concurrent frames", "[detector]") {
+    if (!haveWeights()) {
+        SKIP("no YOLO weights at " YOLO_WEIGHTS_PATH);
+    }
+    ObjectDetector detector(YOLO_CONFIG_PATH, YOLO_WEIGHTS_PATH, YOLO_CLASSES_PATH);
+    const std::vector<cv::Mat> frames = makeFrames();
+
+    // every frame on its own is the reference
+    std::vector<std::vector<Detection>> expected;
+    for (const auto &frame: frames) {
+        expected.push_back(detector.detect({frame}).front());
+    }
+
+    SECTION("One batch finds what single frames find") {
+        const auto detections = detector.detect(frames);
+        REQUIRE(detections.size() == frames.size());
+        for (size_t i = 0; i < frames.size(); ++i) {
+            requireClose(detections[i], expected[i]);
+        }
+    }
+
+    SECTION("Target classes are the only ones found") {
+        detector.setTargetClasses({"person", "tie"});
+        for (const auto &detections: detector.detect(frames)) {
+            for (const auto &detection: detections) {
+                CHECK((detection.classId == 0 || detection.classId == 27));    // lines of coco.names, from 0
+            }
+        }
+        CHECK_THROWS_AS(detector.setTargetClasses({"unicorn"}), std::invalid_argument);
+    }
+
+    SECTION("Frames detected concurrently get their own objects back") {
+        detector.setBatching(frames.size(), std::chrono::milliseconds(100));
+        std::vector<std::vector<int>> coords(frames.size());
+        std::vector<std::vector<int>> expectedCoords(frames.size());
+        const std::string target = "person";
+        for (size_t i = 0; i < frames.size(); ++i) {
+            for (const auto &detection: expected[i]) {
+                if (detection.classId == 0 && expectedCoords[i].empty()) {    // the first class is "person"
+                    expectedCoords[i] = {detection.box.x + detection.box.width / 2,
+                                         detection.box.y + detection.box.height / 2};
+                }
+            }
+        }
+        {
+            std::vector<std::jthread> threads;
+            for (size_t i = 0; i < frames.size(); ++i) {
+                threads.emplace_back([&, i] {
+                    detector.detectObjects(frames[i].clone(), coords[i], target);
+                });
+            }
+        }
+        for (size_t i = 0; i < frames.size(); ++i) {
+            REQUIRE(coords[i].size() == expectedCoords[i].size());
+            for (size_t j = 0; j < coords[i].size(); ++j) {
+                CHECK(std::abs(coords[i][j] - expectedCoords[i][j]) <= 1);
+            }
+        }
+    }
+}
+
+TEST_CASE("ObjectDetector letterboxes frames into its input size", "[detector]") {
+    CHECK_THROWS_AS(ObjectDetector(YOLO_CONFIG_PATH, YOLO_WEIGHTS_PATH, YOLO_CLASSES_PATH, cv::Size(300, 240)),
+                    std::invalid_argument);
+    if (!haveWeights()) {
+        SKIP("no YOLO weights at " YOLO_WEIGHTS_PATH);
+    }
+    ObjectDetector detector(YOLO_CONFIG_PATH, YOLO_WEIGHTS_PATH, YOLO_CLASSES_PATH, cv::Size(320, 256));
+    REQUIRE(detector.getInputSize() == cv::Size(320, 256));
+
+    // a camera frame, and the same frame padded the way the detector pads it, which needs no letterboxing
+    cv::Mat frame;
+    cv::resize(makeFrames().front(), frame, cv::Size(320, 240));
+    cv::Mat padded(256, 320, CV_8UC3, cv::Scalar::all(127));
+    frame.copyTo(padded(cv::Rect(0, 8, 320, 240)));
+
+    const auto detections = detector.detect({frame, padded});
+    REQUIRE(detections[0].size() == detections[1].size());
+    for (size_t i = 0; i < detections[0].size(); ++i) {
+        Detection shifted = detections[1][i];
+        shifted.box.y -= 8;
+        CHECK(close(detections[0][i], shifted));
+    }
+}
+
+TEST_CASE("ObjectDetector batch size: throughput against latency", "[.][benchmark]") {
+    if (!haveWeights()) {
+        SKIP("no YOLO weights at " YOLO_WEIGHTS_PATH);
+    }
+    ObjectDetector detector(YOLO_CONFIG_PATH, YOLO_WEIGHTS_PATH, YOLO_CLASSES_PATH);
+    const cv::Mat frame = makeFrames().front();
+    constexpr int framesPerThread = 16;
+
+    // as many cameras as images per batch, each detecting its frames one after the other
+    for (size_t batch: {1, 2, 4, 8}) {
+        detector.setBatching(batch, std::chrono::milliseconds(5));
+        std::atomic<int64_t> latencySum{0};
+        const auto start = std::chrono::steady_clock::now();
+        {
+            std::vector<std::jthread> cameras;
+            for (size_t i = 0; i < batch; ++i) {
+                cameras.emplace_back([&] {
+                    for (int n = 0; n < framesPerThread; ++n) {
+                        std::vector<int> coords;
+                        const auto submitted = std::chrono::steady_clock::now();
+                        detector.detectObjects(frame.clone(), coords, "person");
+                        latencySum += std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - submitted).count();
+                    }
+                });
+            }
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const double frames = static_cast<double>(batch * framesPerThread);
+        std::cout << "Batch of " << batch << ": " << frames / seconds << " frames/s, "
+                  << static_cast<double>(latencySum) / frames / 1000 << " ms per frame" << std::endl;
+    }
+}
+
+TEST_CASE("Post-processing: all classes against one target class", "[.][benchmark]") {
+    const std::vector<float> rows = makeRows(13 * 13 * 3 + 26 * 26 * 3);
+    const std::vector<int> bottle{39};
+    yolo::Candidates candidates;
+    candidates.reserve(rows.size() / 85);
+    cv::Mat frame = cv::Mat::zeros(cv::Size(416, 416), CV_8UC3);
+
+    std::cout << "All classes: " << postProcess(rows, {}, candidates, frame) << " boxes drawn\n";
+    std::cout << "Target class: " << postProcess(rows, bottle, candidates, frame) << " boxes drawn\n";
+    BENCHMARK("all classes") {
+        return postProcess(rows, {}, candidates, frame);
+    };
+    BENCHMARK("target class") {
+        return postProcess(rows, bottle, candidates, frame);
+    };
+}
@@ -0,0 +1,245 @@
+#include "ImageDecoder.hpp"
+#include "Message.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <string>
+#include <vector>
+
+namespace {
+    std::string bytesOf(const cv::Mat &image) {
+        return {reinterpret_cast<const char *>(image.data), image.total() * image.elemSize()};
+    }
+
+    bool identical(const cv::Mat &a, const cv::Mat &b) {
+        return a.size() == b.size() && a.type() == b.type() && cv::norm(a, b, cv::NORM_INF) == 0;
+    }
+
+    // A camera frame the way a robot sends it
+    struct Frame {
+        std::string name;
+        SharedBuffer wire;
+    };
+
+    Frame makeFrame(const std::string &name, std::string image, const ImageFormat &format) {
+        Message message(Type::IMAGE, 0, 0, {}, {}, std::optional<std::string>(std::move(image)), 0);
+        message.setImageFormat(format);
+        return {name, SharedBuffer(message.toProto())};
+    }
+
+    // Lenna in every encoding the robot may send, compressed where this build can
+    std::vector<Frame> makeFrames(const cv::Mat &bgr) {
+        const auto width = static_cast<uint32_t>(bgr.cols);
+        const auto height = static_cast<uint32_t>(bgr.rows);
+        cv::Mat gray;
+        cv::Mat yuv;
+        cv::cvtColor(bgr, gray, cv::COLOR_BGR2GRAY);
+        cv::cvtColor(bgr, yuv, cv::COLOR_BGR2YUV_I420);
+        std::vector<unsigned char> jpeg;
+        cv::imencode(".jpg", bgr, jpeg);
+
+        std::vector<Frame> frames;
+        frames.push_back(makeFrame("JPEG", std::string(jpeg.begin(), jpeg.end()), {}));
+        ImageCodec codec;
+        for (auto compression: {ImageCompression::UNCOMPRESSED, ImageCompression::LZ4, ImageCompression::ZSTD}) {
+            if (!ImageCodec::supports(compression)) {
+                continue;
+            }
+            const std::string suffix = compression == ImageCompression::LZ4 ? " + LZ4"
+                                     : compression == ImageCompression::ZSTD ? " + zstd" : "";
+            const struct {
+                ImageEncoding encoding;
+                std::string name;
+                const cv::Mat &pixels;
+            } raw[] = {{ImageEncoding::BGR, "BGR", bgr}, {ImageEncoding::GRAY, "GRAY", gray},
+                       {ImageEncoding::YUV420, "YUV420", yuv}};
+            for (const auto &[encoding, name, pixels]: raw) {
+                std::string compressed;
+                codec.compress(bytesOf(pixels), compression, compressed);
+                frames.push_back(makeFrame(name + suffix, std::move(compressed), {encoding, compression, width, height}));
+            }
+        }
+        return frames;
+    }
+
+    ImageTile tileOf(const cv::Mat &image, const cv::Rect &rect) {
+        return {static_cast<uint32_t>(rect.x), static_cast<uint32_t>(rect.y), static_cast<uint32_t>(rect.width),
+                static_cast<uint32_t>(rect.height), SharedBuffer(bytesOf(image(rect).clone()))};
+    }
+
+    // A tile update of a BGR frame the way a robot sends it
+    Message tileUpdate(uint32_t session, uint64_t frameId, uint64_t baseFrameId, const cv::Mat &image,
+                       const std::vector<cv::Rect> &tiles) {
+        Message message(Type::IMAGE, 0, 0, {}, {}, std::nullopt, 0);
+        message.setFrameId(frameId);
+        message.setBaseFrameId(baseFrameId);
+        message.setImageFormat({ImageEncoding::BGR, ImageCompression::UNCOMPRESSED, static_cast<uint32_t>(image.cols),
+                                static_cast<uint32_t>(image.rows)});
+        for (const auto &rect: tiles) {
+            message.addImageTile(tileOf(image, rect));
+        }
+        // through the wire format, so the tiles are slices of a received frame
+        Message received = Message::fromProto(message.toProto());
+        received.setSessionId(session);
+        return received;
+    }
+}
+
+TEST_CASE("ImageDecoder maps raw frames into BGR images", "[image]") {
+    const cv::Mat bgr = cv::imread(IMAGE_PATH, cv::IMREAD_COLOR);
+    REQUIRE_FALSE(bgr.empty());
+    cv::Mat gray;
+    cv::Mat yuv;
+    cv::Mat expectedGray;
+    cv::Mat expectedYuv;
+    cv::cvtColor(bgr, gray, cv::COLOR_BGR2GRAY);
+    cv::cvtColor(gray, expectedGray, cv::COLOR_GRAY2BGR);
+    cv::cvtColor(bgr, yuv, cv::COLOR_BGR2YUV_I420);
+    cv::cvtColor(yuv, expectedYuv, cv::COLOR_YUV2BGR_I420);
+
+    Message::Decoder decoder;
+    ImageDecoder imageDecoder;
+    Message message;
+    for (const auto &frame: makeFrames(bgr)) {
+        INFO(frame.name);
+        decoder.decode(frame.wire, message);
+        const cv::Mat image = imageDecoder.decode(message);
+        REQUIRE(image.size() == bgr.size());
+        REQUIRE(image.type() == CV_8UC3);
+        switch (message.getImageFormat().encoding) {
+            case ImageEncoding::BGR:
+                CHECK(identical(image, bgr));
+                break;
+            case ImageEncoding::GRAY:
+                CHECK(identical(image, expectedGray));
+                break;
+            case ImageEncoding::YUV420:
+                CHECK(identical(image, expectedYuv));
+                break;
+            case ImageEncoding::JPEG:
+                // lossy, but close
+                CHECK(cv::norm(image, bgr, cv::NORM_L1) / static_cast<double>(bgr.total() * 3) < 8);
+                break;
+        }
+        if (message.getImageFormat() == ImageFormat{ImageEncoding::BGR, ImageCompression::UNCOMPRESSED,
+                                                    static_cast<uint32_t>(bgr.cols), static_cast<uint32_t>(bgr.rows)}) {
+            // not decoded, not even copied: the image is the frame's own bytes
+            CHECK(image.data == message.getImage()->data());
+        }
+    }
+
+    // images that do not match their format are rejected like undecodable JPEGs
+    Message broken(Type::IMAGE, 0, 0, {}, {}, std::optional<std::string>("short"), 0);
+    broken.setImageFormat({ImageEncoding::BGR, ImageCompression::UNCOMPRESSED, 4, 4});
+    CHECK(imageDecoder.decode(broken).empty());
+    broken.setImageFormat({ImageEncoding::YUV420, ImageCompression::UNCOMPRESSED, 5, 1});
+    CHECK(imageDecoder.decode(broken).empty());
+    broken.setImageFormat({});
+    CHECK(imageDecoder.decode(broken).empty());
+    if (ImageCodec::supports(ImageCompression::LZ4)) {
+        broken.setImageFormat({ImageEncoding::GRAY, ImageCompression::LZ4, 4, 4});
+        CHECK(imageDecoder.decode(broken).empty());
+    }
+    if (ImageCodec::supports(ImageCompression::ZSTD)) {
+        broken.setImageFormat({ImageEncoding::GRAY, ImageCompression::ZSTD, 4, 4});
+        CHECK(imageDecoder.decode(broken).empty());
+    }
+}
+
+TEST_CASE("ImageDecoder rebuilds frames from tile updates", "[image]") {
+    const cv::Mat bgr = cv::imread(IMAGE_PATH, cv::IMREAD_COLOR);
+    REQUIRE_FALSE(bgr.empty());
+    const cv::Rect whole(0, 0, bgr.cols, bgr.rows);
+    const cv::Rect a(64, 64, 32, 32);
+    const cv::Rect b(128, 0, 16, 16);
+    cv::Mat withA = bgr.clone();
+    withA(a).setTo(cv::Scalar(0, 0, 255));
+    cv::Mat withB = bgr.clone();
+    withB(b).setTo(cv::Scalar(255, 0, 0));
+
+    ImageDecoder imageDecoder;
+    // a keyframe, here in two tiles
+    cv::Mat image = imageDecoder.decode(tileUpdate(1, 1, 0, bgr, {{0, 0, bgr.cols, 200}, {0, 200, bgr.cols, bgr.rows - 200}}));
+    CHECK(identical(image, bgr));
+    CHECK(imageDecoder.changedRegion() == whole);
+    // the caller may draw into the image without changing the frame later updates apply to
+    image.setTo(cv::Scalar::all(0));
+
+    image = imageDecoder.decode(tileUpdate(1, 2, 1, withA, {a}));
+    CHECK(identical(image, withA));
+    CHECK(imageDecoder.changedRegion() == a);
+    // the same tile again: nothing changed
+    image = imageDecoder.decode(tileUpdate(1, 3, 1, withA, {a}));
+    CHECK(identical(image, withA));
+    CHECK(imageDecoder.changedRegion().empty());
+    // a's part of the frame is back to the keyframe, b's changed
+    image = imageDecoder.decode(tileUpdate(1, 4, 1, withB, {b}));
+    CHECK(identical(image, withB));
+    CHECK(imageDecoder.changedRegion() == (a | b));
+
+    // updates only depend on their keyframe, so a dropped update does not matter
+    image = imageDecoder.decode(tileUpdate(1, 6, 1, withA, {a}));
+    CHECK(identical(image, withA));
+    CHECK(imageDecoder.changedRegion() == (a | b));
+
+    // updates to a keyframe that did not arrive, or that another session sent, are rejected
+    CHECK(imageDecoder.decode(tileUpdate(1, 7, 5, withB, {b})).empty());
+    CHECK(imageDecoder.decode(tileUpdate(2, 7, 1, withB, {b})).empty());
+    // as are tiles outside the frame; the frame stays as it was
+    Message outside = tileUpdate(1, 7, 1, withB, {b});
+    std::vector<ImageTile> tiles = outside.getImageTiles();
+    tiles[0].x = static_cast<uint32_t>(bgr.cols - 8);
+    outside.setImageTiles(tiles);
+    CHECK(imageDecoder.decode(outside).empty());
+    image = imageDecoder.decode(tileUpdate(1, 8, 1, withA, {a}));
+    CHECK(identical(image, withA));
+    CHECK(imageDecoder.changedRegion().empty());
+
+    // a new keyframe starts from a black frame
+    cv::Mat partial = cv::Mat::zeros(bgr.size(), CV_8UC3);
+    bgr(b).copyTo(partial(b));
+    image = imageDecoder.decode(tileUpdate(1, 9, 0, bgr, {b}));
+    CHECK(identical(image, partial));
+    CHECK(imageDecoder.changedRegion() == whole);
+
+    // whole images report the whole image as changed
+    Message full(Type::IMAGE, 0, 0, {}, {}, std::optional<std::string>(bytesOf(bgr)), 0);
+    full.setImageFormat({ImageEncoding::BGR, ImageCompression::UNCOMPRESSED, static_cast<uint32_t>(bgr.cols),
+                         static_cast<uint32_t>(bgr.rows)});
+    CHECK(identical(imageDecoder.decode(full), bgr));
+    CHECK(imageDecoder.changedRegion() == whole);
+}
+
+TEST_CASE("Image encodings: server CPU per frame", "[.][benchmark]") {
+    const cv::Mat bgr = cv::imread(IMAGE_PATH, cv::IMREAD_COLOR);
+    Message::Decoder decoder;
+    ImageDecoder imageDecoder;
+    Message message;
+
+    // everything the server does with a frame before detection: parse it and get a BGR image out of it
+    for (const auto &frame: makeFrames(bgr)) {
+        BENCHMARK(frame.name + ", " + std::to_string(frame.wire.size()) + " bytes on the wire") {
+            decoder.decode(frame.wire, message);
+            return imageDecoder.decode(message).cols;
+        };
+    }
+
+    // and what producing each encoding costs the robot
+    ImageCodec codec;
+    std::string compressed;
+    BENCHMARK("robot: JPEG encoding") {
+        std::vector<unsigned char> jpeg;
+        cv::imencode(".jpg", bgr, jpeg);
+        return jpeg.size();
+    };
+    for (auto compression: {ImageCompression::LZ4, ImageCompression::ZSTD}) {
+        if (ImageCodec::supports(compression)) {
+            BENCHMARK(std::string("robot: BGR ") + (compression == ImageCompression::LZ4 ? "LZ4" : "zstd") +
+                      " compression") {
+                codec.compress(bytesOf(bgr), compression, compressed);
+                return compressed.size();
+            };
+        }
+    }
+}
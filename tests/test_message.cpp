@@ -1,7 +1,48 @@
 #include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cstdlib>
 #include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <random>
+#include <type_traits>
 #include "Message.hpp"
 
+// Counts heap allocations made while counting is enabled
+namespace {
+    std::atomic<bool> countAllocations{false};
+    std::atomic<uint64_t> allocations{0};
+
+    uint64_t countAllocationsOf(const std::function<void()> &work) {
+        allocations = 0;
+        countAllocations = true;
+        work();
+        countAllocations = false;
+        return allocations;
+    }
+}
+
+void *operator new(size_t size) {
+    if (countAllocations.load(std::memory_order_relaxed)) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
 std::string loadImage(std::filesystem::path path) {
 
     std::ifstream fileStream(path);
@@ -74,4 +115,809 @@ TEST_CASE("Message to proto", "[message]") {
     REQUIRE(directions[1] == Direction::LEFT);
     REQUIRE(newMessage.getImage().has_value());
     REQUIRE(newMessage.getImage().value() == image);
-}
\ No newline at end of file
+}
+TEST_CASE("Message shares the image with the frame it was parsed from", "[message]") {
+    std::string image = loadImage(IMAGE_PATH);
+
+    Message message(Type::IMAGE, 42, 100, {Direction::FORWARD, Direction::LEFT}, {Direction::RIGHT},
+                    std::optional<std::string>(image), 77);
+    SharedBuffer frame(message.toProto());
+
+    const uint64_t copiesBefore = SharedBuffer::copies();
+    Message parsed = Message::fromProto(frame);
+    Message shared = parsed;
+    CHECK(SharedBuffer::copies() == copiesBefore);
+
+    CHECK(parsed == message);
+    CHECK(parsed.getBatteryPercentage() == 77);
+    REQUIRE(parsed.getImage().has_value());
+    // the image points into the frame, and copies of the message point to the same bytes
+    CHECK(parsed.getImage()->data() >= frame.data());
+    CHECK(parsed.getImage()->data() + parsed.getImage()->size() <= frame.data() + frame.size());
+    CHECK(shared.getImage()->data() == parsed.getImage()->data());
+
+    // fields after the image are still parsed
+    proto::ProtoMessage reordered;
+    reordered.set_image("abc");
+    std::string serialized = reordered.SerializeAsString();
+    proto::ProtoMessage trailer;
+    trailer.set_speed(9);
+    trailer.set_type(proto::ProtoMessage_MessageType_COMMAND);
+    serialized += trailer.SerializeAsString();
+    Message mixed = Message::fromProto(SharedBuffer(std::move(serialized)));
+    CHECK(mixed.getSpeed() == 9);
+    CHECK(mixed.getType() == Type::COMMAND);
+    CHECK(mixed.getImage().value() == "abc");
+
+    CHECK_THROWS(Message::fromProto(std::string_view("\x12\x05\x61", 3)));
+}
+
+TEST_CASE("DirectionSet behaves like the direction list it replaces", "[message]") {
+    static_assert(std::is_trivially_copyable_v<DirectionSet>);
+    static_assert(sizeof(DirectionSet) == 1);
+    static_assert(DirectionSet{Direction::LEFT, Direction::FORWARD}.size() == 2);
+
+    DirectionSet set{Direction::RIGHT, Direction::FORWARD, Direction::RIGHT};
+    REQUIRE(set.size() == 2);
+    CHECK(set[0] == Direction::FORWARD);
+    CHECK(set[1] == Direction::RIGHT);
+    CHECK(set.contains(Direction::RIGHT));
+    CHECK_FALSE(set.contains(Direction::LEFT));
+    CHECK(set.toVector() == std::vector<Direction>{Direction::FORWARD, Direction::RIGHT});
+    CHECK(set == DirectionSet(std::vector<Direction>{Direction::RIGHT, Direction::FORWARD}));
+    set.erase(Direction::FORWARD);
+    CHECK(set == DirectionSet{Direction::RIGHT});
+    set.clear();
+    CHECK(set.empty());
+    CHECK(set.begin() == set.end());
+
+    // building, copying and comparing commands never touches the heap
+    Message a;
+    Message b;
+    uint64_t allocated = countAllocationsOf([&] {
+        for (int i = 0; i < 100; ++i) {
+            a = Message(Type::COMMAND, 0, 10, {Direction::FORWARD, Direction::LEFT}, {Direction::BACKWARD},
+                        std::nullopt, 0);
+            b = a;
+            b.addDirection(Direction::LEFT);
+            CHECK(a == b);
+            b.addCameraDirection(Direction::RIGHT);
+            CHECK(a != b);
+        }
+    });
+    CHECK(allocated == 0);
+}
+
+TEST_CASE("Message decoder does not allocate in the steady state", "[message]") {
+    std::string image = loadImage(IMAGE_PATH);
+    Message message(Type::IMAGE, 42, 100, {Direction::FORWARD, Direction::LEFT}, {Direction::RIGHT},
+                    std::optional<std::string>(image), 77);
+    Message command(Type::COMMAND, 0, 50, {Direction::BACKWARD}, {}, std::nullopt, 0);
+    const std::string imageProto = message.toProto();
+    const SharedBuffer imageFrame{std::string(imageProto)};
+    const SharedBuffer commandFrame{command.toProto()};
+    const int rounds = 100;
+
+    Message::Decoder decoder;
+    Message decoded;
+    uint64_t reused = countAllocationsOf([&] {
+        for (int i = 0; i < rounds; ++i) {
+            decoder.decode(imageFrame, decoded);
+            decoder.decode(commandFrame, decoded);
+        }
+    });
+    CHECK(decoded == command);
+    decoder.decode(imageFrame, decoded);
+    CHECK(decoded == message);
+
+    uint64_t fresh = countAllocationsOf([&] {
+        for (int i = 0; i < rounds; ++i) {
+            Message parsed = Message::fromProto(imageProto);
+        }
+    });
+    std::cout << "Allocations per decoded frame: " << static_cast<double>(reused) / (2 * rounds)
+              << " reusing a decoder, " << static_cast<double>(fresh) / rounds << " with Message::fromProto\n";
+    CHECK(reused == 0);
+    CHECK(fresh > 0);
+}
+
+namespace {
+    // Builds protobuf wire-format byte strings by hand, including encodings protobuf itself never produces
+    struct WireWriter {
+        std::string bytes;
+
+        void varint(uint64_t value) {
+            while (value >= 0x80) {
+                bytes += static_cast<char>(value | 0x80);
+                value >>= 7;
+            }
+            bytes += static_cast<char>(value);
+        }
+
+        void tag(uint32_t field, uint32_t wireType) {
+            varint((static_cast<uint64_t>(field) << 3) | wireType);
+        }
+
+        void lengthDelimited(uint32_t field, std::string_view data) {
+            tag(field, 2);
+            varint(data.size());
+            bytes += data;
+        }
+    };
+
+    // What Message should contain after parsing with libprotobuf
+    Message referenceMessage(const proto::ProtoMessage &parsed) {
+        auto convert = [](const google::protobuf::RepeatedField<int> &from) {
+            std::vector<Direction> to;
+            for (int value: from) {
+                switch (value) {
+                    case proto::ProtoMessage_Direction_FORWARD:
+                        to.push_back(Direction::FORWARD);
+                        break;
+                    case proto::ProtoMessage_Direction_BACKWARD:
+                        to.push_back(Direction::BACKWARD);
+                        break;
+                    case proto::ProtoMessage_Direction_LEFT:
+                        to.push_back(Direction::LEFT);
+                        break;
+                    case proto::ProtoMessage_Direction_RIGHT:
+                        to.push_back(Direction::RIGHT);
+                        break;
+                    default:
+                        break;
+                }
+            }
+            return to;
+        };
+        Type type = parsed.type() == proto::ProtoMessage_MessageType_IMAGE ? Type::IMAGE
+                  : parsed.type() == proto::ProtoMessage_MessageType_COMMAND ? Type::COMMAND : Type::EMPTY;
+        std::optional<std::string> image;
+        if (!parsed.image().empty()) {
+            image = parsed.image();
+        }
+        Message message(type, static_cast<uint16_t>(parsed.distance()), static_cast<uint8_t>(parsed.speed()),
+                        convert(parsed.directions()), convert(parsed.camera_directions()), image,
+                        static_cast<uint8_t>(parsed.battery_percentage()));
+        ImageFormat format;
+        switch (parsed.image_encoding()) {
+            case proto::ProtoMessage_ImageEncoding_BGR:
+                format.encoding = ImageEncoding::BGR;
+                break;
+            case proto::ProtoMessage_ImageEncoding_GRAY:
+                format.encoding = ImageEncoding::GRAY;
+                break;
+            case proto::ProtoMessage_ImageEncoding_YUV420:
+                format.encoding = ImageEncoding::YUV420;
+                break;
+            default:
+                break;
+        }
+        switch (parsed.image_compression()) {
+            case proto::ProtoMessage_Compression_LZ4:
+                format.compression = ImageCompression::LZ4;
+                break;
+            case proto::ProtoMessage_Compression_ZSTD:
+                format.compression = ImageCompression::ZSTD;
+                break;
+            default:
+                break;
+        }
+        format.width = parsed.image_width();
+        format.height = parsed.image_height();
+        message.setImageFormat(format);
+        for (const auto &tile: parsed.image_tiles()) {
+            message.addImageTile({tile.x(), tile.y(), tile.width(), tile.height(), SharedBuffer::copyOf(tile.pixels())});
+        }
+        return message;
+    }
+
+    Timestamps referenceTimestamps(const proto::ProtoMessage &parsed) {
+        const auto &stamps = parsed.timestamps();
+        return {stamps.capture(), stamps.sent(), stamps.received(), stamps.decoded(), stamps.detected(),
+                stamps.command_sent(), stamps.echo_command_sent(), stamps.echo_command_received()};
+    }
+
+    // A random frame: mostly valid fields in random order, with repeats, unusual encodings and unknown fields
+    std::string randomFrame(std::mt19937 &random) {
+        auto pick = [&](uint64_t bound) {
+            return std::uniform_int_distribution<uint64_t>(0, bound - 1)(random);
+        };
+        auto anyVarint = [&]() -> uint64_t {
+            switch (pick(4)) {
+                case 0: return pick(4);
+                case 1: return pick(300);
+                case 2: return random();
+                default: return (static_cast<uint64_t>(random()) << 32) | random();
+            }
+        };
+        WireWriter out;
+        const uint64_t fields = pick(12);
+        for (uint64_t i = 0; i < fields; ++i) {
+            switch (pick(13)) {
+                case 0: // the type
+                    out.tag(1, 0);
+                    out.varint(pick(2) ? pick(3) : anyVarint());
+                    break;
+                case 1: // speed, distance or battery percentage
+                    out.tag(static_cast<uint32_t>(3 + pick(3)), 0);
+                    out.varint(anyVarint());
+                    break;
+                case 2: { // the image
+                    std::string image(pick(40), '\0');
+                    for (char &c: image) {
+                        c = static_cast<char>(random());
+                    }
+                    out.lengthDelimited(2, image);
+                    break;
+                }
+                case 3: { // packed directions
+                    WireWriter packed;
+                    for (uint64_t n = pick(6); n > 0; --n) {
+                        packed.varint(pick(8) ? pick(4) : anyVarint());
+                    }
+                    out.lengthDelimited(static_cast<uint32_t>(6 + pick(2)), packed.bytes);
+                    break;
+                }
+                case 4: // an unpacked direction
+                    out.tag(static_cast<uint32_t>(6 + pick(2)), 0);
+                    out.varint(pick(5));
+                    break;
+                case 5: { // a known field with the wrong wire type
+                    const bool fixed32 = pick(2);
+                    out.tag(static_cast<uint32_t>(1 + pick(15)), fixed32 ? 5 : 1);
+                    out.bytes += std::string(fixed32 ? 4 : 8, '\x01');
+                    break;
+                }
+                case 6: // an unknown field
+                    out.tag(static_cast<uint32_t>(16 + pick(1000)), 0);
+                    out.varint(anyVarint());
+                    break;
+                case 7:
+                    out.lengthDelimited(static_cast<uint32_t>(16 + pick(1000)), "unknown");
+                    break;
+                case 8: // the frame id or the base frame id
+                    out.tag(pick(2) ? 8 : 15, 0);
+                    out.varint(anyVarint());
+                    break;
+                case 9: { // timestamps, possibly partial, repeated or with unknown fields of their own
+                    WireWriter stamps;
+                    for (uint64_t n = pick(6); n > 0; --n) {
+                        if (pick(6)) {
+                            stamps.tag(static_cast<uint32_t>(1 + pick(8)), 0);
+                            stamps.varint(anyVarint());
+                        } else {
+                            stamps.lengthDelimited(static_cast<uint32_t>(9 + pick(100)), "unknown");
+                        }
+                    }
+                    out.lengthDelimited(9, stamps.bytes);
+                    break;
+                }
+                case 10: // image encoding, compression, width or height
+                    out.tag(static_cast<uint32_t>(10 + pick(4)), 0);
+                    out.varint(pick(2) ? pick(5) : anyVarint());
+                    break;
+                case 11: { // a tile, possibly partial, with repeated or unknown fields or fields of the wrong type
+                    WireWriter tile;
+                    for (uint64_t n = pick(7); n > 0; --n) {
+                        switch (pick(5)) {
+                            case 0:
+                                tile.lengthDelimited(5, std::string(pick(20), static_cast<char>(random())));
+                                break;
+                            case 1:
+                                tile.tag(static_cast<uint32_t>(1 + pick(5)), 5);
+                                tile.bytes += std::string(4, '\x02');
+                                break;
+                            case 2:
+                                tile.lengthDelimited(static_cast<uint32_t>(1 + pick(100)), "unknown");
+                                break;
+                            default:
+                                tile.tag(static_cast<uint32_t>(1 + pick(4)), 0);
+                                tile.varint(anyVarint());
+                                break;
+                        }
+                    }
+                    out.lengthDelimited(14, tile.bytes);
+                    break;
+                }
+                default: { // an unknown group, possibly nested
+                    const auto group = static_cast<uint32_t>(16 + pick(100));
+                    out.tag(group, 3);
+                    if (pick(2)) {
+                        out.tag(group + 1, 3);
+                        out.tag(1, 0);
+                        out.varint(1);
+                        out.tag(group + 1, 4);
+                    }
+                    out.tag(2, 0);
+                    out.varint(anyVarint());
+                    out.tag(group, 4);
+                    break;
+                }
+            }
+        }
+        return out.bytes;
+    }
+
+    // Damages a frame the way a broken sender or a bad link would
+    void mutate(std::string &frame, std::mt19937 &random) {
+        auto pick = [&](uint64_t bound) {
+            return std::uniform_int_distribution<uint64_t>(0, bound - 1)(random);
+        };
+        for (uint64_t n = 1 + pick(3); n > 0; --n) {
+            switch (frame.empty() ? 2 : pick(4)) {
+                case 0:
+                    frame[pick(frame.size())] ^= static_cast<char>(1 << pick(8));
+                    break;
+                case 1:
+                    frame.resize(pick(frame.size()));
+                    break;
+                case 2:
+                    frame.insert(frame.begin() + static_cast<long>(pick(frame.size() + 1)), static_cast<char>(random()));
+                    break;
+                default:
+                    frame[pick(frame.size())] = static_cast<char>(random());
+                    break;
+            }
+        }
+    }
+}
+
+TEST_CASE("Message decoder agrees with libprotobuf on arbitrary input", "[message]") {
+    std::mt19937 random(20241017);
+    Message::Decoder decoder;
+    Message decoded;
+    int accepted = 0;
+    int rejected = 0;
+
+    auto check = [&](const std::string &bytes) {
+        proto::ProtoMessage reference;
+        const bool valid = reference.ParseFromString(bytes);
+        if (Message::isCompactFrame(bytes)) {
+            // never a valid ProtoMessage, which is what lets compact commands share a connection with them
+            REQUIRE_FALSE(valid);
+            return;
+        }
+        bool decodedOk = true;
+        try {
+            decoder.decode(SharedBuffer(std::string(bytes)), decoded);
+        } catch (const std::runtime_error &) {
+            decodedOk = false;
+        }
+        INFO("frame of " << bytes.size() << " bytes");
+        REQUIRE(decodedOk == valid);
+        if (valid) {
+            const Message expected = referenceMessage(reference);
+            REQUIRE(decoded == expected);
+            REQUIRE(decoded.getBatteryPercentage() == expected.getBatteryPercentage());
+            REQUIRE(decoded.getImage().has_value() == expected.getImage().has_value());
+            REQUIRE(decoded.getFrameId() == reference.frame_id());
+            REQUIRE(decoded.getTimestamps() == referenceTimestamps(reference));
+            REQUIRE(decoded.getBaseFrameId() == reference.base_frame_id());
+            accepted++;
+        } else {
+            rejected++;
+        }
+    };
+
+    for (int i = 0; i < 20000; ++i) {
+        std::string frame = randomFrame(random);
+        check(frame);
+        mutate(frame, random);
+        check(frame);
+    }
+    // plain noise
+    for (int i = 0; i < 5000; ++i) {
+        std::string noise(std::uniform_int_distribution<size_t>(0, 32)(random), '\0');
+        for (char &c: noise) {
+            c = static_cast<char>(random());
+        }
+        check(noise);
+    }
+    // edge cases: overlong varints, field number 0, stray and mismatched end-group tags, oversized lengths
+    for (const std::string &edge: {std::string("\x08\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01"),
+                                   std::string("\x08\xff\xff\xff\xff\xff\xff\xff\xff\xff\x7f"),
+                                   std::string("\x08\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01"),
+                                   std::string("\x80\x80\x80\x80\x10\x00", 6),
+                                   std::string("\x00\x01", 2), std::string("\x04"), std::string("\x5c"),
+                                   std::string("\x5b\x64"), std::string("\x12\xff\xff\xff\xff\x0f"),
+                                   std::string("\x32\x02\x00"), std::string("\x0e"), std::string("\x0f")}) {
+        check(edge);
+    }
+    std::cout << "Differential decode: " << accepted << " frames accepted and " << rejected
+              << " rejected by both decoders\n";
+    CHECK(accepted > 1000);
+    CHECK(rejected > 1000);
+}
+
+TEST_CASE("Message compact command frames", "[message]") {
+    Message command(Type::COMMAND, 0, 200, {Direction::FORWARD, Direction::LEFT, Direction::FORWARD},
+                    {Direction::RIGHT, Direction::BACKWARD}, std::nullopt, 0);
+    REQUIRE(command.fitsCompactFrame());
+
+    std::string frame;
+    command.toCompactFrame(frame);
+    REQUIRE(frame.size() == 8);
+    uint32_t length;
+    std::memcpy(&length, frame.data(), sizeof(uint32_t));
+    length = ntohl(length);
+    REQUIRE(length == Message::compactPayloadSize);
+    const std::string_view payload = std::string_view(frame).substr(sizeof(uint32_t));
+    REQUIRE(Message::isCompactFrame(payload));
+
+    std::string protoFrame;
+    command.toFrame(protoFrame);
+    CHECK(frame.size() < protoFrame.size());
+
+    // the decoder takes compact and protobuf frames alike
+    Message::Decoder decoder;
+    Message decoded;
+    decoder.decode(SharedBuffer::copyOf(payload), decoded);
+    CHECK(decoded == command);
+    CHECK(decoded.getDirections().size() == 2);
+    CHECK(decoded.getCameraDirections().size() == 2);
+    decoder.decode(SharedBuffer::copyOf(std::string_view(protoFrame).substr(sizeof(uint32_t))), decoded);
+    CHECK(decoded == command);
+    Message empty(Type::COMMAND, 0, 0, {}, {}, std::nullopt, 0);
+    empty.toCompactFrame(frame);
+    decoder.decode(SharedBuffer::copyOf(std::string_view(frame).substr(sizeof(uint32_t))), decoded);
+    CHECK(decoded == empty);
+
+    // anything carrying more than a command keeps using protobuf
+    Message withDistance = command;
+    withDistance.setDistance(3);
+    CHECK_FALSE(withDistance.fitsCompactFrame());
+    Message image = command;
+    image.setType(Type::IMAGE);
+    CHECK_FALSE(image.fitsCompactFrame());
+
+    // unknown versions and reserved bits are rejected
+    CHECK_THROWS(Message::fromProto(std::string_view("\x02\x00\x00\x00", 4)));
+    CHECK_THROWS(Message::fromProto(std::string_view("\x01\x00\x10\x00", 4)));
+    CHECK_THROWS(Message::fromProto(std::string_view("\x01\x00\x00", 3)));
+}
+
+namespace {
+    // The DOM-based encoding Message used before writeJSON(), which the streaming writer has to match
+    std::string domJSON(const Message &message) {
+        nlohmann::json json;
+        json["speed"] = message.getSpeed();
+        json["distance"] = message.getDistance();
+        if (message.getType() != Type::EMPTY) {
+            json["type"] = message.getType() == Type::COMMAND ? 1 : 0;
+        }
+        const char *names[] = {"forward", "backward", "left", "right"};
+        for (auto direction: message.getDirections()) {
+            json["directions"].push_back(names[static_cast<size_t>(direction)]);
+        }
+        if (message.getImage()) {
+            json["image"] = base64::to_base64(message.getImage()->view());
+        }
+        return json.dump();
+    }
+}
+
+TEST_CASE("Message JSON writer matches the DOM encoding", "[message]") {
+    std::mt19937 random(16);
+    const std::string image = loadImage(IMAGE_PATH);
+    for (int i = 0; i < 500; ++i) {
+        Message message;
+        message.setType(static_cast<Type>(random() % 3));
+        message.setSpeed(static_cast<uint8_t>(random()));
+        message.setDistance(static_cast<uint16_t>(random()));
+        message.setDirections(DirectionSet::fromBits(static_cast<uint8_t>(random())));
+        if (random() % 2) {
+            message.setImageFromString(image.substr(0, random() % (i < 10 ? image.size() : 10000)));
+        }
+        const std::string json = message.toJSONString();
+        REQUIRE(json == domJSON(message));
+        REQUIRE(Message::fromJSONString(json) == message);
+    }
+
+    Message message(Type::IMAGE, 3, 4, {Direction::LEFT}, {}, std::optional<std::string>(image), 0);
+    std::string json;
+    // without the image, and with a truncated one
+    message.toJSON(json, 0);
+    CHECK(json == R"({"directions":["left"],"distance":3,"speed":4,"type":0})");
+    message.toJSON(json, 100);
+    CHECK(Message::fromJSONString(json).getImage()->view() == std::string_view(image).substr(0, 100));
+
+    // into a socket or any other sink, piece by piece
+    std::string streamed;
+    size_t pieces = 0;
+    message.writeJSON([&](std::string_view piece) {
+        streamed += piece;
+        pieces++;
+    });
+    CHECK(streamed == message.toJSONString());
+    CHECK(pieces > 1);
+
+    // a reused buffer needs no allocation once it is large enough
+    message.toJSON(json);
+    CHECK(countAllocationsOf([&] { message.toJSON(json); }) == 0);
+}
+
+TEST_CASE("Message carries frame ids and timestamps", "[message]") {
+    Message message(Type::IMAGE, 0, 0, {}, {}, std::optional<std::string>("jpeg"), 90);
+    message.setFrameId(1234567890123ull);
+    message.setTimestamps({100, 200, 0, 0, 0, 0, 50, 150});
+    Message decoded = Message::fromProto(message.toProto());
+    CHECK(decoded.getFrameId() == 1234567890123ull);
+    CHECK(decoded.getTimestamps() == message.getTimestamps());
+
+    Message::Decoder decoder;
+    decoder.decode(SharedBuffer(message.toProto()), decoded);
+    CHECK(decoded.getFrameId() == 1234567890123ull);
+    CHECK(decoded.getTimestamps() == message.getTimestamps());
+    // a reused Message forgets the previous frame's id and timestamps
+    decoder.decode(SharedBuffer(Message(Type::COMMAND, 0, 1, {Direction::LEFT}, {}, std::nullopt, 0).toProto()),
+                   decoded);
+    CHECK(decoded.getFrameId() == 0);
+    CHECK(decoded.getTimestamps() == Timestamps{});
+
+    // a command echoing a frame needs the full encoding to carry the echo
+    Message command(Type::COMMAND, 0, 50, {Direction::LEFT}, {}, std::nullopt, 0);
+    CHECK(command.fitsCompactFrame());
+    command.setFrameId(7);
+    CHECK_FALSE(command.fitsCompactFrame());
+    // unless the echo may be left out
+    CHECK(command.fitsCompactFrameWithoutEcho());
+    command.setDistance(3);
+    CHECK_FALSE(command.fitsCompactFrameWithoutEcho());
+}
+
+TEST_CASE("Message carries the image format", "[message]") {
+    const std::string pixels(64 * 48 * 3 / 2, '\x7f');
+    Message message(Type::IMAGE, 0, 0, {}, {}, std::optional<std::string>(pixels), 0);
+    CHECK(message.getImageFormat() == ImageFormat{});
+    CHECK(message.getImageFormat().rawSize() == 0);
+    const ImageFormat format{ImageEncoding::YUV420, ImageCompression::UNCOMPRESSED, 64, 48};
+    CHECK(format.rawSize() == pixels.size());
+    message.setImageFormat(format);
+
+    Message decoded = Message::fromProto(message.toProto());
+    CHECK(decoded.getImageFormat() == format);
+    CHECK(decoded == message);
+    Message jpeg = decoded;
+    jpeg.setImageFormat({});
+    CHECK(jpeg != message);
+
+    // uncompressed pixels are handed on as they are
+    ImageCodec codec;
+    const SharedBuffer raw = codec.decompress(*decoded.getImage(), format);
+    CHECK(raw.data() == decoded.getImage()->data());
+    CHECK_THROWS_AS(codec.decompress(*decoded.getImage(), {ImageEncoding::BGR, ImageCompression::UNCOMPRESSED, 64, 48}),
+                    std::runtime_error);
+    CHECK_THROWS_AS(codec.decompress(*decoded.getImage(), {}), std::runtime_error);
+    CHECK(ImageFormat{ImageEncoding::YUV420, ImageCompression::UNCOMPRESSED, 63, 48}.rawSize() == 0);
+
+    // sizes come from the sender: ones that could overflow are no raw format, large ones are refused before
+    // anything is allocated for them
+    const ImageFormat huge{ImageEncoding::BGR, ImageCompression::LZ4, UINT32_MAX, UINT32_MAX};
+    CHECK(huge.rawSize() == 0);
+    CHECK_THROWS_AS(codec.decompress(*decoded.getImage(), huge), std::runtime_error);
+    const ImageFormat large{ImageEncoding::BGR, ImageCompression::ZSTD, 16384, 16384};
+    CHECK(large.rawSize() == size_t{16384} * 16384 * 3);
+    CHECK_THROWS_AS(codec.decompress(*decoded.getImage(), large), std::runtime_error);
+    ImageCodec small(64 * 48);
+    CHECK_THROWS_AS(small.decompress(*decoded.getImage(), format), std::runtime_error);
+}
+
+TEST_CASE("Message carries image tiles", "[message]") {
+    Message update(Type::IMAGE, 0, 0, {}, {}, std::nullopt, 0);
+    update.setImageFormat({ImageEncoding::GRAY, ImageCompression::UNCOMPRESSED, 64, 48});
+    update.setFrameId(12);
+    update.setBaseFrameId(10);
+    update.addImageTile({0, 0, 16, 16, SharedBuffer::copyOf(std::string(16 * 16, '\x10'))});
+    update.addImageTile({32, 16, 8, 4, SharedBuffer::copyOf(std::string(8 * 4, '\x20'))});
+    CHECK_FALSE(update.fitsCompactFrame());
+
+    const SharedBuffer frame(update.toProto());
+    Message::Decoder decoder;
+    Message decoded;
+    decoder.decode(frame, decoded);
+    CHECK(decoded == update);
+    CHECK(decoded.getBaseFrameId() == 10);
+    REQUIRE(decoded.getImageTiles().size() == 2);
+    CHECK(decoded.getImageTiles()[1].x == 32);
+    CHECK(decoded.getImageTiles()[1].y == 16);
+    CHECK(decoded.getImageTiles()[1].formatIn(decoded.getImageFormat()).rawSize() == 8 * 4);
+    // the pixels are not copied out of the frame
+    for (const auto &tile: decoded.getImageTiles()) {
+        CHECK(tile.pixels.data() >= frame.data());
+        CHECK(tile.pixels.data() + tile.pixels.size() <= frame.data() + frame.size());
+    }
+
+    // different pixels make a different message, a different keyframe does not
+    Message other = decoded;
+    other.setBaseFrameId(11);
+    CHECK(other == update);
+    other.setImageTiles({update.getImageTiles()[0]});
+    CHECK(other != update);
+
+    // a reused Message forgets the previous frame's tiles
+    decoder.decode(SharedBuffer(Message(Type::IMAGE, 0, 0, {}, {}, std::optional<std::string>("jpeg"), 0).toProto()),
+                   decoded);
+    CHECK(decoded.getImageTiles().empty());
+    CHECK(decoded.getBaseFrameId() == 0);
+}
+
+TEST_CASE("ClockOffsetEstimator recovers the offset between two clocks", "[message]") {
+    std::mt19937 random(17);
+    std::uniform_int_distribution<uint64_t> queueing(0, 5000);
+    const int64_t offset = 123456789;   // server clock minus robot clock
+    const uint64_t baseDelay = 300;     // each way
+
+    ClockOffsetEstimator estimator;
+    CHECK_FALSE(estimator.offset().has_value());
+    // frames without echoes only give the offset plus the shortest transfer
+    uint64_t robotNow = 1000000;
+    for (int i = 0; i < 50; ++i, robotNow += 33000) {
+        Timestamps stamps;
+        stamps.sent = robotNow;
+        stamps.received = robotNow + offset + baseDelay + queueing(random);
+        estimator.add(stamps);
+    }
+    REQUIRE(estimator.offset().has_value());
+    CHECK(*estimator.offset() >= offset + static_cast<int64_t>(baseDelay));
+    CHECK(*estimator.offset() <= offset + static_cast<int64_t>(baseDelay) + 1000);
+
+    // round trips cancel symmetric delay out, and the least queued one wins
+    for (int i = 0; i < 50; ++i, robotNow += 33000) {
+        Timestamps stamps;
+        stamps.echoCommandReceived = robotNow - 10000;
+        stamps.echoCommandSent = stamps.echoCommandReceived + offset - baseDelay - queueing(random);
+        stamps.sent = robotNow;
+        stamps.received = robotNow + offset + baseDelay + queueing(random);
+        estimator.add(stamps);
+    }
+    REQUIRE(estimator.offset().has_value());
+    CHECK(std::abs(*estimator.offset() - offset) <= 1500);
+
+    // the breakdown of a command corrects the capture time by the offset
+    Timestamps command;
+    command.capture = 5000;
+    command.received = 5000 + offset + 2000;
+    command.decoded = command.received + 100;
+    command.detected = command.decoded + 30000;
+    command.commandSent = command.detected + 50;
+    auto latency = LatencyBreakdown::of(command, offset);
+    REQUIRE(latency.has_value());
+    CHECK(latency->transfer == 2000);
+    CHECK(latency->decode == 100);
+    CHECK(latency->detect == 30000);
+    CHECK(latency->command == 50);
+    CHECK(latency->total == 32150);
+    command.detected = 0;
+    CHECK_FALSE(LatencyBreakdown::of(command, offset).has_value());
+}
+
+TEST_CASE("Message batch frames", "[message]") {
+    Message telemetry(Type::COMMAND, 120, 0, {}, {}, std::nullopt, 64);
+    Message command(Type::COMMAND, 0, 40, {Direction::FORWARD}, {Direction::LEFT}, std::nullopt, 0);
+    Message image(Type::IMAGE, 0, 0, {}, {}, std::optional<std::string>("jpeg bytes"), 0);
+    image.setFrameId(9);
+    image.setTimestamps({1, 2, 0, 0, 0, 0, 0, 0});
+
+    std::string frame;
+    Message::startBatchFrame(frame);
+    uint32_t length;
+    std::memcpy(&length, frame.data(), sizeof(uint32_t));
+    length = ntohl(length);
+    CHECK(length == 1);
+    for (const Message *message: {&telemetry, &command, &image}) {
+        message->appendToBatchFrame(frame);
+    }
+    std::memcpy(&length, frame.data(), sizeof(uint32_t));
+    length = ntohl(length);
+    REQUIRE(length == frame.size() - sizeof(uint32_t));
+
+    const std::string payload = frame.substr(sizeof(uint32_t));
+    CHECK(Message::isBatchFrame(payload));
+    CHECK_FALSE(Message::isCompactFrame(payload));
+    // the entries are what libprotobuf makes of the bytes after the tag
+    proto::MessageBatch reference;
+    REQUIRE(reference.ParseFromString(payload.substr(1)));
+    REQUIRE(reference.messages_size() == 3);
+    CHECK(referenceMessage(reference.messages(0)) == telemetry);
+    CHECK(referenceMessage(reference.messages(2)) == image);
+
+    Message::Decoder decoder;
+    std::vector<Message> decoded;
+    const SharedBuffer buffer{std::string(payload)};
+    const uint64_t copiesBefore = SharedBuffer::copies();
+    decoder.decodeBatch(buffer, decoded);
+    CHECK(SharedBuffer::copies() == copiesBefore);
+    REQUIRE(decoded.size() == 3);
+    CHECK(decoded[0] == telemetry);
+    CHECK(decoded[0].getBatteryPercentage() == 64);
+    CHECK(decoded[1] == command);
+    CHECK(decoded[2] == image);
+    CHECK(decoded[2].getFrameId() == 9);
+    CHECK(decoded[2].getTimestamps() == image.getTimestamps());
+    // the image points into the batch frame
+    CHECK(decoded[2].getImage()->data() >= buffer.data());
+    CHECK(decoded[2].getImage()->data() < buffer.data() + buffer.size());
+
+    // a batch is not a message of its own
+    Message single;
+    CHECK_THROWS_AS(decoder.decode(buffer, single), std::runtime_error);
+    Message::startBatchFrame(frame);
+    decoder.decodeBatch(SharedBuffer(frame.substr(sizeof(uint32_t))), decoded);
+    CHECK(decoded.empty());
+
+    // arbitrary batches are accepted and rejected exactly like libprotobuf does
+    std::mt19937 random(18);
+    int accepted = 0;
+    for (int i = 0; i < 5000; ++i) {
+        WireWriter batch;
+        for (int n = std::uniform_int_distribution<int>(0, 4)(random); n > 0; --n) {
+            if (random() % 8) {
+                batch.lengthDelimited(1, randomFrame(random));
+            } else {
+                batch.tag(static_cast<uint32_t>(2 + random() % 100), 0);
+                batch.varint(random());
+            }
+        }
+        if (random() % 2) {
+            mutate(batch.bytes, random);
+        }
+        proto::MessageBatch parsed;
+        const bool valid = parsed.ParseFromString(batch.bytes);
+        bool decodedOk = true;
+        try {
+            decoder.decodeBatch(SharedBuffer(static_cast<char>(Message::batchTag) + batch.bytes), decoded);
+        } catch (const std::runtime_error &) {
+            decodedOk = false;
+        }
+        REQUIRE(decodedOk == valid);
+        if (valid) {
+            REQUIRE(decoded.size() == static_cast<size_t>(parsed.messages_size()));
+            for (size_t m = 0; m < decoded.size(); ++m) {
+                REQUIRE(decoded[m] == referenceMessage(parsed.messages(static_cast<int>(m))));
+                REQUIRE(decoded[m].getFrameId() == parsed.messages(static_cast<int>(m)).frame_id());
+            }
+            accepted++;
+        }
+    }
+    CHECK(accepted > 1000);
+}
+
+TEST_CASE("Message decoding throughput", "[.][benchmark]") {
+    std::string image = loadImage(IMAGE_PATH);
+    Message message(Type::IMAGE, 42, 100, {Direction::FORWARD, Direction::LEFT}, {Direction::RIGHT},
+                    std::optional<std::string>(image), 77);
+    const std::string imageProto = message.toProto();
+    const SharedBuffer imageFrame{std::string(imageProto)};
+    Message command(Type::COMMAND, 0, 50, {Direction::BACKWARD}, {}, std::nullopt, 0);
+    const std::string commandProto = command.toProto();
+    const SharedBuffer commandFrame{std::string(commandProto)};
+
+    Message::Decoder decoder;
+    Message decoded;
+    proto::ProtoMessage parsed;
+
+    BENCHMARK("libprotobuf, Lenna frame") {
+        parsed.ParseFromString(imageProto);
+        return referenceMessage(parsed);
+    };
+    BENCHMARK("Message::Decoder, Lenna frame") {
+        decoder.decode(imageFrame, decoded);
+        return decoded.getSpeed();
+    };
+    BENCHMARK("libprotobuf, command frame") {
+        parsed.ParseFromString(commandProto);
+        return referenceMessage(parsed);
+    };
+    std::string json;
+    BENCHMARK("nlohmann::json DOM, Lenna frame to JSON") {
+        return domJSON(message).size();
+    };
+    BENCHMARK("Message::toJSON, Lenna frame") {
+        message.toJSON(json);
+        return json.size();
+    };
+    BENCHMARK("Message::Decoder, command frame") {
+        decoder.decode(commandFrame, decoded);
+        return decoded.getSpeed();
+    };
+}
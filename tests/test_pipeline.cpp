@@ -0,0 +1,133 @@
+#include <catch2/catch_test_macros.hpp>
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <thread>
+#include <vector>
+#include "Pipeline.hpp"
+
+using namespace std::chrono_literals;
+
+TEST_CASE("StageQueue applies its drop policy", "[pipeline]") {
+    SECTION("DROP_OLDEST keeps the newest items") {
+        StageQueue<int> queue({DropPolicy::DROP_OLDEST, 2});
+        for (int i = 0; i < 5; ++i) {
+            REQUIRE(queue.push(i));
+        }
+        CHECK(queue.size() == 2);
+        CHECK(queue.takeDropped() == 3);
+        CHECK(queue.takeDropped() == 0);
+        CHECK(queue.pop()->item == 3);
+        CHECK(queue.pop()->item == 4);
+    }
+
+    SECTION("COALESCE keeps only the newest item") {
+        StageQueue<int> queue({DropPolicy::COALESCE, 0});
+        queue.push(1);
+        queue.push(2);
+        CHECK(queue.size() == 1);
+        CHECK(queue.takeDropped() == 1);
+        CHECK(queue.pop()->item == 2);
+    }
+
+    SECTION("KEEP blocks the producer while the queue is full") {
+        StageQueue<int> queue({DropPolicy::KEEP, 2});
+        queue.push(0);
+        queue.push(1);
+        std::atomic<bool> pushed{false};
+        std::jthread producer([&] {
+            queue.push(2);
+            pushed = true;
+        });
+        std::this_thread::sleep_for(20ms);
+        CHECK_FALSE(pushed);
+        CHECK(queue.pop()->item == 0);
+        producer.join();
+        CHECK(pushed);
+        CHECK(queue.takeDropped() == 0);
+        CHECK(queue.pop()->item == 1);
+        CHECK(queue.pop()->item == 2);
+    }
+}
+
+TEST_CASE("StageQueue wakes everyone when closed", "[pipeline]") {
+    StageQueue<int> queue({DropPolicy::KEEP, 1});
+    queue.push(7);
+    std::atomic<bool> rejected{false};
+    std::jthread producer([&] { rejected = !queue.push(8); });
+    std::this_thread::sleep_for(10ms);
+    queue.close();
+    producer.join();
+    CHECK(rejected);
+    CHECK_FALSE(queue.push(9));
+    // what was queued before can still be taken
+    CHECK(queue.pop()->item == 7);
+    CHECK_FALSE(queue.pop().has_value());
+}
+
+TEST_CASE("Stage workers process every item and report statistics", "[pipeline]") {
+    StageQueue<int> input;
+    std::mutex mtx;
+    std::set<size_t> workersSeen;
+    std::vector<int> done;
+    {
+        Stage<int> stage("square", input, 3, [&](int &item, size_t worker) {
+            std::this_thread::sleep_for(1ms);
+            if (item == 13) {
+                throw std::runtime_error("unlucky");
+            }
+            std::lock_guard lock(mtx);
+            workersSeen.insert(worker);
+            done.push_back(item * item);
+        });
+        CHECK(stage.getThreads() == 3);
+        for (int i = 0; i < 30; ++i) {
+            input.push(i);
+        }
+        // wait for the queue to drain, then for the last items in flight
+        while (input.size() > 0) {
+            std::this_thread::sleep_for(1ms);
+        }
+        std::this_thread::sleep_for(20ms);
+        const StageStats stats = stage.takeStats();
+        CHECK(stats.processed == 30);
+        CHECK(stats.dropped == 0);
+        CHECK(stats.meanService >= 1000);
+        CHECK(stats.maxLatency >= stats.meanService);
+        CHECK(stats.fps > 0);
+        CHECK(stage.takeStats().processed == 0);
+    }
+    // the item that threw is skipped, every other one was worked on by some worker
+    CHECK(done.size() == 29);
+    for (size_t worker: workersSeen) {
+        CHECK(worker < 3);
+    }
+}
+
+TEST_CASE("Pipelined stages overlap", "[pipeline]") {
+    // two stages of 10 ms each: run one after the other they take 20 ms a frame, pipelined about 10 ms
+    constexpr int frames = 20;
+    StageQueue<int> first({DropPolicy::KEEP, 2});
+    StageQueue<int> second({DropPolicy::KEEP, 2});
+    std::atomic<int> finished{0};
+    const auto start = std::chrono::steady_clock::now();
+    {
+        Stage<int> decode("decode", first, 1, [&](int &item, size_t) {
+            std::this_thread::sleep_for(10ms);
+            second.push(item);
+        });
+        Stage<int> detect("detect", second, 1, [&](int &, size_t) {
+            std::this_thread::sleep_for(10ms);
+            finished++;
+        });
+        for (int i = 0; i < frames; ++i) {
+            first.push(i);
+        }
+        while (finished < frames) {
+            std::this_thread::sleep_for(1ms);
+        }
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    CHECK(finished == frames);
+    CHECK(elapsed < frames * 15ms);
+}
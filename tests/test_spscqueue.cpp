@@ -0,0 +1,175 @@
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include "SpscQueue.hpp"
+#include "Notifier.hpp"
+#include "Message.hpp"
+
+namespace {
+    // Counts the instances alive, to see what a queue holds on to
+    struct Counted {
+        static inline std::atomic<int> alive{0};
+        std::vector<char> payload = std::vector<char>(1024);
+
+        Counted() { alive++; }
+        Counted(const Counted &other) : payload(other.payload) { alive++; }
+        Counted(Counted &&other) noexcept : payload(std::move(other.payload)) { alive++; }
+        ~Counted() { alive--; }
+    };
+}
+
+TEST_CASE("SpscQueue keeps order and refuses items while full", "[spsc]") {
+    SpscQueue<int> queue(4);
+    CHECK(queue.empty());
+    REQUIRE(queue.getCapacity() == 4);
+
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE(queue.push(i));
+    }
+    CHECK_FALSE(queue.push(4));
+    CHECK_FALSE(queue.empty());
+    for (int i = 0; i < 2; ++i) {
+        REQUIRE(queue.pop() == i);
+    }
+    // room again after a partial drain, behind what is still queued
+    REQUIRE(queue.push(5));
+    for (int i: {2, 3, 5}) {
+        REQUIRE(queue.pop() == i);
+    }
+    CHECK_FALSE(queue.pop().has_value());
+    CHECK(queue.empty());
+}
+
+TEST_CASE("SpscQueue pushes a range at once", "[spsc]") {
+    SpscQueue<int> queue(4);
+    std::vector<int> items{0, 1, 2};
+    REQUIRE(queue.pushAll(items.begin(), items.end()) == 3);
+    REQUIRE(queue.pop() == 0);
+
+    // the second range only partly fits, the rest is left to the caller
+    items = {3, 4, 5, 6, 7};
+    REQUIRE(queue.pushAll(items.begin(), items.end()) == 2);
+    CHECK_FALSE(queue.push(8));
+    items.clear();
+    CHECK(queue.pushAll(items.begin(), items.end()) == 0);
+    for (int i = 1; i <= 4; ++i) {
+        REQUIRE(queue.pop() == i);
+    }
+    CHECK(queue.empty());
+
+    // move iterators hand the items over without copying them
+    SpscQueue<std::string> strings(4);
+    std::vector<std::string> words{"a fairly long string that is not stored inline", "b"};
+    strings.pushAll(std::make_move_iterator(words.begin()), std::make_move_iterator(words.end()));
+    CHECK(strings.pop() == "a fairly long string that is not stored inline");
+    CHECK(strings.pop() == "b");
+}
+
+TEST_CASE("SpscQueue stays bounded while the consumer stalls", "[spsc]") {
+    {
+        SpscQueue<Counted> queue(64);
+        size_t accepted = 0;
+        std::thread producer([&] {
+            for (int i = 0; i < 100000; ++i) {
+                accepted += queue.push(Counted());
+            }
+        });
+        producer.join();
+        // nothing was popped: the queue holds what fit and nothing else
+        CHECK(accepted == 64);
+        CHECK(Counted::alive == 64);
+
+        size_t popped = 0;
+        while (queue.pop()) {
+            popped++;
+        }
+        CHECK(popped == 64);
+        CHECK(queue.push(Counted()));
+    }
+    CHECK(Counted::alive == 0);
+}
+
+TEST_CASE("SpscQueue hands items between threads", "[spsc]") {
+    SpscQueue<Message> queue(64);
+    Notifier notifier;
+    const int count = 100000;
+
+    std::thread producer([&] {
+        for (int i = 0; i < count; ++i) {
+            Message message;
+            message.setDistance(static_cast<uint16_t>(i));
+            // the ring is smaller than the run, so wait for room rather than lose messages
+            while (!queue.push(message)) {
+                std::this_thread::yield();
+            }
+            notifier.notify();
+        }
+    });
+
+    int expected = 0;
+    while (expected < count) {
+        REQUIRE(notifier.wait([&] { return !queue.empty(); }, std::chrono::seconds(5)));
+        while (auto message = queue.pop()) {
+            REQUIRE(message->getDistance() == static_cast<uint16_t>(expected));
+            expected++;
+        }
+    }
+    producer.join();
+    CHECK(queue.empty());
+}
+
+TEST_CASE("SpscQueue against mutex and condition variable", "[.][benchmark]") {
+    const int count = 100000;
+
+    BENCHMARK("SpscQueue + eventfd, 100k messages") {
+        SpscQueue<Message> queue(1024);
+        Notifier notifier;
+        std::thread producer([&] {
+            for (int i = 0; i < count; ++i) {
+                while (!queue.push(Message())) {
+                    std::this_thread::yield();
+                }
+                notifier.notify();
+            }
+        });
+        int received = 0;
+        while (received < count) {
+            notifier.wait([&] { return !queue.empty(); });
+            while (queue.pop()) {
+                received++;
+            }
+        }
+        producer.join();
+        return received;
+    };
+
+    BENCHMARK("std::queue + mutex + condition_variable, 100k messages") {
+        std::queue<Message> queue;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::thread producer([&] {
+            for (int i = 0; i < count; ++i) {
+                std::lock_guard<std::mutex> lock(mtx);
+                queue.push(Message());
+                cv.notify_one();
+            }
+        });
+        int received = 0;
+        while (received < count) {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&] { return !queue.empty(); });
+            while (!queue.empty()) {
+                queue.pop();
+                received++;
+            }
+        }
+        producer.join();
+        return received;
+    };
+}
@@ -0,0 +1,160 @@
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "YoloDecode.hpp"
+
+namespace {
+    const std::vector<std::pair<yolo::Kernel, const char *>> kernels = {
+            {yolo::Kernel::SCALAR, "scalar"},
+            {yolo::Kernel::AVX, "AVX"},
+            {yolo::Kernel::NEON, "NEON"},
+    };
+
+    // Output rows the way OpenCV's Darknet layers produce them: class scores scaled by the objectness, most
+    // rows with next to no objectness
+    std::vector<float> makeRows(std::mt19937 &random, size_t count, size_t classes, double objectShare) {
+        std::uniform_real_distribution<float> unit(0, 1);
+        std::bernoulli_distribution object(objectShare);
+        std::vector<float> rows(count * (5 + classes));
+        for (size_t r = 0; r < count; ++r) {
+            float *row = rows.data() + r * (5 + classes);
+            for (int i = 0; i < 4; ++i) {
+                row[i] = unit(random);
+            }
+            row[4] = object(random) ? 0.5f + unit(random) / 2 : unit(random) / 10;
+            for (size_t c = 0; c < classes; ++c) {
+                // coarse scores, so rows often have several best classes
+                row[5 + c] = row[4] * static_cast<float>(static_cast<int>(unit(random) * 8)) / 8;
+            }
+        }
+        return rows;
+    }
+
+    // What the detector did before: the best class of every row, whatever its objectness
+    yolo::Candidates reference(const std::vector<float> &rows, size_t classes, float threshold) {
+        yolo::Candidates out;
+        const size_t cols = 5 + classes;
+        for (size_t r = 0; r < rows.size() / cols; ++r) {
+            const float *row = rows.data() + r * cols;
+            int best = 0;
+            for (size_t c = 1; c < classes; ++c) {
+                best = row[5 + c] > row[5 + best] ? static_cast<int>(c) : best;
+            }
+            if (row[5 + best] > threshold) {
+                out.centerX.push_back(row[0]);
+                out.centerY.push_back(row[1]);
+                out.width.push_back(row[2]);
+                out.height.push_back(row[3]);
+                out.score.push_back(row[5 + best]);
+                out.classId.push_back(best);
+            }
+        }
+        return out;
+    }
+
+    // The general path restricted to some classes, best of them first
+    yolo::Candidates reference(const std::vector<float> &rows, size_t classes, float threshold,
+                               const std::vector<int> &targets) {
+        yolo::Candidates out;
+        const size_t cols = 5 + classes;
+        for (size_t r = 0; r < rows.size() / cols; ++r) {
+            const float *row = rows.data() + r * cols;
+            int best = targets.front();
+            for (int c: targets) {
+                best = row[5 + c] > row[5 + best] ? c : best;
+            }
+            if (row[5 + best] > threshold) {
+                out.centerX.push_back(row[0]);
+                out.centerY.push_back(row[1]);
+                out.width.push_back(row[2]);
+                out.height.push_back(row[3]);
+                out.score.push_back(row[5 + best]);
+                out.classId.push_back(best);
+            }
+        }
+        return out;
+    }
+
+    bool same(const yolo::Candidates &a, const yolo::Candidates &b) {
+        return a.centerX == b.centerX && a.centerY == b.centerY && a.width == b.width && a.height == b.height &&
+               a.score == b.score && a.classId == b.classId;
+    }
+}
+
+TEST_CASE("YOLO decode kernels agree with a full scan", "[yolo]") {
+    std::mt19937 random(23);
+    std::cout << "Active YOLO decode kernel: " << kernels[static_cast<size_t>(yolo::bestKernel())].second << "\n";
+
+    for (const auto &[kernel, name]: kernels) {
+        if (!yolo::kernelSupported(kernel)) {
+            continue;
+        }
+        INFO("kernel " << name);
+        // every class count around the vector widths, so each kernel ends on every possible remainder
+        for (size_t classes = 1; classes <= 90; ++classes) {
+            INFO(classes << " classes");
+            const std::vector<float> rows = makeRows(random, 200, classes, 0.2);
+            yolo::Candidates candidates;
+            yolo::decode(rows.data(), 200, 5 + classes, 0.5f, candidates, kernel);
+            REQUIRE(same(candidates, reference(rows, classes, 0.5f)));
+        }
+    }
+
+    SECTION("Candidates are appended and cleared without giving up their buffers") {
+        const std::vector<float> rows = makeRows(random, 100, 80, 1.0);
+        yolo::Candidates candidates;
+        candidates.reserve(200);
+        yolo::decode(rows.data(), 50, 85, 0.5f, candidates);
+        yolo::decode(rows.data() + 50 * 85, 50, 85, 0.5f, candidates);
+        CHECK(same(candidates, reference(rows, 80, 0.5f)));
+        const float *buffer = candidates.score.data();
+        candidates.clear();
+        CHECK(candidates.size() == 0);
+        yolo::decode(rows.data(), 100, 85, 0.5f, candidates);
+        CHECK(candidates.score.data() == buffer);
+    }
+}
+
+TEST_CASE("YOLO decode of target classes scores only those", "[yolo]") {
+    std::mt19937 random(24);
+    const std::vector<float> rows = makeRows(random, 500, 80, 0.3);
+    for (const std::vector<int> &targets: {std::vector<int>{39}, std::vector<int>{0, 39, 79}, std::vector<int>{5, 2}}) {
+        yolo::Candidates candidates;
+        yolo::decode(rows.data(), 500, 85, 0.5f, targets, candidates);
+        REQUIRE(same(candidates, reference(rows, 80, 0.5f, targets)));
+        for (int classId: candidates.classId) {
+            CHECK(std::find(targets.begin(), targets.end(), classId) != targets.end());
+        }
+    }
+
+    // without targets there is nothing to find
+    yolo::Candidates candidates;
+    yolo::decode(rows.data(), 500, 85, 0.5f, std::vector<int>{}, candidates);
+    CHECK(candidates.size() == 0);
+}
+
+TEST_CASE("YOLO decode: one 416x416 frame", "[.][benchmark]") {
+    // the rows of yolov4-tiny's two output layers at 416x416, 80 classes, a few objects
+    std::mt19937 random(23);
+    const std::vector<float> rows = makeRows(random, 13 * 13 * 3 + 26 * 26 * 3, 80, 0.01);
+    const size_t count = rows.size() / 85;
+    yolo::Candidates candidates;
+    candidates.reserve(count);
+
+    BENCHMARK("full scan, scalar") {
+        return reference(rows, 80, 0.5f).size();
+    };
+    for (const auto &[kernel, name]: kernels) {
+        if (yolo::kernelSupported(kernel)) {
+            BENCHMARK(std::string("objectness first, ") + name) {
+                candidates.clear();
+                yolo::decode(rows.data(), count, 85, 0.5f, candidates, kernel);
+                return candidates.size();
+            };
+        }
+    }
+}